@@ -1,21 +1,72 @@
+#pragma once
 #include "arg_parse.h"
 #include "Bench.h"
+#include "file_stream.h"
+#include "launch_queue.h"
 
 class Aes : public Bench
 {
     const int size = 1073741824 / 2;
     void *src;
     void *dest;
+    uint64_t jobs;
+    const uint32_t key[4] = {1, 2, 3, 4};
+
+    // -d streams the file through windows instead
+    const uint64_t window_bytes = 64 << 20;
+    const uint64_t num_windows = 4;
+    const char *input_path;
+    const char *output_path;
+    FileStream *stream = nullptr;
+    int output_fd = -1;
+    std::atomic<uint64_t> stream_sum;
 
 public:
-    Aes(ArgParse argparse) : Bench(argparse) {}
+    Aes(ArgParse argparse) : Aes(argparse, argparse.getAppId()) {}
+    Aes(ArgParse argparse, uint64_t app_id) : Bench(argparse, app_id), jobs(argparse.getJobs()), input_path(argparse.getInputPath()), output_path(argparse.getOutputPath()), stream_sum(0) {}
+
+    virtual ~Aes()
+    {
+        delete stream;
+        if (output_fd >= 0)
+            close(output_fd);
+    }
 
     virtual void setup()
     {
+        if (input_path != nullptr)
+        {
+            if (mode == FSRF::MODE::CPU || check)
+            {
+                std::cerr << "-d streams need a device mode and can't be checked\n";
+                exit(1);
+            }
+            // ECB over 64 byte words, the last one zero padded
+            struct stat st;
+            if (stat(input_path, &st) != 0)
+            {
+                std::cerr << "could not open " << input_path << "\n";
+                exit(1);
+            }
+            std::vector<uint8_t> tail((64 - st.st_size % 64) % 64, 0);
+            stream = new FileStream(fsrf, mode, input_path, tail, window_bytes, num_windows, true);
+            if (output_path != nullptr)
+            {
+                output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (output_fd < 0)
+                {
+                    std::cerr << "could not open " << output_path << "\n";
+                    exit(1);
+                }
+            }
+            return;
+        }
+
         switch (mode)
         {
         case FSRF::MODE::INV_READ:
         case FSRF::MODE::INV_WRITE:
+        case FSRF::MODE::CPU:
             src = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
             dest = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
             break;
@@ -39,49 +90,51 @@ public:
         }
     }
 
+    // -j jobs each encrypt a slice, queued so the kernel restarts as soon
+    // as the previous slice is done
     virtual void wait_for_fpga()
     {
-        if (mode == FSRF::MODE::MMAP)
-            fsrf->sync_host_to_device(src);
-
-        fsrf->cntrlreg_write(0x00, 1);
-        fsrf->cntrlreg_write(0x08, 2);
-        fsrf->cntrlreg_write(0x10, 3);
-        fsrf->cntrlreg_write(0x18, 4);
-
-        fsrf->cntrlreg_write(0x20, (uint64_t)src);  // where to read from
-        fsrf->cntrlreg_write(0x28, (uint64_t)dest); // where to write to
-        fsrf->cntrlreg_write(0x38, 8);              // read credits
-        fsrf->cntrlreg_write(0x40, 8);              // write credits
-
-        // write this last because it starts the app
-        fsrf->cntrlreg_write(0x30, size / 64); // num words
-
-        uint64_t val = 1;
-        while (val != 0)
+        if (stream != nullptr)
         {
-            val = fsrf->cntrlreg_read(0x38);
+            stream->run([this](const FileStream::Window &window)
+                        { return job((uint64_t)window.in, (uint64_t)window.out, window.bytes / 64); },
+                        [this](const FileStream::Window &window)
+                        { consume(window); });
+            return;
+        }
+        if (mode == FSRF::MODE::CPU)
+        {
+            cpu::Aes(key).encrypt(src, dest, size / 64);
+            return;
         }
 
-        uint64_t num_credits = 1;
-
-        while (num_credits)
+        LaunchQueue<Runtime> queue(fsrf, mode);
+        std::vector<std::future<void>> done;
+        uint64_t words = size / 64;
+        for (uint64_t i = 0; i < jobs; ++i)
         {
-            num_credits = fsrf->get_num_credits();
-            // std::cout << "Waiting " << num_credits << "\n";
+            uint64_t first = words * i / jobs;
+            uint64_t count = words * (i + 1) / jobs - first;
+            done.push_back(queue.submit(job((uint64_t)src + first * 64, (uint64_t)dest + first * 64, count)));
         }
+        for (std::future<void> &launch : done)
+            launch.wait();
     }
 
     virtual void copy_back_output()
     {
+        if (stream != nullptr)
+        {
+            if (verbose)
+                std::cout << "out sum: " << stream_sum << "\n";
+            std::cout << "STREAM_GBPS, " << stream->gbps() << "\n";
+            return;
+        }
 
         uint64_t *output = (uint64_t *)dest;
         uint64_t output_sum = 0;
 
-        if (mode == FSRF::MODE::MMAP)
-        {
-            fsrf->sync_device_to_host(output);
-        }
+        // MMAP outputs were synced back as each job finished
 
         for (uint64_t i = 0; i < size / sizeof(uint64_t); i += 0x1000 / sizeof(uint64_t))
         {
@@ -91,8 +144,52 @@ public:
             std::cout << "out sum: " << output_sum << "\n";
 
         // assert(output_sum == 8785770774558841555);
-        assert(output_sum == 7075813084211175919);
+        assert(simulated || mode == FSRF::MODE::CPU || output_sum == 7075813084211175919);
+
+        if (check && mode != FSRF::MODE::CPU)
+        {
+            void *expected = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            cpu::Aes(key).encrypt(src, expected, size / 64);
+            check_result(memcmp(expected, dest, size) == 0);
+            munmap(expected, size);
+        }
 
         return;
     }
+
+private:
+    KernelJob job(uint64_t job_src, uint64_t job_dest, uint64_t words)
+    {
+        KernelJob job;
+        job.regs = {
+            {0x00, key[0]},
+            {0x08, key[1]},
+            {0x10, key[2]},
+            {0x18, key[3]},
+            {0x20, job_src},  // where to read from
+            {0x28, job_dest}, // where to write to
+            {0x38, 8},        // read credits
+            {0x40, 8},        // write credits
+            {0x30, words},    // num words, starts the app
+        };
+        job.done_addr = 0x38; // words left
+        job.done_value = 0;
+        job.inputs = {{(void *)job_src, words * 64}};
+        job.outputs = {{(void *)job_dest, words * 64}};
+        return job;
+    }
+
+    // Same page sampled sum as the in memory run, then the ciphertext out
+    void consume(const FileStream::Window &window)
+    {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < window.bytes; i += 0x1000)
+            sum += *(uint64_t *)(window.out + i);
+        stream_sum += sum;
+        if (output_fd >= 0 && pwrite(output_fd, window.out, window.bytes, window.offset) != (ssize_t)window.bytes)
+        {
+            std::cerr << "could not write the output\n";
+            exit(1);
+        }
+    }
 };
@@ -1,24 +1,38 @@
 #pragma once
 #include "arg_parse.h"
+#include "cpu_kernels.h"
 #include "fsrf.h"
 
+#ifdef FSRF_DAEMON
+// apps connect to the fault handling daemon instead of owning the device
+#include "fsrf_client.h"
+typedef FSRFClient Runtime;
+#else
+typedef FSRF Runtime;
+#endif
+
 class Bench
 {
 protected:
-    FSRF *fsrf = nullptr;
+    Runtime *fsrf = nullptr;
     FSRF::MODE mode;
     int verbose;
     uint64_t app_id;
     int batch_size;
+    bool check;
 
 public:
-    Bench(ArgParse argparse) : mode(FSRF::MODE::NONE), verbose(false), app_id(~0L)
+    Bench(ArgParse argparse) : Bench(argparse, argparse.getAppId()) {}
+
+    Bench(ArgParse argparse, uint64_t app_id) : mode(FSRF::MODE::NONE), verbose(false), app_id(app_id)
     {
         mode = argparse.getMode();
         verbose = argparse.getVerbose();
-        app_id = argparse.getAppId();
         batch_size = argparse.getBatchSize();
-        fsrf = new FSRF(app_id, mode, verbose, batch_size);
+        check = argparse.getCheck();
+        // -m cpu runs the cpu engine on host memory alone
+        if (mode != FSRF::MODE::CPU)
+            fsrf = new Runtime(app_id, mode, verbose, batch_size);
     }
 
     virtual ~Bench()
@@ -29,4 +43,13 @@ public:
     virtual void setup() = 0;
     virtual void wait_for_fpga() = 0;
     virtual void copy_back_output() = 0;
+
+protected:
+    // -c: full comparison of the device output with the cpu engine
+    void check_result(bool matches)
+    {
+        std::cout << "CHECK, " << (matches ? "pass" : "FAIL") << "\n";
+        if (!matches)
+            exit(1);
+    }
 };
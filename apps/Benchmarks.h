@@ -0,0 +1,30 @@
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+
+#include "Aes.h"
+#include "Bench.h"
+#include "Md5.h"
+#include "Nw.h"
+#include "Pagerank.h"
+
+// Returns nullptr for an unknown benchmark name
+inline Bench *make_bench(ArgParse &argparse, uint64_t app_id)
+{
+    const char *benchmarkNames[] = {"aes", "md5", "nw", "pagerank"};
+
+#ifdef SIM
+    // stands in for loading the benchmark's image onto the card
+    setenv("FSRF_SIM_IMAGE", argparse.getBenchmarkName(), 0);
+#endif
+
+    if (strcmp(argparse.getBenchmarkName(), benchmarkNames[0]) == 0)
+        return new Aes(argparse, app_id);
+    if (strcmp(argparse.getBenchmarkName(), benchmarkNames[1]) == 0)
+        return new Md5(argparse, app_id);
+    if (strcmp(argparse.getBenchmarkName(), benchmarkNames[2]) == 0)
+        return new Nw(argparse, app_id);
+    if (strcmp(argparse.getBenchmarkName(), benchmarkNames[3]) == 0)
+        return new Pagerank(argparse, app_id);
+    return nullptr;
+}
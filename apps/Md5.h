@@ -1,20 +1,63 @@
+#pragma once
+#include <iomanip>
 #include "arg_parse.h"
 #include "Bench.h"
+#include "file_stream.h"
 
 class Md5 : public Bench
 {
     const uint64_t size = 1073741824;
     void *buf;
 
+    // -d streams the file through windows instead, chaining the digest
+    const uint64_t window_bytes = 64 << 20;
+    const uint64_t num_windows = 4;
+    const char *input_path;
+    FileStream *stream = nullptr;
+
+    // -m cpu has no registers to read the digest back from
+    cpu::Md5 host;
+
 public:
-    Md5(ArgParse argparse) : Bench(argparse) {}
+    Md5(ArgParse argparse) : Md5(argparse, argparse.getAppId()) {}
+    Md5(ArgParse argparse, uint64_t app_id) : Bench(argparse, app_id), input_path(argparse.getInputPath()) {}
+
+    virtual ~Md5()
+    {
+        delete stream;
+    }
 
     virtual void setup()
     {
+        if (input_path != nullptr)
+        {
+            if (mode == FSRF::MODE::CPU || check)
+            {
+                std::cerr << "-d streams need a device mode and can't be checked\n";
+                exit(1);
+            }
+            // chaining the digest across windows (0x30) is sim only, the
+            // F1 image always starts from the initial state
+            if (!simulated)
+            {
+                std::cerr << "-d streams need a kernel that chains digests, only the simulator has one\n";
+                exit(1);
+            }
+            struct stat st;
+            if (stat(input_path, &st) != 0)
+            {
+                std::cerr << "could not open " << input_path << "\n";
+                exit(1);
+            }
+            stream = new FileStream(fsrf, mode, input_path, padding(st.st_size), window_bytes, num_windows, false);
+            return;
+        }
+
         switch (mode)
         {
         case FSRF::MODE::INV_READ:
         case FSRF::MODE::INV_WRITE:
+        case FSRF::MODE::CPU:
             buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
             break;
         case FSRF::MODE::MMAP:
@@ -35,6 +78,33 @@ public:
 
     virtual void wait_for_fpga()
     {
+        if (stream != nullptr)
+        {
+            // every window after the first continues the previous digest
+            stream->run([](const FileStream::Window &window)
+                        {
+                            KernelJob job;
+                            job.regs = {
+                                {0x10, (uint64_t)window.in}, // src_addr
+                                {0x18, 8},                   // rd_credits
+                                {0x30, window.index != 0},   // chain
+                                {0x20, window.bytes / 64},   // num 64 byte words
+                            };
+                            job.done_addr = 0x28; // words done
+                            job.done_value = window.bytes / 64;
+                            job.drain_credits = false;
+                            job.inputs = {{(void *)window.in, window.bytes}};
+                            return job;
+                        },
+                        [](const FileStream::Window &) {});
+            return;
+        }
+
+        if (mode == FSRF::MODE::CPU)
+        {
+            host.update(buf, size / 64);
+            return;
+        }
         if (mode == FSRF::MODE::MMAP)
             fsrf->sync_host_to_device(buf);
 
@@ -42,23 +112,58 @@ public:
         fsrf->cntrlreg_write(0x18, 8);             // rd_credits
         fsrf->cntrlreg_write(0x20, size / 64);     // num 64 byte words
 
-        uint64_t val = 0;
-        while (val != size / 64)
-        {
-            val = fsrf->cntrlreg_read(0x28);
-        }
+        fsrf->wait_reg(0x28, ~0ull, size / 64); // words done
     }
 
     virtual void copy_back_output()
     {
-        uint64_t ab = fsrf->cntrlreg_read(0x0);
-        assert(ab == 5116089179561787392);
-        uint64_t cd = fsrf->cntrlreg_read(0x8);
-        assert(cd == 1945555042127839232);
+        if (stream != nullptr)
+        {
+            uint64_t ab = fsrf->cntrlreg_read(0x0);
+            uint64_t cd = fsrf->cntrlreg_read(0x8);
+            if (verbose)
+            {
+                // the digest is the state words, little endian
+                uint32_t state[4] = {(uint32_t)(ab >> 32), (uint32_t)ab, (uint32_t)(cd >> 32), (uint32_t)cd};
+                const uint8_t *bytes = (const uint8_t *)state;
+                std::cout << "md5: " << std::hex << std::setfill('0');
+                for (int i = 0; i < 16; ++i)
+                    std::cout << std::setw(2) << (int)bytes[i];
+                std::cout << std::dec << "\n";
+            }
+            std::cout << "STREAM_GBPS, " << stream->gbps() << "\n";
+            return;
+        }
+
+        bool on_cpu = mode == FSRF::MODE::CPU;
+        uint64_t ab = on_cpu ? host.ab() : fsrf->cntrlreg_read(0x0);
+        assert(simulated || on_cpu || ab == 5116089179561787392);
+        uint64_t cd = on_cpu ? host.cd() : fsrf->cntrlreg_read(0x8);
+        assert(simulated || on_cpu || cd == 1945555042127839232);
         if (verbose)
         {
             std::cout << "ab: " << ab << "\n";
             std::cout << "cd: " << cd << "\n";
         }
+
+        if (check && !on_cpu)
+        {
+            cpu::Md5 expected;
+            expected.update(buf, size / 64);
+            check_result(expected.ab() == ab && expected.cd() == cd);
+        }
+    }
+
+private:
+    // 0x80, zeros up to 56 mod 64, then the message length in bits
+    static std::vector<uint8_t> padding(uint64_t length)
+    {
+        std::vector<uint8_t> tail(1, 0x80);
+        while ((length + tail.size()) % 64 != 56)
+            tail.push_back(0);
+        uint64_t bits = length * 8;
+        for (int i = 0; i < 8; ++i)
+            tail.push_back(bits >> (8 * i));
+        return tail;
     }
 };
@@ -1,3 +1,4 @@
+#pragma once
 #include "arg_parse.h"
 #include "Bench.h"
 
@@ -31,6 +32,10 @@ public:
     {
     }
 
+    Nw(ArgParse argparse, uint64_t app_id) : Bench(argparse, app_id)
+    {
+    }
+
     virtual void setup()
     {
         s0_words = 1 << length0;
@@ -117,10 +122,18 @@ public:
 
     virtual void wait_for_fpga()
     {
+        if (mode == FSRF::MODE::CPU)
+        {
+            int8_t *scores = (int8_t *)sc_addr;
+            cpu::nw((const void *)s0_addr, s0_words * s_ratio, (const void *)s1_addr, s1_words * s_ratio, sc_count,
+                    [scores](uint64_t cell, const int8_t *row, uint64_t count)
+                    { memcpy(scores + cell, row, count); });
+            return;
+        }
         if (mode == FSRF::MODE::MMAP)
         {
-            frsf->sync_host_to_device(s0_addr);
-            frsf->sync_host_to_device(s1_addr);
+            fsrf->sync_host_to_device((void *)s0_addr);
+            fsrf->sync_host_to_device((void *)s1_addr);
         }
         fsrf->cntrlreg_write(0x00, s0_addr);
         fsrf->cntrlreg_write(0x08, s0_words);
@@ -131,18 +144,8 @@ public:
         fsrf->cntrlreg_write(0x30, sc_addr);
         fsrf->cntrlreg_write(0x38, sc_words);
 
-        uint64_t val = 1;
-        while (val != 0)
-        {
-            val = fsrf->cntrlreg_read(0x48);
-        }
-        uint64_t num_credits = 1;
-
-        while (num_credits)
-        {
-            num_credits = fsrf->get_num_credits();
-            // std::cout << "Waiting " << num_credits << "\n";
-        }
+        fsrf->wait_reg(0x48, ~0ull, 0); // busy
+        fsrf->wait_credits_drained();
     }
 
     virtual void copy_back_output()
@@ -161,5 +164,18 @@ public:
         }
         if (verbose)
             std::cout << "out sum: " << output_sum << "\n";
+
+        if (check && mode != FSRF::MODE::CPU)
+        {
+            const int8_t *scores = (const int8_t *)sc_addr;
+            std::atomic<bool> matches(true);
+            cpu::nw((const void *)s0_addr, s0_words * s_ratio, (const void *)s1_addr, s1_words * s_ratio, sc_count,
+                    [&](uint64_t cell, const int8_t *row, uint64_t count)
+                    {
+                        if (memcmp(scores + cell, row, count) != 0)
+                            matches = false;
+                    });
+            check_result(matches);
+        }
     }
 };
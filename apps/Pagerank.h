@@ -1,69 +1,108 @@
+#pragma once
 #include "arg_parse.h"
 #include "Bench.h"
+#include "load_file.h"
+#include "inputs/graph_format.h"
 
 class Pagerank : public Bench
 {
-    // uint64_t num_verts = 1000448;
-    // uint64_t num_edges = 3105792;
-    uint64_t num_verts = 68863488;
-    uint64_t num_edges = 143415296;
+    // mawi_201512020030 as converted by inputs/get_inputs.sh, the golden
+    // output sum below is for this graph
+    const char *default_input = "/home/centos/fsrf/inputs/mawi_201512020030/mawi_201512020030.bin";
+    std::string input_path;
+    const char *output_path; // -o, a file for the final ranks
+    const char *dataset;     // -k, cache name of the graph on the device
+
+    // from the input's graph_format::Header
+    uint64_t num_verts;
+    uint64_t num_edges;
     uint64_t vert_ptr;
     uint64_t edge_ptr;
     uint64_t input_ptr;
     uint64_t output_ptr;
     void *read_ptr;
     void *write_ptr;
+    void *scratch_ptr = nullptr; // second rank buffer when running several passes
+    uint64_t result_ptr;         // ranks of the last pass
+
+    // -p and -t: passes stop early once the sampled ranks change by less
+    // than tolerance, relatively, between two passes
+    uint64_t max_passes;
+    double tolerance;
+    uint64_t passes;
+    static const uint64_t sample_pages = 8;
+    std::vector<uint64_t> sample;
 
     uint64_t read_length, write_length;
 
 public:
-    Pagerank(ArgParse argparse) : Bench(argparse) {}
+    Pagerank(ArgParse argparse) : Pagerank(argparse, argparse.getAppId()) {}
+    Pagerank(ArgParse argparse, uint64_t app_id) : Bench(argparse, app_id)
+    {
+        input_path = argparse.getInputPath() != nullptr ? argparse.getInputPath() : default_input;
+        output_path = argparse.getOutputPath();
+        dataset = argparse.getDataset();
+        max_passes = argparse.getPasses();
+        tolerance = argparse.getTolerance();
+    }
 
     virtual void setup()
     {
-        read_length = num_verts * (16 + 8) + num_edges * 8;
-        write_length = num_verts * 8;
+        int fd = open(input_path.c_str(), O_RDWR | O_LARGEFILE);
+        if (fd == -1)
+        {
+            std::cerr << "can't open graph " << input_path << ": " << strerror(errno) << "\n";
+            exit(1);
+        }
 
-        // int fd = open("/home/centos/fsrf/inputs/webbase-1M/webbase-1M.bin", O_RDWR);
-        int fd = open("/home/centos/fsrf/inputs/mawi_201512020030/mawi_201512020030.bin", O_RDWR | O_LARGEFILE);
-        assert(fd != -1);
+        graph_format::Header header;
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || !graph_format::valid(header))
+        {
+            std::cerr << input_path << " is not a graph from inputs/matrix2graph\n";
+            exit(1);
+        }
+        num_verts = header.verts;
+        num_edges = header.edges;
 
-        if (mode == FSRF::MODE::INV_READ || mode == FSRF::MODE::INV_WRITE)
+        // vertices, edges and source ranks; destination ranks aren't read
+        read_length = header.dst_rank_offset - header.vert_offset;
+        write_length = num_verts * 8;
+
+        if (dataset != nullptr && mode != FSRF::MODE::CPU)
+        {
+            // stays on the device for the next run with the same graph
+            bool attached;
+            read_ptr = fsrf->fsrf_mmap_cached(dataset, input_path.c_str(), header.vert_offset, read_length, &attached);
+            if (verbose)
+                std::cout << "dataset " << dataset << ": " << (attached ? "attached" : "loaded") << "\n";
+        }
+        else if (mode == FSRF::MODE::INV_READ || mode == FSRF::MODE::INV_WRITE)
+        {
+            read_ptr = mmap(0, read_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, header.vert_offset);
+        }
+        else if (mode == FSRF::MODE::MMAP || mode == FSRF::MODE::MANAGED)
         {
-            read_ptr = mmap(0, read_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
-            // limitation - transparent version doesn't know when to copy back to host
-            // to save changes to file
-            // write_ptr = mmap(0, write_length, PROT_WRITE, MAP_PRIVATE, fd, read_length);
-            write_ptr = mmap(0, write_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            // the device reads the graph straight from the file
+            read_ptr = fsrf->fsrf_mmap(input_path.c_str(), header.vert_offset, read_length, PROT_READ | PROT_WRITE, PROT_READ);
         }
         else
         {
-            if (mode == FSRF::MODE::MMAP)
-                read_ptr = fsrf->fsrf_malloc(read_length, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE);
-            else
-                read_ptr = fsrf->fsrf_malloc_managed(read_length, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE);
-            uint64_t length = 0;
-
-            while (length != read_length)
-            {
-                length += read(fd, (void *)((uint64_t)read_ptr + length), read_length - length);
-                std::cout << "len: " << length << "\n";
-            }
-            if (length != read_length)
+            read_ptr = allocate(read_length);
+            if (!parallel_pread(fd, read_ptr, read_length, header.vert_offset))
             {
-                std::cerr << "Intended length: " << length << ", desired length " << read_length << "\n";
-                std::cerr << "Problem reading\n";
+                std::cerr << "Problem reading " << input_path << "\n";
                 exit(1);
             }
-
-            if (mode == FSRF::MODE::MMAP)
-                write_ptr = fsrf->fsrf_malloc(write_length, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE);
-            else
-                write_ptr = fsrf->fsrf_malloc_managed(write_length, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE);
         }
+        close(fd);
+
+        write_ptr = output_path != nullptr ? map_output() : allocate(write_length);
+        if (max_passes > 1)
+            scratch_ptr = allocate(write_length);
 
         assert(read_ptr != MAP_FAILED);
         assert(write_ptr != MAP_FAILED);
+        assert(scratch_ptr != MAP_FAILED);
 
         vert_ptr = (uint64_t)read_ptr;
         edge_ptr = vert_ptr + num_verts * 16;
@@ -71,34 +110,43 @@ public:
         output_ptr = (uint64_t)write_ptr;
     }
 
+    // Pass one reads the source ranks of the input, later passes ping-pong
+    // between the output and scratch buffers on the device; the input's
+    // ranks are never overwritten. Between passes only a few sampled pages
+    // come back to the host.
     virtual void wait_for_fpga()
     {
-        if (mode == FSRF::MODE::MMAP)
-            fsrf->sync_host_to_device(read_ptr);
-        fsrf->cntrlreg_write(0x20, num_verts);
-        fsrf->cntrlreg_write(0x30, num_edges);
-        fsrf->cntrlreg_write(0x40, vert_ptr);
-        fsrf->cntrlreg_write(0x50, edge_ptr);
-        fsrf->cntrlreg_write(0x60, input_ptr);
-        fsrf->cntrlreg_write(0x70, output_ptr);
+        if (mode != FSRF::MODE::CPU)
+        {
+            fsrf->cntrlreg_write(0x20, num_verts);
+            fsrf->cntrlreg_write(0x30, num_edges);
+            fsrf->cntrlreg_write(0x40, vert_ptr);
+            fsrf->cntrlreg_write(0x50, edge_ptr);
+        }
 
-        fsrf->cntrlreg_write(0x00, 0x1);
-        bool done = false;
-        while (!done)
+        uint64_t src = input_ptr, dst = output_ptr;
+        sample.clear();
+        for (passes = 1;; ++passes)
         {
-            done = fsrf->cntrlreg_read(0x0) & 0x2;
+            run_pass(src, dst);
+            if (passes == max_passes || (tolerance > 0 && converged(dst)))
+                break;
+            src = dst;
+            dst = dst == output_ptr ? (uint64_t)scratch_ptr : output_ptr;
         }
-        fsrf->cntrlreg_write(0x00, 0x10);
+        result_ptr = dst;
+        if (verbose)
+            std::cout << "passes: " << passes << "\n";
     }
 
     virtual void copy_back_output()
     {
-        uint64_t *output = (uint64_t *)write_ptr;
+        uint64_t *output = (uint64_t *)result_ptr;
         uint64_t output_sum = 0;
 
         if (mode == FSRF::MODE::MMAP)
         {
-            fsrf->sync_device_to_host(output);
+            fsrf->sync_device_to_host(output, write_length);
         }
 
         else
@@ -109,7 +157,109 @@ public:
             }
             if (verbose)
                 std::cout << "out sum: " << output_sum << "\n";
-            assert(output_sum == 36028887531252117);
+            // golden value of a single pass
+            assert(simulated || mode == FSRF::MODE::CPU || input_path != default_input || passes != 1 || output_sum == 36028887531252117);
+        }
+
+        if (output_path != nullptr)
+            save_output();
+
+        if (check && mode != FSRF::MODE::CPU)
+        {
+            // the same number of passes, so an early stop is checked too
+            std::vector<uint64_t> expected(num_verts), scratch(num_verts);
+            const uint64_t *src = (const uint64_t *)input_ptr;
+            for (uint64_t pass = 0; pass < passes; ++pass)
+            {
+                cpu::pagerank((const uint64_t *)vert_ptr, (const uint64_t *)edge_ptr, src, scratch.data(), num_verts);
+                expected.swap(scratch);
+                src = expected.data();
+            }
+            check_result(memcmp(expected.data(), output, write_length) == 0);
+        }
+    }
+
+private:
+    void *allocate(uint64_t length)
+    {
+        if (mode == FSRF::MODE::MMAP)
+            return fsrf->fsrf_malloc(length, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE);
+        if (mode == FSRF::MODE::MANAGED)
+            return fsrf->fsrf_malloc_managed(length, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE);
+        return mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    // The output ranks as a file, which fsrf_msync writes straight from
+    // the device
+    void *map_output()
+    {
+        int fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || ftruncate(fd, write_length) != 0)
+        {
+            std::cerr << "can't create " << output_path << ": " << strerror(errno) << "\n";
+            exit(1);
+        }
+        void *ptr;
+        if (mode == FSRF::MODE::MMAP || mode == FSRF::MODE::MANAGED)
+            ptr = fsrf->fsrf_mmap(output_path, 0, write_length, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE);
+        else
+            ptr = mmap(0, write_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        return ptr;
+    }
+
+    void save_output()
+    {
+        // an even number of passes ends in the scratch buffer
+        if (result_ptr != output_ptr)
+        {
+            memcpy(write_ptr, (void *)result_ptr, write_length);
+            if (mode == FSRF::MODE::MMAP)
+                fsrf->sync_host_to_device(write_ptr);
+        }
+        if (mode == FSRF::MODE::MMAP || mode == FSRF::MODE::MANAGED)
+            fsrf->fsrf_msync(write_ptr);
+        else
+            msync(write_ptr, write_length, MS_SYNC);
+    }
+
+    void run_pass(uint64_t src, uint64_t dst)
+    {
+        if (mode == FSRF::MODE::CPU)
+        {
+            cpu::pagerank((const uint64_t *)vert_ptr, (const uint64_t *)edge_ptr, (const uint64_t *)src, (uint64_t *)dst, num_verts);
+            return;
+        }
+        fsrf->cntrlreg_write(0x60, src);
+        fsrf->cntrlreg_write(0x70, dst);
+
+        fsrf->cntrlreg_write(0x00, 0x1);
+        fsrf->wait_reg(0x0, 0x2, 0x2); // done
+        fsrf->cntrlreg_write(0x00, 0x10);
+    }
+
+    // Compares evenly spaced pages of ranks with the previous pass
+    bool converged(uint64_t ranks)
+    {
+        uint64_t pages = write_length / 0x1000;
+        std::vector<uint64_t> current;
+        for (uint64_t i = 0; i < sample_pages && i < pages; ++i)
+        {
+            uint64_t *page = (uint64_t *)(ranks + (i * pages / sample_pages) * 0x1000);
+            if (mode == FSRF::MODE::MMAP)
+                fsrf->sync_device_to_host(page, 0x1000);
+            current.insert(current.end(), page, page + 0x1000 / sizeof(uint64_t));
+        }
+
+        double max_change = sample.empty() ? 1 : 0;
+        for (uint64_t i = 0; i < sample.size(); ++i)
+        {
+            double diff = current[i] > sample[i] ? current[i] - sample[i] : sample[i] - current[i];
+            max_change = std::max(max_change, diff / std::max<uint64_t>(sample[i], 1));
         }
+        sample.swap(current);
+        if (verbose)
+            std::cout << "pass " << passes << " max sampled change: " << max_change << "\n";
+        return max_change < tolerance;
     }
 };
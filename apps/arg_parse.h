@@ -2,6 +2,9 @@
 #include <assert.h>
 #include <getopt.h>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
 #include "fsrf.h"
 
 class ArgParse
@@ -11,14 +14,34 @@ class ArgParse
     int batch_size;
     bool need_app_id;
     uint64_t app_id;
+    uint64_t num_apps;
     char *benchmark_name;
+    char *input_path;
+    char *output_path;
+    char *dataset;
+    // -m and -s take comma separated lists, swept by apps/main.cpp
+    std::vector<FSRF::MODE> modes;
+    std::vector<int> batch_sizes;
+    uint64_t warmup;
+    uint64_t iterations;
+    uint64_t passes;
+    double tolerance;
+    uint64_t jobs;
+    bool check;
+    std::string format;
 
 public:
-    ArgParse(int argc, char **argv, bool need_app_id = true) : mode(FSRF::MODE::NONE), verbose(false), batch_size(1), need_app_id(need_app_id), app_id(~0L), benchmark_name(nullptr)
+    ArgParse(int argc, char **argv, bool need_app_id = true) : mode(FSRF::MODE::NONE), verbose(false), batch_size(1), need_app_id(need_app_id), app_id(~0L), num_apps(max_apps), benchmark_name(nullptr), input_path(nullptr), output_path(nullptr), dataset(nullptr), warmup(0), iterations(1), passes(1), tolerance(0), jobs(1), check(false)
     {
         read_args(argc, argv);
     }
 
+    static const char *modeName(FSRF::MODE mode)
+    {
+        const char *names[] = {"inv_read", "inv_write", "mmap", "managed", "cpu"};
+        return mode == FSRF::MODE::NONE ? "none" : names[mode];
+    }
+
     FSRF::MODE getMode()
     {
         return mode;
@@ -38,22 +61,104 @@ public:
     int getBatchSize()
     {
         assert(mode == FSRF::MODE::MMAP || mode == FSRF::MODE::MANAGED || batch_size == 1);
-        assert(batch_size >= 1);
+        assert(batch_size == FSRF::BATCH_ADAPTIVE || batch_size >= 1);
         assert(batch_size <= 512);
 
         return batch_size;
     }
 
+    uint64_t getNumApps()
+    {
+        return num_apps;
+    }
+
     char *getBenchmarkName()
     {
         return benchmark_name;
     }
 
+    // -d, nullptr if the benchmark should use its default input. AES and
+    // MD5 stream a given file through the kernel.
+    char *getInputPath()
+    {
+        return input_path;
+    }
+
+    // -o, where streaming AES writes its ciphertext and Pagerank its final
+    // ranks, nullptr to drop them
+    char *getOutputPath()
+    {
+        return output_path;
+    }
+
+    // -k, name to keep Pagerank's graph on the device under between runs
+    char *getDataset()
+    {
+        return dataset;
+    }
+
+    std::vector<FSRF::MODE> getModes()
+    {
+        return modes;
+    }
+
+    std::vector<int> getBatchSizes()
+    {
+        return batch_sizes;
+    }
+
+    uint64_t getWarmup()
+    {
+        return warmup;
+    }
+
+    uint64_t getIterations()
+    {
+        return iterations;
+    }
+
+    // -p, Pagerank passes to run at most
+    uint64_t getPasses()
+    {
+        return passes;
+    }
+
+    // -t, stop Pagerank early once ranks change by less than this
+    double getTolerance()
+    {
+        return tolerance;
+    }
+
+    // -j, launches AES splits its input into, queued back to back
+    uint64_t getJobs()
+    {
+        return jobs;
+    }
+
+    // -c, compare the whole output with the cpu engine's
+    bool getCheck()
+    {
+        return check;
+    }
+
+    // "csv" or "json", empty if -f wasn't given
+    std::string getFormat()
+    {
+        return format;
+    }
+
+    // Pick one point of the -m/-s sweep for the benchmarks to run with
+    void select(FSRF::MODE mode, int batch_size)
+    {
+        this->mode = mode;
+        this->batch_size = batch_size;
+    }
+
 private:
     void read_args(int argc, char **argv)
     {
         int opt;
-        while ((opt = getopt(argc, argv, "a:b:m:s:v")) != -1)
+        while ((opt = getopt(argc, argv, "a:b:cd:f:i:j:k:m:n:o:p:s:t:vw:")) != -1)
         {
             switch (opt)
             {
@@ -66,31 +171,80 @@ private:
             case 'b':
                 benchmark_name = optarg;
                 break;
-            case 'm':
-                if (strcmp("inv_read", optarg) == 0)
-                {
-                    mode = FSRF::MODE::INV_READ;
-                }
-                else if (strcmp("inv_write", optarg) == 0)
-                {
-                    mode = FSRF::MODE::INV_WRITE;
-                }
-                else if (strcmp("mmap", optarg) == 0)
-                {
-                    mode = FSRF::MODE::MMAP;
-                }
-                else if (strcmp("managed", optarg) == 0)
+            case 'c':
+                check = true;
+                break;
+            case 'd':
+                input_path = optarg;
+                break;
+            case 'f':
+                format = optarg;
+                if (format != "csv" && format != "json")
                 {
-                    mode = FSRF::MODE::MANAGED;
+                    std::cerr << "Format (-f) must be one of [csv, json]\n";
+                    exit(1);
                 }
-                else
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'k':
+                dataset = optarg;
+                break;
+            case 'm':
+                modes.clear();
+                for (const std::string &name : split(optarg))
                 {
-                    printf("Unexpected mode!\n");
-                    exit(1);
+                    if (name == "inv_read")
+                    {
+                        modes.push_back(FSRF::MODE::INV_READ);
+                    }
+                    else if (name == "inv_write")
+                    {
+                        modes.push_back(FSRF::MODE::INV_WRITE);
+                    }
+                    else if (name == "mmap")
+                    {
+                        modes.push_back(FSRF::MODE::MMAP);
+                    }
+                    else if (name == "managed")
+                    {
+                        modes.push_back(FSRF::MODE::MANAGED);
+                    }
+                    else if (name == "cpu")
+                    {
+                        modes.push_back(FSRF::MODE::CPU);
+                    }
+                    else
+                    {
+                        printf("Unexpected mode!\n");
+                        exit(1);
+                    }
                 }
                 break;
+            case 'n':
+                num_apps = atoi(optarg);
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'p':
+                passes = atoi(optarg);
+                break;
             case 's':
-                batch_size = atoi(optarg);
+                batch_sizes.clear();
+                // auto lets MANAGED allocations tune their own batch
+                for (const std::string &size : split(optarg))
+                    batch_sizes.push_back(size == "auto" ? FSRF::BATCH_ADAPTIVE : atoi(size.c_str()));
+                break;
+            case 't':
+                tolerance = atof(optarg);
+                break;
+            case 'w':
+                warmup = atoi(optarg);
                 break;
             default:
                 printf("unknown option: %c\n", optopt);
@@ -102,9 +256,34 @@ private:
             std::cerr << "App id (-a) must be in range [0,3]\n";
             exit(1);
         }
+        if (num_apps < 1 || num_apps > max_apps)
+        {
+            std::cerr << "Number of apps (-n) must be in range [1,4]\n";
+            exit(1);
+        }
+        if (batch_sizes.empty())
+            batch_sizes.push_back(batch_size);
+        batch_size = batch_sizes[0];
+        if (!modes.empty())
+            mode = modes[0];
+        if (passes < 1)
+        {
+            std::cerr << "Passes (-p) must be at least 1\n";
+            exit(1);
+        }
+        if (jobs < 1)
+        {
+            std::cerr << "Jobs (-j) must be at least 1\n";
+            exit(1);
+        }
+        if (iterations < 1)
+        {
+            std::cerr << "Iterations (-i) must be at least 1\n";
+            exit(1);
+        }
         if (mode == FSRF::MODE::NONE)
         {
-            std::cerr << "Mode (-m) must be one of [inv_read, inv_write, mmap]\n";
+            std::cerr << "Mode (-m) must be one of [inv_read, inv_write, mmap, managed, cpu]\n";
             exit(1);
         }
         if (benchmark_name == nullptr)
@@ -113,4 +292,17 @@ private:
             exit(1);
         }
     }
+
+    static std::vector<std::string> split(const char *list)
+    {
+        std::vector<std::string> items;
+        std::stringstream stream(list);
+        std::string item;
+        while (std::getline(stream, item, ','))
+        {
+            if (!item.empty())
+                items.push_back(item);
+        }
+        return items;
+    }
 };
@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Per phase timing samples of every configuration a driver run swept,
+// summarized as CSV or JSON so runs of two runtime versions can be diffed.
+// When the sweep includes -m cpu, each configuration's mean is also given
+// as a speedup over the cpu engine's for the same benchmark and phase.
+class BenchReport
+{
+public:
+    enum PHASE
+    {
+        CONSTRUCT,
+        SETUP,
+        EXECUTE,
+        COPY_BACK,
+        E2E, // argument parsing through copy back, as in a single run
+
+        NUM_PHASES
+    };
+
+    struct Config
+    {
+        std::string benchmark;
+        std::string mode;
+        int batch_size;
+        std::vector<uint64_t> samples_us[NUM_PHASES];
+    };
+
+    void add(const Config &config)
+    {
+        configs.push_back(config);
+    }
+
+    void write_csv(std::ostream &out) const
+    {
+        out << std::fixed << std::setprecision(1);
+        out << "benchmark,mode,batch_size,phase,iterations,mean_us,stddev_us,min_us,p50_us,p90_us,p99_us,max_us,speedup_vs_cpu\n";
+        for (const Config &config : configs)
+        {
+            for (int phase = 0; phase < NUM_PHASES; ++phase)
+            {
+                Summary s = summarize(config.samples_us[phase]);
+                out << config.benchmark << "," << config.mode << "," << batch_name(config.batch_size) << ","
+                    << phase_names[phase] << "," << s.count << "," << s.mean << "," << s.stddev << ","
+                    << s.min << "," << s.p50 << "," << s.p90 << "," << s.p99 << "," << s.max << ",";
+                double speedup = speedup_vs_cpu(config, phase, s);
+                if (speedup > 0)
+                    out << std::setprecision(3) << speedup << std::setprecision(1);
+                out << "\n";
+            }
+        }
+    }
+
+    void write_json(std::ostream &out) const
+    {
+        out << std::fixed << std::setprecision(1);
+        out << "[\n";
+        for (size_t i = 0; i < configs.size(); ++i)
+        {
+            const Config &config = configs[i];
+            out << "  {\"benchmark\": \"" << config.benchmark << "\", \"mode\": \"" << config.mode
+                << "\", \"batch_size\": " << (config.batch_size < 0 ? "\"auto\"" : batch_name(config.batch_size))
+                << ", \"phases\": {\n";
+            for (int phase = 0; phase < NUM_PHASES; ++phase)
+            {
+                Summary s = summarize(config.samples_us[phase]);
+                out << "    \"" << phase_names[phase] << "\": {\"iterations\": " << s.count
+                    << ", \"mean_us\": " << s.mean << ", \"stddev_us\": " << s.stddev
+                    << ", \"min_us\": " << s.min << ", \"p50_us\": " << s.p50 << ", \"p90_us\": " << s.p90
+                    << ", \"p99_us\": " << s.p99 << ", \"max_us\": " << s.max << ", \"speedup_vs_cpu\": ";
+                double speedup = speedup_vs_cpu(config, phase, s);
+                if (speedup > 0)
+                    out << std::setprecision(3) << speedup << std::setprecision(1);
+                else
+                    out << "null";
+                out << "}"
+                    << (phase + 1 < NUM_PHASES ? ",\n" : "\n");
+            }
+            out << "  }}" << (i + 1 < configs.size() ? ",\n" : "\n");
+        }
+        out << "]\n";
+    }
+
+private:
+    // -s auto is FSRF::BATCH_ADAPTIVE
+    static std::string batch_name(int batch_size)
+    {
+        return batch_size < 0 ? "auto" : std::to_string(batch_size);
+    }
+
+    struct Summary
+    {
+        uint64_t count = 0;
+        double mean = 0;
+        double stddev = 0;
+        uint64_t min = 0, p50 = 0, p90 = 0, p99 = 0, max = 0;
+    };
+
+    // nearest rank percentiles, sample standard deviation
+    static Summary summarize(std::vector<uint64_t> samples)
+    {
+        Summary s;
+        s.count = samples.size();
+        if (samples.empty())
+            return s;
+        std::sort(samples.begin(), samples.end());
+        for (uint64_t sample : samples)
+            s.mean += sample;
+        s.mean /= samples.size();
+        for (uint64_t sample : samples)
+            s.stddev += (sample - s.mean) * (sample - s.mean);
+        s.stddev = samples.size() > 1 ? std::sqrt(s.stddev / (samples.size() - 1)) : 0;
+        s.min = samples.front();
+        s.max = samples.back();
+        s.p50 = percentile(samples, 50);
+        s.p90 = percentile(samples, 90);
+        s.p99 = percentile(samples, 99);
+        return s;
+    }
+
+    // the cpu config's mean over this one's, 0 without a cpu run to compare
+    double speedup_vs_cpu(const Config &config, int phase, const Summary &s) const
+    {
+        for (const Config &cpu : configs)
+        {
+            if (cpu.benchmark != config.benchmark || cpu.mode != "cpu")
+                continue;
+            Summary baseline = summarize(cpu.samples_us[phase]);
+            return s.mean > 0 ? baseline.mean / s.mean : 0;
+        }
+        return 0;
+    }
+
+    static uint64_t percentile(const std::vector<uint64_t> &sorted, uint64_t p)
+    {
+        uint64_t rank = (p * sorted.size() + 99) / 100;
+        return sorted[std::max<uint64_t>(rank, 1) - 1];
+    }
+
+    const char *phase_names[NUM_PHASES] = {"construct", "setup", "execute", "copy_back", "e2e"};
+    std::vector<Config> configs;
+};
@@ -0,0 +1,299 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <immintrin.h>
+#include <iostream>
+#include <math.h>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Host implementations of the four kernels, the -m cpu baseline and the
+// reference -c checks device output against. Each computes what the
+// kernel's registers describe, bit for bit, on every core.
+namespace cpu
+{
+    inline uint64_t num_threads()
+    {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // body(first, last) over contiguous shares of [0, count)
+    inline void parallel_for(uint64_t count, std::function<void(uint64_t, uint64_t)> body)
+    {
+        uint64_t threads = std::min<uint64_t>(num_threads(), std::max<uint64_t>(count, 1));
+        std::vector<std::thread> workers;
+        for (uint64_t t = 0; t < threads; ++t)
+            workers.push_back(std::thread(body, count * t / threads, count * (t + 1) / threads));
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+
+    // AES-128 in ECB mode over 64 byte words with AES-NI, eight blocks in
+    // flight per core. The key is the low 32 bits of registers 0x00-0x18.
+    class Aes
+    {
+    public:
+        Aes(const uint32_t key_words[4])
+        {
+            if (!__builtin_cpu_supports("aes"))
+            {
+                std::cerr << "the cpu AES engine needs AES-NI\n";
+                exit(1);
+            }
+            expand(key_words);
+        }
+
+        void encrypt(const void *src, void *dest, uint64_t words) const
+        {
+            parallel_for(words * 4, [=](uint64_t first, uint64_t last)
+                         { encrypt_blocks((const __m128i *)src + first, (__m128i *)dest + first, last - first); });
+        }
+
+    private:
+        __m128i round_keys[11];
+
+        static __m128i expand_step(__m128i key, __m128i generated)
+        {
+            generated = _mm_shuffle_epi32(generated, 0xff);
+            key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+            key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+            key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+            return _mm_xor_si128(key, generated);
+        }
+
+        __attribute__((target("aes"))) void expand(const uint32_t key_words[4])
+        {
+            __m128i *rk = round_keys;
+            rk[0] = _mm_loadu_si128((const __m128i *)key_words);
+            rk[1] = expand_step(rk[0], _mm_aeskeygenassist_si128(rk[0], 0x01));
+            rk[2] = expand_step(rk[1], _mm_aeskeygenassist_si128(rk[1], 0x02));
+            rk[3] = expand_step(rk[2], _mm_aeskeygenassist_si128(rk[2], 0x04));
+            rk[4] = expand_step(rk[3], _mm_aeskeygenassist_si128(rk[3], 0x08));
+            rk[5] = expand_step(rk[4], _mm_aeskeygenassist_si128(rk[4], 0x10));
+            rk[6] = expand_step(rk[5], _mm_aeskeygenassist_si128(rk[5], 0x20));
+            rk[7] = expand_step(rk[6], _mm_aeskeygenassist_si128(rk[6], 0x40));
+            rk[8] = expand_step(rk[7], _mm_aeskeygenassist_si128(rk[7], 0x80));
+            rk[9] = expand_step(rk[8], _mm_aeskeygenassist_si128(rk[8], 0x1b));
+            rk[10] = expand_step(rk[9], _mm_aeskeygenassist_si128(rk[9], 0x36));
+        }
+
+        __attribute__((target("aes"))) void encrypt_blocks(const __m128i *src, __m128i *dest, uint64_t blocks) const
+        {
+            const uint64_t lanes = 8;
+            uint64_t i = 0;
+            for (; i + lanes <= blocks; i += lanes)
+            {
+                __m128i b[lanes];
+                for (uint64_t l = 0; l < lanes; ++l)
+                    b[l] = _mm_xor_si128(_mm_loadu_si128(src + i + l), round_keys[0]);
+                for (int round = 1; round < 10; ++round)
+                    for (uint64_t l = 0; l < lanes; ++l)
+                        b[l] = _mm_aesenc_si128(b[l], round_keys[round]);
+                for (uint64_t l = 0; l < lanes; ++l)
+                    _mm_storeu_si128(dest + i + l, _mm_aesenclast_si128(b[l], round_keys[10]));
+            }
+            for (; i < blocks; ++i)
+            {
+                __m128i b = _mm_xor_si128(_mm_loadu_si128(src + i), round_keys[0]);
+                for (int round = 1; round < 10; ++round)
+                    b = _mm_aesenc_si128(b, round_keys[round]);
+                _mm_storeu_si128(dest + i, _mm_aesenclast_si128(b, round_keys[10]));
+            }
+        }
+    };
+
+    // MD5 compression of raw 64 byte words, no padding, from the standard
+    // initial state or a previous digest. A single chain is serial, so this
+    // runs on one core like the kernel.
+    class Md5
+    {
+    public:
+        uint32_t state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+        void update(const void *src, uint64_t words)
+        {
+            const uint32_t *m = (const uint32_t *)src;
+            for (uint64_t word = 0; word < words; ++word)
+                compress(m + word * 16);
+        }
+
+        // as kernel registers 0x00 and 0x08 report it
+        uint64_t ab() const
+        {
+            return ((uint64_t)state[0] << 32) | state[1];
+        }
+
+        uint64_t cd() const
+        {
+            return ((uint64_t)state[2] << 32) | state[3];
+        }
+
+    private:
+        void compress(const uint32_t *m)
+        {
+            static const uint32_t shifts[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+            static const struct Table
+            {
+                uint32_t k[64];
+                uint8_t g[64];
+                Table()
+                {
+                    for (int i = 0; i < 64; ++i)
+                    {
+                        k[i] = (uint32_t)(uint64_t)(fabs(sin(i + 1.0)) * 4294967296.0);
+                        g[i] = i < 16 ? i : i < 32 ? (5 * i + 1) % 16 : i < 48 ? (3 * i + 5) % 16 : (7 * i) % 16;
+                    }
+                }
+            } table;
+
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            for (int i = 0; i < 64; ++i)
+            {
+                uint32_t f;
+                if (i < 16)
+                    f = d ^ (b & (c ^ d));
+                else if (i < 32)
+                    f = c ^ (d & (b ^ c));
+                else if (i < 48)
+                    f = b ^ c ^ d;
+                else
+                    f = c ^ (b | ~d);
+                uint32_t rotate = shifts[(i / 16) * 4 + i % 4];
+                uint32_t sum = a + f + table.k[i] + m[table.g[i]];
+                a = d;
+                d = c;
+                c = b;
+                b += (sum << rotate) | (sum >> (32 - rotate));
+            }
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+        }
+    };
+
+    // Needleman-Wunsch over 128 bit symbols: +1 match, -1 mismatch and gap,
+    // scores saturated to 8 bits, row major. The matrix is cut into tiles
+    // that cores take in anti-diagonal order, each waiting only on the tiles
+    // above and to its left. Symbols are interned first so a cell compares
+    // two integers. Scores go to sink(cell, scores, count) a tile row at a
+    // time, from any core; cells past the limit are not produced.
+    inline void nw(const void *s0, uint64_t rows, const void *s1, uint64_t cols, uint64_t cells,
+                   std::function<void(uint64_t, const int8_t *, uint64_t)> sink)
+    {
+        const uint64_t tile_rows = 64, tile_cols = 4096;
+        rows = cols == 0 ? 0 : std::min(rows, (cells + cols - 1) / cols);
+        if (rows == 0)
+            return;
+
+        std::unordered_map<std::string, uint32_t> ids;
+        auto intern = [&](const void *symbols, uint64_t count)
+        {
+            std::vector<uint32_t> out(count);
+            for (uint64_t i = 0; i < count; ++i)
+                out[i] = ids.insert(std::make_pair(std::string((const char *)symbols + i * 16, 16), (uint32_t)ids.size())).first->second;
+            return out;
+        };
+        std::vector<uint32_t> row_ids = intern(s0, rows), col_ids = intern(s1, cols);
+
+        uint64_t tiles_down = (rows + tile_rows - 1) / tile_rows;
+        uint64_t tiles_across = (cols + tile_cols - 1) / tile_cols;
+        // last row of the tile row above, last column of the tile to the
+        // left, and every finished tile's bottom right corner
+        std::vector<int32_t> bottom(cols), right(rows), corners(tiles_down * tiles_across);
+        for (uint64_t j = 0; j < cols; ++j)
+            bottom[j] = -(int32_t)(j + 1);
+        for (uint64_t i = 0; i < rows; ++i)
+            right[i] = -(int32_t)(i + 1);
+        std::unique_ptr<std::atomic<bool>[]> done(new std::atomic<bool>[tiles_down * tiles_across]);
+        for (uint64_t t = 0; t < tiles_down * tiles_across; ++t)
+            done[t] = false;
+
+        // tiles in anti-diagonal order
+        std::vector<std::pair<uint32_t, uint32_t>> order;
+        for (uint64_t d = 0; d < tiles_down + tiles_across - 1; ++d)
+            for (uint64_t ti = d < tiles_across ? 0 : d - tiles_across + 1; ti < tiles_down && ti <= d; ++ti)
+                order.push_back(std::make_pair(ti, d - ti));
+        std::atomic<uint64_t> next(0);
+
+        parallel_for(num_threads(), [&](uint64_t, uint64_t)
+                     {
+                         std::vector<int32_t> row;
+                         std::vector<int8_t> scores(tile_cols);
+                         uint64_t k;
+                         while ((k = next.fetch_add(1)) < order.size())
+                         {
+                             uint64_t ti = order[k].first, tj = order[k].second;
+                             if (ti > 0)
+                                 while (!done[(ti - 1) * tiles_across + tj])
+                                     std::this_thread::yield();
+                             if (tj > 0)
+                                 while (!done[ti * tiles_across + tj - 1])
+                                     std::this_thread::yield();
+
+                             uint64_t first_row = ti * tile_rows, last_row = std::min(rows, first_row + tile_rows);
+                             uint64_t first_col = tj * tile_cols, last_col = std::min(cols, first_col + tile_cols);
+                             // score above and left of the tile
+                             int32_t up_left = ti == 0 ? -(int32_t)first_col
+                                               : tj == 0 ? -(int32_t)first_row
+                                                         : corners[(ti - 1) * tiles_across + tj - 1];
+                             row.assign(bottom.begin() + first_col, bottom.begin() + last_col);
+                             for (uint64_t i = first_row; i < last_row; ++i)
+                             {
+                                 int32_t diag = up_left, left = right[i];
+                                 up_left = left;
+                                 uint32_t symbol = row_ids[i];
+                                 for (uint64_t j = first_col; j < last_col; ++j)
+                                 {
+                                     int32_t up = row[j - first_col];
+                                     int32_t score = std::max(diag + (symbol == col_ids[j] ? 1 : -1), std::max(up, left) - 1);
+                                     row[j - first_col] = score;
+                                     diag = up;
+                                     left = score;
+                                     scores[j - first_col] = (int8_t)std::max(-128, std::min(127, score));
+                                 }
+                                 right[i] = left;
+                                 uint64_t cell = i * cols + first_col;
+                                 if (cell < cells)
+                                     sink(cell, scores.data(), std::min(last_col - first_col, cells - cell));
+                             }
+                             std::copy(row.begin(), row.end(), bottom.begin() + first_col);
+                             corners[ti * tiles_across + tj] = row.back();
+                             done[ti * tiles_across + tj] = true;
+                         }
+                     });
+    }
+
+    // One pull based PageRank pass over the graph_format sections, the
+    // kernel's fixed point arithmetic. Each source's share is computed once
+    // per pass, then every core sums its vertices' in-edges.
+    inline void pagerank(const uint64_t *vertices, const uint64_t *edges, const uint64_t *src_ranks, uint64_t *dst_ranks, uint64_t verts)
+    {
+        std::vector<uint64_t> share(verts), edge_start(verts + 1, 0);
+        parallel_for(verts, [&](uint64_t first, uint64_t last)
+                     {
+                         for (uint64_t v = first; v < last; ++v)
+                             share[v] = src_ranks[v] / std::max<uint64_t>(vertices[2 * v + 1], 1);
+                     });
+        for (uint64_t v = 0; v < verts; ++v)
+            edge_start[v + 1] = edge_start[v] + vertices[2 * v];
+
+        const uint64_t base = verts == 0 ? 0 : (UINT64_MAX / verts) / 100 * 15;
+        parallel_for(verts, [&](uint64_t first, uint64_t last)
+                     {
+                         for (uint64_t v = first; v < last; ++v)
+                         {
+                             uint64_t sum = 0;
+                             for (uint64_t e = edge_start[v]; e < edge_start[v + 1]; ++e)
+                                 sum += share[edges[e]];
+                             dst_ranks[v] = base + sum / 100 * 85;
+                         }
+                     });
+    }
+}
@@ -0,0 +1,212 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "Bench.h"
+#include "launch_queue.h"
+#include "load_file.h"
+
+// Streams a file through a kernel one window at a time, for inputs larger
+// than the device's DRAM slice. A ring of windows overlaps four stages:
+// the caller reads the file into a free window and submits it to a
+// LaunchQueue, which syncs it to the device and launches it, and a
+// consumer thread takes the finished windows in stream order.
+class FileStream
+{
+public:
+    struct Window
+    {
+        uint64_t index;
+        uint64_t offset; // in the stream
+        uint64_t bytes;  // a multiple of 64
+        uint8_t *in;
+        uint8_t *out; // nullptr without outputs
+    };
+
+    // The stream is the file followed by tail, e.g. padding, and must be a
+    // multiple of 64 bytes long
+    FileStream(Runtime *fsrf, FSRF::MODE mode, const char *path, const std::vector<uint8_t> &tail,
+               uint64_t window_bytes, uint64_t num_windows, bool outputs)
+        : fsrf(fsrf), mode(mode), tail(tail), window_bytes(window_bytes)
+    {
+        fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            std::cerr << "could not open " << path << "\n";
+            exit(1);
+        }
+        file_length = st.st_size;
+        if (stream_bytes() % 64 != 0 || window_bytes % 64 != 0)
+        {
+            std::cerr << "stream windows must be a multiple of 64 bytes\n";
+            exit(1);
+        }
+
+        for (uint64_t i = 0; i < num_windows; ++i)
+        {
+            ins.push_back(allocate());
+            outs.push_back(outputs ? allocate() : nullptr);
+        }
+    }
+
+    ~FileStream()
+    {
+        close(fd);
+        // FSRF allocations live as long as the runtime
+        if (mode == FSRF::MODE::INV_READ || mode == FSRF::MODE::INV_WRITE)
+        {
+            for (uint64_t i = 0; i < ins.size(); ++i)
+            {
+                munmap(ins[i], window_bytes);
+                if (outs[i] != nullptr)
+                    munmap(outs[i], window_bytes);
+            }
+        }
+    }
+
+    uint64_t file_bytes() const
+    {
+        return file_length;
+    }
+
+    uint64_t stream_bytes() const
+    {
+        return file_length + tail.size();
+    }
+
+    // Sustained rate of the last run()
+    double gbps() const
+    {
+        return seconds > 0 ? stream_bytes() / seconds / 1e9 : 0;
+    }
+
+    // make_job builds the launch of a filled window. consume runs on the
+    // consumer thread once a window's outputs are on the host.
+    void run(std::function<KernelJob(const Window &)> make_job, std::function<void(const Window &)> consume)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint64_t num_windows = (stream_bytes() + window_bytes - 1) / window_bytes;
+        consumed = 0;
+
+        LaunchQueue<Runtime> queue(fsrf, mode);
+        std::deque<std::pair<Window, std::future<void>>> launched;
+        std::thread consumer([&]()
+                             {
+                                 for (uint64_t i = 0; i < num_windows; ++i)
+                                 {
+                                     std::unique_lock<std::mutex> guard(lock);
+                                     cv.wait(guard, [&]
+                                             { return !launched.empty(); });
+                                     Window window = launched.front().first;
+                                     std::future<void> done = std::move(launched.front().second);
+                                     launched.pop_front();
+                                     guard.unlock();
+
+                                     done.wait();
+                                     consume(window);
+
+                                     guard.lock();
+                                     ++consumed;
+                                     cv.notify_all();
+                                 }
+                             });
+
+        for (uint64_t i = 0; i < num_windows; ++i)
+        {
+            uint64_t slot = i % ins.size();
+            {
+                // the window's previous contents must be consumed
+                std::unique_lock<std::mutex> guard(lock);
+                cv.wait(guard, [&]
+                        { return consumed + ins.size() > i; });
+            }
+
+            Window window;
+            window.index = i;
+            window.offset = i * window_bytes;
+            window.bytes = std::min(window_bytes, stream_bytes() - window.offset);
+            window.in = ins[slot];
+            window.out = outs[slot];
+            fill(window);
+
+            std::future<void> done = queue.submit(make_job(window));
+            std::lock_guard<std::mutex> guard(lock);
+            launched.push_back(std::make_pair(window, std::move(done)));
+            cv.notify_all();
+        }
+        consumer.join();
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    uint8_t *allocate()
+    {
+        void *buf = MAP_FAILED;
+        switch (mode)
+        {
+        case FSRF::MODE::INV_READ:
+        case FSRF::MODE::INV_WRITE:
+            buf = mmap(NULL, window_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            break;
+        case FSRF::MODE::MMAP:
+            buf = fsrf->fsrf_malloc(window_bytes, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE);
+            break;
+        case FSRF::MODE::MANAGED:
+            buf = fsrf->fsrf_malloc_managed(window_bytes, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE);
+            break;
+        default:
+            std::cerr << "unexpected mode\n";
+            exit(1);
+        }
+        if (buf == MAP_FAILED)
+        {
+            std::cerr << "allocation failed\n";
+            exit(1);
+        }
+        return (uint8_t *)buf;
+    }
+
+    // File bytes of the window, then whatever part of the tail it covers
+    void fill(const Window &window)
+    {
+        uint64_t from_file = 0;
+        if (window.offset < file_length)
+            from_file = std::min(window.bytes, file_length - window.offset);
+        if (from_file != 0 && !parallel_pread(fd, window.in, from_file, window.offset))
+        {
+            std::cerr << "could not read the input\n";
+            exit(1);
+        }
+        if (from_file < window.bytes)
+            memcpy(window.in + from_file, tail.data() + (window.offset + from_file - file_length), window.bytes - from_file);
+    }
+
+    Runtime *fsrf;
+    FSRF::MODE mode;
+    int fd;
+    uint64_t file_length;
+    std::vector<uint8_t> tail;
+    uint64_t window_bytes;
+    std::vector<uint8_t *> ins;
+    std::vector<uint8_t *> outs;
+    double seconds = 0;
+
+    // consumed windows free their slot for the reader
+    std::mutex lock;
+    std::condition_variable cv;
+    uint64_t consumed;
+};
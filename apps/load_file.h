@@ -0,0 +1,45 @@
+#pragma once
+#include <algorithm>
+#include <errno.h>
+#include <stdint.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Read length bytes at offset of fd into buf with parallel pread()s, so a
+// large input loads at storage bandwidth. buf may be an FSRF allocation, it
+// is only touched from the host. False on a read error or a short file.
+inline bool parallel_pread(int fd, void *buf, uint64_t length, uint64_t offset)
+{
+    const uint64_t chunk = 64 << 20;
+    uint64_t num_threads = std::min<uint64_t>(std::max(1u, std::thread::hardware_concurrency()), 16);
+    num_threads = std::max<uint64_t>(1, std::min(num_threads, (length + chunk - 1) / chunk));
+
+    std::vector<std::thread> threads;
+    std::vector<char> failed(num_threads, false);
+    for (uint64_t t = 0; t < num_threads; ++t)
+    {
+        threads.push_back(std::thread([=, &failed]() {
+            // chunks are dealt round robin so every thread streams
+            for (uint64_t start = t * chunk; start < length; start += num_threads * chunk)
+            {
+                uint64_t end = std::min(length, start + chunk);
+                for (uint64_t pos = start; pos < end;)
+                {
+                    ssize_t n = pread(fd, (char *)buf + pos, end - pos, offset + pos);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                    {
+                        failed[t] = true;
+                        return;
+                    }
+                    pos += n;
+                }
+            }
+        }));
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    return std::find(failed.begin(), failed.end(), true) == failed.end();
+}
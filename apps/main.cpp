@@ -1,80 +1,102 @@
 #include <chrono>
 
-#include "Aes.h"
-#include "Bench.h"
-#include "Md5.h"
-#include "Nw.h"
-#include "Pagerank.h"
+#include "Benchmarks.h"
+#include "bench_report.h"
 
 using namespace std::chrono;
 
-int main(int argc, char *argv[])
+static uint64_t elapsed_us(high_resolution_clock::time_point start, high_resolution_clock::time_point end)
 {
+    return duration_cast<microseconds>(end - start).count();
+}
 
-    high_resolution_clock::time_point very_beginning, very_end;
+// One run of the benchmark from construction to teardown, the time of each
+// phase in us. E2E keeps the single run's boundaries: argument parsing,
+// done once and passed in, through copy back, without the teardown.
+static void run_once(ArgParse &argsparse, uint64_t parse_us, uint64_t phase_us[BenchReport::NUM_PHASES])
+{
+    high_resolution_clock::time_point very_beginning, start, end;
     very_beginning = high_resolution_clock::now();
 
-    high_resolution_clock::time_point start, end;
-
-    start = high_resolution_clock::now();
-    ArgParse argsparse(argc, argv);
-    Bench *bench;
-    end = high_resolution_clock::now();
-
     start = high_resolution_clock::now();
-    const char *benchmarkNames[] = {"aes", "md5", "nw", "pagerank"};
-
-    if (strcmp(argsparse.getBenchmarkName(), benchmarkNames[0]) == 0)
-    {
-        bench = new Aes(argsparse);
-    }
-    else if (strcmp(argsparse.getBenchmarkName(), benchmarkNames[1]) == 0)
-    {
-        bench = new Md5(argsparse);
-    }
-    else if (strcmp(argsparse.getBenchmarkName(), benchmarkNames[2]) == 0)
-    {
-        bench = new Nw(argsparse);
-    }
-    else if (strcmp(argsparse.getBenchmarkName(), benchmarkNames[3]) == 0)
-    {
-        bench = new Pagerank(argsparse);
-    }
-    else
+    Bench *bench = make_bench(argsparse, argsparse.getAppId());
+    if (bench == nullptr)
     {
         std::cerr << "unsupported benchmark name\n";
         exit(1);
     }
-
     end = high_resolution_clock::now();
-    // auto construct_fsrf_time = end - start;
+    phase_us[BenchReport::CONSTRUCT] = elapsed_us(start, end);
 
     start = high_resolution_clock::now();
     bench->setup();
     end = high_resolution_clock::now();
-    // auto setup_time = end - start;
+    phase_us[BenchReport::SETUP] = elapsed_us(start, end);
 
     start = high_resolution_clock::now();
     bench->wait_for_fpga();
     end = high_resolution_clock::now();
-    auto fpga_execution_time = end - start;
+    phase_us[BenchReport::EXECUTE] = elapsed_us(start, end);
 
     start = high_resolution_clock::now();
     bench->copy_back_output();
     end = high_resolution_clock::now();
-    // auto copy_back_time = end - start;
+    phase_us[BenchReport::COPY_BACK] = elapsed_us(start, end);
+    phase_us[BenchReport::E2E] = parse_us + elapsed_us(very_beginning, end);
+
+    delete bench;
+}
 
-    very_end = high_resolution_clock::now();
-    auto end_to_end_time = very_end - very_beginning;
+// Runs -w warmup and -i measured iterations of every -m mode and -s batch
+// size. A single plain run keeps the original two line output.
+int main(int argc, char *argv[])
+{
+    high_resolution_clock::time_point start = high_resolution_clock::now();
+    ArgParse argsparse(argc, argv);
+    uint64_t parse_us = elapsed_us(start, high_resolution_clock::now());
+    BenchReport report;
 
-    std::cout << "FPGA_EXECUTION, " << fpga_execution_time.count() * microseconds::period::num / microseconds::period::den << "\n";
-    std::cout << "E2E, " << end_to_end_time.count() * microseconds::period::num / microseconds::period::den << "\n";
+    std::vector<FSRF::MODE> modes = argsparse.getModes();
+    std::vector<int> batch_sizes = argsparse.getBatchSizes();
+    bool sweep = modes.size() > 1 || batch_sizes.size() > 1;
 
-    /*
-        std::cout << "FSRF_CONSTRUCTOR," << construct_fsrf_time.count() * microseconds::period::num / microseconds::period::den << "\n";
-        std::cout << "SETUP, " << setup_time.count() * microseconds::period::num / microseconds::period::den << "\n";
-        std::cout << "COPY_BACK, " << copy_back_time.count() * microseconds::period::num / microseconds::period::den << "\n";
-    */
+    for (FSRF::MODE mode : modes)
+    {
+        for (int batch_size : batch_sizes)
+        {
+            // only mmap and managed migrate in batches
+            bool batched = mode == FSRF::MODE::MMAP || mode == FSRF::MODE::MANAGED;
+            if (!batched && batch_size != batch_sizes[0])
+                continue;
+
+            BenchReport::Config config;
+            config.benchmark = argsparse.getBenchmarkName();
+            config.mode = ArgParse::modeName(mode);
+            config.batch_size = batched ? batch_size : 1;
+            argsparse.select(mode, config.batch_size);
+
+            uint64_t phase_us[BenchReport::NUM_PHASES];
+            for (uint64_t i = 0; i < argsparse.getWarmup(); ++i)
+                run_once(argsparse, parse_us, phase_us);
+            for (uint64_t i = 0; i < argsparse.getIterations(); ++i)
+            {
+                run_once(argsparse, parse_us, phase_us);
+                for (int phase = 0; phase < BenchReport::NUM_PHASES; ++phase)
+                    config.samples_us[phase].push_back(phase_us[phase]);
+            }
+
+            if (!sweep && argsparse.getIterations() == 1 && argsparse.getWarmup() == 0 && argsparse.getFormat().empty())
+            {
+                std::cout << "FPGA_EXECUTION, " << phase_us[BenchReport::EXECUTE] << "\n";
+                std::cout << "E2E, " << phase_us[BenchReport::E2E] << "\n";
+                return 0;
+            }
+            report.add(config);
+        }
+    }
 
-    delete bench;
+    if (argsparse.getFormat() == "json")
+        report.write_json(std::cout);
+    else
+        report.write_csv(std::cout);
 }
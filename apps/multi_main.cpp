@@ -0,0 +1,60 @@
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "Benchmarks.h"
+
+using namespace std::chrono;
+
+// Runs one copy of the benchmark on each of the first -n app slots from a
+// single process, every copy with its own FSRF instance.
+static void run_app(ArgParse argsparse, uint64_t app_id, uint64_t *fpga_execution_us)
+{
+    Bench *bench = make_bench(argsparse, app_id);
+
+    bench->setup();
+
+    high_resolution_clock::time_point start = high_resolution_clock::now();
+    bench->wait_for_fpga();
+    high_resolution_clock::time_point end = high_resolution_clock::now();
+    *fpga_execution_us = duration_cast<microseconds>(end - start).count();
+
+    bench->copy_back_output();
+    delete bench;
+}
+
+int main(int argc, char *argv[])
+{
+    high_resolution_clock::time_point very_beginning, very_end;
+    very_beginning = high_resolution_clock::now();
+
+    ArgParse argsparse(argc, argv, false);
+    uint64_t num_apps = argsparse.getNumApps();
+
+    if (strcmp(argsparse.getBenchmarkName(), "aes") && strcmp(argsparse.getBenchmarkName(), "md5") &&
+        strcmp(argsparse.getBenchmarkName(), "nw") && strcmp(argsparse.getBenchmarkName(), "pagerank"))
+    {
+        std::cerr << "unsupported benchmark name\n";
+        exit(1);
+    }
+
+    std::vector<uint64_t> fpga_execution_us(num_apps, 0);
+    std::vector<std::thread> apps;
+    for (uint64_t app_id = 0; app_id < num_apps; ++app_id)
+    {
+        apps.push_back(std::thread(run_app, argsparse, app_id, &fpga_execution_us[app_id]));
+    }
+    for (auto &app : apps)
+    {
+        app.join();
+    }
+
+    very_end = high_resolution_clock::now();
+    auto end_to_end_time = very_end - very_beginning;
+
+    for (uint64_t app_id = 0; app_id < num_apps; ++app_id)
+    {
+        std::cout << "FPGA_EXECUTION_" << app_id << ", " << fpga_execution_us[app_id] << "\n";
+    }
+    std::cout << "E2E, " << end_to_end_time.count() * microseconds::period::num / microseconds::period::den << "\n";
+}
@@ -0,0 +1,769 @@
+#include <chrono>
+#include <fcntl.h>
+#include <iostream>
+#include <sched.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "fault_handler.h"
+#include "policy.h"
+
+#define ERR(x)                                                                          \
+    {                                                                                   \
+        std::cerr << "[" << __FUNCTION__ << ":" << __LINE__ << "]\t" << x << std::endl; \
+        exit(1);                                                                        \
+    }
+
+#ifdef DEBUG
+#define DBG(x)  \
+    if (debug)  \
+    std::cout << "[" << __FUNCTION__ << ":" << __LINE__ << "]\t" << x << std::endl
+#define ASSERT(b) assert(b)
+#else
+#define DBG(x) \
+    {          \
+    }
+#define ASSERT(b) \
+    {             \
+    }
+#endif
+
+#define PAGE_SIZE 0x1000
+#define XFER_SIZE (2 << 20)
+// shorter TLB runs are written one entry at a time
+#define BULK_TLB_ENTRIES 64
+
+// Values returned to the client in out[3] of OP_HOST_FAULT
+#define FILL_NONE 0
+#define FILL_AND_FREE 1
+#define FILL_AND_KEEP 2
+
+using namespace fsrf_ipc;
+
+// Copy len bytes between the daemon and a client's address space.
+// process_vm_readv/writev honor the client's protection, so pages it mapped
+// write only, or that a migration left PROT_NONE, go through /proc/<pid>/mem
+// instead, which doesn't.
+static bool copy_remote(pid_t pid, void *local, uint64_t remote, uint64_t len, bool to_client)
+{
+    struct iovec local_iov = {local, len};
+    struct iovec remote_iov = {(void *)remote, len};
+    ssize_t res = to_client ? process_vm_writev(pid, &local_iov, 1, &remote_iov, 1, 0)
+                            : process_vm_readv(pid, &local_iov, 1, &remote_iov, 1, 0);
+    if (res == (ssize_t)len)
+        return true;
+
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/mem", pid);
+    int fd = open(path, to_client ? O_WRONLY : O_RDONLY);
+    if (fd == -1)
+        return false;
+    res = to_client ? pwrite(fd, local, len, remote) : pread(fd, local, len, remote);
+    close(fd);
+    return res == (ssize_t)len;
+}
+
+FaultHandler::FaultHandler(bool debug) : debug(debug)
+{
+    // Only one daemon may own the device
+    lock_fd = open(lock_path, O_CREAT | O_RDWR, 0666);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0)
+        ERR("Another fault handler is already running");
+
+    shm_unlink(shm_name);
+    int fd = shm_open(shm_name, O_CREAT | O_RDWR, 0666);
+    if (fd == -1)
+        ERR("shm_open failed");
+    fchmod(fd, 0666);
+    if (ftruncate(fd, sizeof(Shm)) != 0)
+        ERR("ftruncate failed");
+    shm = (Shm *)mmap(0, sizeof(Shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        ERR("mmap of shared memory failed");
+    memset((void *)shm, 0, sizeof(Shm));
+
+    for (uint64_t app_id = 0; app_id < max_apps; ++app_id)
+    {
+        fpga[app_id] = new FPGA(0, app_id, FPGA::dram_tlb_addr(app_id, 0));
+        tenants[app_id].pid = 0;
+        tenants[app_id].mode = FSRF::MODE::NONE;
+        tenants[app_id].disconnect = nullptr;
+    }
+    fpga[0]->write_sys_reg(8, 0x18, 0x0); // PCIe coyote striping
+
+    shm->magic = magic;
+    shm->daemon_pid = getpid();
+    DBG("Listening on " << shm_name);
+}
+
+FaultHandler::~FaultHandler()
+{
+    for (uint64_t app_id = 0; app_id < max_apps; ++app_id)
+    {
+        if (tenants[app_id].pid != 0)
+            reset(app_id);
+        delete fpga[app_id];
+    }
+    shm->daemon_pid = 0;
+    munmap(shm, sizeof(Shm));
+    shm_unlink(shm_name);
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+void FaultHandler::stop()
+{
+    abort = true;
+}
+
+// One listener for every tenant: serve client requests, then device faults
+void FaultHandler::listen()
+{
+    uint64_t iteration = 0;
+    while (!abort)
+    {
+        bool idle = true;
+        ++iteration;
+        for (uint64_t app_id = 0; app_id < max_apps; ++app_id)
+        {
+            fsrf_ipc::Tenant &shared = shm->tenants[app_id];
+            if (shared.pid.load() == 0)
+                continue;
+
+            // reclaim slots of clients that died without disconnecting
+            if (iteration % (1 << 16) == 0 && !client_alive(app_id))
+            {
+                std::cerr << "Client " << shared.pid.load() << " on app " << app_id << " exited, reclaiming\n";
+                reset(app_id);
+                continue;
+            }
+
+            for (uint64_t slot = 0; slot < ring_slots; ++slot)
+            {
+                if (shared.ring[slot].state.load(std::memory_order_acquire) == SUBMITTED)
+                {
+                    idle = false;
+                    serve(app_id, shared.ring[slot]);
+                }
+            }
+
+            if (!shared.connected.load())
+                continue;
+
+            Tenant &tenant = tenants[app_id];
+            if (tenant.fault_deferred)
+            {
+                // the device waits on this fault, nothing new to read
+                if (being_filled(app_id, tenant.deferred_vpn))
+                    continue;
+                idle = false;
+                tenant.fault_deferred = false;
+                handle_device_fault(app_id, tenant.deferred_read, tenant.deferred_vpn);
+                continue;
+            }
+
+            uint64_t fault = read_tlb_fault(app_id);
+            ASSERT(fault != (uint64_t)-1);
+            if (!(fault & 1))
+            {
+                tenants[app_id].num_credits = fault >> 57;
+                shared.num_credits.store(fault >> 57, std::memory_order_release);
+                if (tenants[app_id].disconnect && tenants[app_id].num_credits == 0)
+                {
+                    Request *req = tenants[app_id].disconnect;
+                    reset(app_id);
+                    complete(*req, 0);
+                }
+                continue;
+            }
+
+            idle = false;
+            bool read = fault & 0x2;
+            uint64_t vpn = (fault >> 2) & 0xFFFFFFFFFFFFF;
+            DBG("App " << app_id << " faulted on vpn " << (void *)vpn << (read ? " (read)" : " (write)"));
+            handle_device_fault(app_id, read, vpn);
+        }
+        if (idle)
+            sched_yield();
+    }
+}
+
+bool FaultHandler::client_alive(uint64_t app_id)
+{
+    pid_t pid = shm->tenants[app_id].pid.load();
+    return pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+void FaultHandler::connect(uint64_t app_id, pid_t pid, FSRF::MODE mode, uint64_t batch_size)
+{
+    Tenant &tenant = tenants[app_id];
+    tenant.pid = pid;
+    tenant.mode = mode;
+    tenant.mmap_dma_size = (batch_size == (uint64_t)FSRF::BATCH_ADAPTIVE ? policy::adaptive_max_pages : batch_size) * PAGE_SIZE;
+    tenant.num_credits = 0;
+    tenant.disconnect = nullptr;
+    tenant.filling.clear();
+    tenant.fault_deferred = false;
+
+    uint64_t addrs[4] = {0, 8 << 20, 4 << 20, 12 << 20};
+    // offset 128 MB for TLB
+    tenant.phys_base = (128 << 20) + addrs[app_id];
+    tenant.phys_bound = addrs[app_id] + (16 << 20) / max_apps;
+    tenant.next_free_page = tenant.phys_base >> 12;
+
+    fpga[app_id]->write_sys_reg(app_id, 0x10, 1);       // enable tlb
+    fpga[app_id]->write_sys_reg(app_id, 0x18, 1);       // use dram tlb
+    fpga[app_id]->write_sys_reg(app_id + 4, 0x10, 0x0); // Coyote striping
+
+    shm->tenants[app_id].num_credits = 0;
+    shm->tenants[app_id].connected = 1;
+    DBG("App " << app_id << " connected, pid " << pid << ", mode " << mode << ", batch " << batch_size);
+}
+
+// Drop every mapping of a tenant and hand the slot back
+void FaultHandler::reset(uint64_t app_id)
+{
+    Tenant &tenant = tenants[app_id];
+    for (auto it = tenant.device_vpn_to_ppn.begin(); it != tenant.device_vpn_to_ppn.end(); ++it)
+        write_tlb(app_id, it->first, it->second, false, false, false);
+    tenant.device_vpn_to_ppn.clear();
+    tenant.vmes.clear();
+    tenant.filling.clear();
+    tenant.fault_deferred = false;
+    tenant.pid = 0;
+    tenant.mode = FSRF::MODE::NONE;
+    tenant.disconnect = nullptr;
+
+    fsrf_ipc::Tenant &shared = shm->tenants[app_id];
+    shared.connected = 0;
+    shared.num_credits = 0;
+    shared.protect.seq = 0;
+    shared.protect.ack = 0;
+    // a live client still waits on its pending OP_DISCONNECT
+    bool alive = client_alive(app_id);
+    for (uint64_t slot = 0; slot < ring_slots; ++slot)
+    {
+        if (!alive || shared.ring[slot].state.load() != SUBMITTED)
+            shared.ring[slot].state = FREE;
+    }
+    if (!alive)
+        shared.pid = 0;
+}
+
+void FaultHandler::complete(Request &req, int64_t result)
+{
+    req.result = result;
+    req.state.store(DONE, std::memory_order_release);
+    futex_wake(&req.state);
+}
+
+void FaultHandler::serve(uint64_t app_id, Request &req)
+{
+    Tenant &tenant = tenants[app_id];
+    pid_t pid = shm->tenants[app_id].pid.load();
+
+    if (req.op != OP_CONNECT && tenant.pid != pid)
+    {
+        complete(req, -1);
+        return;
+    }
+
+    switch (req.op)
+    {
+    case OP_CONNECT:
+        if (tenant.pid != 0 && tenant.pid != pid)
+            reset(app_id);
+        if ((FSRF::MODE)req.args[0] < FSRF::MODE::INV_READ || (FSRF::MODE)req.args[0] > FSRF::MODE::MANAGED ||
+            ((req.args[1] < 1 || req.args[1] > FSRF::MAX_BATCH) && req.args[1] != (uint64_t)FSRF::BATCH_ADAPTIVE))
+        {
+            complete(req, -1);
+            return;
+        }
+        connect(app_id, pid, (FSRF::MODE)req.args[0], req.args[1]);
+        complete(req, 0);
+        return;
+    case OP_DISCONNECT:
+        // completed by listen() once the device stops holding credits
+        tenant.disconnect = &req;
+        return;
+    case OP_REG_READ:
+        fpga[app_id]->read_app_reg(app_id, req.args[0], req.out[0]);
+        complete(req, 0);
+        return;
+    case OP_REG_WRITE:
+        fpga[app_id]->write_app_reg(app_id, req.args[0], req.args[1]);
+        complete(req, 0);
+        return;
+    case OP_REGISTER_VME:
+        complete(req, register_vme(app_id, req.args[0], req.args[1], req.args[2], req.args[3]));
+        return;
+    case OP_FREE_VME:
+        free_vme(app_id, req.args[0]);
+        complete(req, 0);
+        return;
+    case OP_SYNC_TO_DEVICE:
+        complete(req, sync(app_id, req.args[0], req.args[1], true, req.args[2]));
+        return;
+    case OP_SYNC_TO_HOST:
+        complete(req, sync(app_id, req.args[0], req.args[1], false, req.args[2]));
+        return;
+    case OP_HOST_FAULT:
+        complete(req, host_fault(app_id, req.args[0], req.args[1], req.out));
+        return;
+    case OP_HOST_FILL:
+        complete(req, host_fill(app_id, req.args[0], req.args[1], req.args[2]));
+        return;
+    default:
+        complete(req, -1);
+        return;
+    }
+}
+
+FaultHandler::VME *FaultHandler::find_vme(uint64_t app_id, uint64_t addr)
+{
+    std::map<uint64_t, VME> &vmes = tenants[app_id].vmes;
+    auto it = vmes.upper_bound(addr);
+    if (it == vmes.begin())
+        return nullptr;
+    --it;
+    if (addr >= it->second.addr && addr < it->second.addr + it->second.size)
+        return &it->second;
+    return nullptr;
+}
+
+// policy is fsrf_ipc::vme_policy(mode, batch pages)
+int64_t FaultHandler::register_vme(uint64_t app_id, uint64_t addr, uint64_t length, uint64_t prot, uint64_t policy)
+{
+    Tenant &tenant = tenants[app_id];
+    FSRF::MODE mode = (FSRF::MODE)(policy & 0xFF);
+    bool adaptive = (policy >> 8) & 1;
+    uint64_t batch_pages = policy >> 32;
+    if (mode < FSRF::MODE::INV_READ || mode > FSRF::MODE::MANAGED || batch_pages < 1 || batch_pages > FSRF::MAX_BATCH)
+        return -1;
+    if (addr % (batch_pages * PAGE_SIZE) != 0 || length % (batch_pages * PAGE_SIZE) != 0)
+        return -1;
+    // MMAP only reserves its pages here, see map_reserved
+    int64_t first_ppn = 0;
+    if (mode == FSRF::MODE::MMAP && (first_ppn = allocate_device_ppns(app_id, length >> 12)) < 0)
+        return -1;
+    VME vme{addr, length, prot, mode, batch_pages * PAGE_SIZE, adaptive,
+            policy::BatchTuner(adaptive ? policy::adaptive_start_pages : batch_pages, batch_pages)};
+    vme.first_ppn = first_ppn;
+    tenant.vmes[addr] = vme;
+    return 0;
+}
+
+// Maps the batches of an MMAP VME overlapping [start, end) that aren't
+// mapped yet onto the device pages reserved for them
+void FaultHandler::map_reserved(uint64_t app_id, VME *vme, uint64_t start, uint64_t end)
+{
+    Tenant &tenant = tenants[app_id];
+    start -= (start - vme->addr) % vme->dma_size;
+    end = std::min(vme->addr + vme->size, end);
+
+    // runs of unmapped batches, each mapped in one go
+    uint64_t run = start;
+    for (uint64_t vaddr = start;; vaddr += vme->dma_size)
+    {
+        // a batch is mapped all at once, so its first page tells
+        if (vaddr < end && tenant.device_vpn_to_ppn.find(vaddr >> 12) == tenant.device_vpn_to_ppn.end())
+            continue;
+        if (vaddr > run)
+        {
+            uint64_t vpn = run >> 12;
+            uint64_t ppn = vme->first_ppn + ((run - vme->addr) >> 12);
+            uint64_t pages = (vaddr - run) >> 12;
+            for (uint64_t page = 0; page < pages; ++page)
+                tenant.device_vpn_to_ppn[vpn + page] = ppn + page;
+            write_tlb_run(app_id, vpn, ppn, pages, (vme->prot & PROT_WRITE) != 0);
+        }
+        if (vaddr >= end)
+            break;
+        run = vaddr + vme->dma_size;
+    }
+}
+
+void FaultHandler::free_vme(uint64_t app_id, uint64_t addr)
+{
+    Tenant &tenant = tenants[app_id];
+    VME *vme = find_vme(app_id, addr);
+    if (vme == nullptr)
+        return;
+
+    for (uint64_t vaddr = vme->addr; vaddr < vme->addr + vme->size; vaddr += PAGE_SIZE)
+    {
+        uint64_t vpn = vaddr >> 12;
+        // this page was never put on the device
+        if (tenant.device_vpn_to_ppn.find(vpn) == tenant.device_vpn_to_ppn.end())
+            continue;
+        write_tlb(app_id, vpn, tenant.device_vpn_to_ppn[vpn], false, false, false);
+        tenant.device_vpn_to_ppn.erase(vpn);
+    }
+    tenant.vmes.erase(vme->addr);
+}
+
+// Sync the batches of the VME containing addr that overlap
+// [addr, addr + length) in either direction, the whole VME if length is 0.
+// Exact syncs move just [addr, addr + length) within one page, for
+// fsrf_malloc_small objects.
+int64_t FaultHandler::sync(uint64_t app_id, uint64_t addr, uint64_t length, bool to_device, bool exact)
+{
+    Tenant &tenant = tenants[app_id];
+    VME *vme = find_vme(app_id, addr);
+    if (vme == nullptr || vme->mode != FSRF::MODE::MMAP)
+        return -1;
+
+    if (exact)
+    {
+        uint64_t page = addr & ~(PAGE_SIZE - 1);
+        if (length == 0 || addr + length > page + PAGE_SIZE)
+            return -1;
+        if (to_device)
+            map_reserved(app_id, vme, page, page + PAGE_SIZE);
+        auto mapped = tenant.device_vpn_to_ppn.find(page >> 12);
+        // the device never used this batch
+        if (mapped == tenant.device_vpn_to_ppn.end())
+            return 0;
+        // read-modify-write of the device page
+        FPGA &dev = *fpga[app_id];
+        dev.dma_wrapper(true, 1, mapped->second, app_id);
+        bool ok = copy_remote(tenant.pid, (char *)dev.xfer_buf + (addr - page), addr, length, !to_device);
+        if (ok && to_device)
+            dev.dma_wrapper(false, 1, mapped->second, app_id);
+        memset(dev.xfer_buf, 0, PAGE_SIZE);
+        return ok ? 0 : -1;
+    }
+
+    uint64_t start = vme->addr, end = vme->addr + vme->size;
+    if (length != 0)
+    {
+        start = addr - (addr - vme->addr) % vme->dma_size;
+        end = std::min(end, addr + length);
+    }
+    if (to_device)
+        map_reserved(app_id, vme, start, end);
+    for (uint64_t vaddr = start; vaddr < end; vaddr += vme->dma_size)
+    {
+        auto mapped = tenant.device_vpn_to_ppn.find(vaddr >> 12);
+        // the device never used this batch
+        if (mapped == tenant.device_vpn_to_ppn.end())
+            continue;
+        uint64_t ppn = mapped->second;
+        bool ok = to_device ? remote_dma_write(app_id, vaddr, ppn, vme->dma_size)
+                            : remote_dma_read(app_id, vaddr, ppn, vme->dma_size);
+        if (!ok)
+            return -1;
+    }
+    return 0;
+}
+
+// First half of a client SIGSEGV: take the page(s) away from the device and
+// tell the client which range to open up before the data is copied back.
+int64_t FaultHandler::host_fault(uint64_t app_id, uint64_t vaddr, bool write, uint64_t *out)
+{
+    Tenant &tenant = tenants[app_id];
+    uint64_t vpn = vaddr >> 12;
+
+    if (tenant.device_vpn_to_ppn.find(vpn) == tenant.device_vpn_to_ppn.end())
+        return -1;
+
+    // memory outside any allocation follows the tenant's policy
+    VME *vme = find_vme(app_id, vaddr);
+    FSRF::MODE mode = vme != nullptr ? vme->mode : tenant.mode;
+    uint64_t dma_size = vme != nullptr ? vme->dma_size : tenant.mmap_dma_size;
+    policy::HostPlan plan = policy::plan_host_fault((policy::MODE)mode, write, vpn, dma_size >> 12);
+    // MMAP should not have host faults
+    if (!plan.valid)
+        return -1;
+    if (plan.pages > 1 && vme == nullptr)
+        return -1;
+    if (mode == FSRF::MODE::MANAGED && vme != nullptr)
+    {
+        // the whole batch the page went over in, sizes vary when adaptive
+        auto batch = vme->batches.upper_bound(vpn);
+        if (batch != vme->batches.begin() && vpn < std::prev(batch)->first + std::prev(batch)->second)
+        {
+            --batch;
+            plan.vpn = batch->first;
+            plan.pages = batch->second;
+            vme->batches.erase(batch);
+        }
+    }
+
+    // invalidate, or set to readonly if the device keeps a copy it may have written
+    for (uint64_t page = plan.vpn; page < plan.vpn + plan.pages; ++page)
+    {
+        auto it = tenant.device_vpn_to_ppn.find(page);
+        if (it != tenant.device_vpn_to_ppn.end())
+            write_tlb(app_id, page, it->second, false, plan.device_keeps, plan.device_keeps);
+    }
+    tenant.filling[plan.vpn] = plan.pages;
+    out[0] = plan.vpn << 12;
+    out[1] = plan.pages << 12;
+    out[2] = plan.prot;
+    out[3] = plan.device_keeps ? FILL_AND_KEEP : FILL_AND_FREE;
+    return 0;
+}
+
+// Second half of a client SIGSEGV: the range is writeable again, copy it back
+int64_t FaultHandler::host_fill(uint64_t app_id, uint64_t addr, uint64_t len, uint64_t flags)
+{
+    Tenant &tenant = tenants[app_id];
+    tenant.filling.erase(addr >> 12);
+    if (flags == FILL_NONE)
+        return 0;
+
+    auto it = tenant.device_vpn_to_ppn.find(addr >> 12);
+    if (it == tenant.device_vpn_to_ppn.end())
+        return -1;
+
+    // batches are allocated contiguously on the device
+    if (!remote_dma_read(app_id, addr, it->second, len))
+        return -1;
+
+    if (flags == FILL_AND_FREE)
+    {
+        for (uint64_t curr = addr; curr < addr + len; curr += PAGE_SIZE)
+            tenant.device_vpn_to_ppn.erase(curr >> 12);
+    }
+    return 0;
+}
+
+bool FaultHandler::being_filled(uint64_t app_id, uint64_t vpn)
+{
+    std::map<uint64_t, uint64_t> &filling = tenants[app_id].filling;
+    auto it = filling.upper_bound(vpn);
+    return it != filling.begin() && vpn < std::prev(it)->first + std::prev(it)->second;
+}
+
+// First of pages contiguous device pages, -1 once the slot runs out. Only
+// the request that asked fails, the other tenants keep being served.
+int64_t FaultHandler::allocate_device_ppns(uint64_t app_id, uint64_t pages)
+{
+    Tenant &tenant = tenants[app_id];
+    uint64_t toReturn = tenant.next_free_page;
+    if (toReturn < tenant.phys_bound >> 12 && toReturn + pages >= tenant.phys_bound >> 12)
+    {
+        std::cerr << "App " << app_id << " is out of device pages\n";
+        return -1;
+    }
+    tenant.next_free_page += pages;
+    return toReturn;
+}
+
+void FaultHandler::write_tlb(uint64_t app_id, uint64_t vpn, uint64_t ppn,
+                             uint64_t writeable, uint64_t readable, uint64_t present)
+{
+    uint64_t tlb_addr = FPGA::dram_tlb_addr(app_id, vpn);
+    fpga[app_id]->write_mem_reg(tlb_addr, FPGA::tlb_entry(vpn, ppn, writeable, readable, present));
+}
+
+// Entries for pages consecutive vpns, mapped to consecutive ppns. The sets
+// of consecutive vpns lie 64 bytes apart in DRAM, so long runs read their
+// sets back by DMA, fill in their way and write them out again instead of
+// taking one MMIO write per entry.
+void FaultHandler::write_tlb_run(uint64_t app_id, uint64_t vpn, uint64_t ppn, uint64_t pages, uint64_t writeable)
+{
+    const uint64_t set_mask = (1ull << 21) - 1; // see FPGA::dram_tlb_addr
+    FPGA &dev = *fpga[app_id];
+    while (pages != 0)
+    {
+        uint64_t tlb_addr = FPGA::dram_tlb_addr(app_id, vpn);
+        uint64_t first = tlb_addr & ~(uint64_t)(PAGE_SIZE - 1);
+        // the way changes where the set index wraps
+        uint64_t run = std::min(pages, (set_mask + 1) - (vpn & set_mask));
+        run = std::min(run, (XFER_SIZE - (tlb_addr - first)) / 64);
+        if (run < BULK_TLB_ENTRIES)
+        {
+            for (uint64_t page = 0; page < run; ++page)
+                write_tlb(app_id, vpn + page, ppn + page, writeable, true, true);
+        }
+        else
+        {
+            uint64_t bytes = (tlb_addr - first + run * 64 + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+            uint64_t *sets = (uint64_t *)dev.xfer_buf;
+            dev.dma_wrapper(true, bytes >> 12, first >> 12, app_id);
+            for (uint64_t page = 0; page < run; ++page)
+                sets[(tlb_addr - first) / 8 + page * 8] = FPGA::tlb_entry(vpn + page, ppn + page, writeable, true, true);
+            dev.dma_wrapper(false, bytes >> 12, first >> 12, app_id);
+            memset(dev.xfer_buf, 0, bytes);
+        }
+        vpn += run;
+        ppn += run;
+        pages -= run;
+    }
+}
+
+uint64_t FaultHandler::read_tlb_fault(uint64_t app_id)
+{
+    uint64_t res = (uint64_t)~0;
+    fpga[app_id]->read_sys_reg(app_id, 0, res);
+    return res;
+}
+
+void FaultHandler::respond_tlb(uint64_t app_id, uint64_t ppn, uint64_t valid)
+{
+    uint64_t resp = 0 | (ppn << 1) | valid;
+    fpga[app_id]->write_sys_reg(app_id, 0x0, resp);
+}
+
+void FaultHandler::handle_device_fault(uint64_t app_id, bool read, uint64_t vpn)
+{
+    Tenant &tenant = tenants[app_id];
+
+    // the device's copy is on its way to the host, answer after OP_HOST_FILL
+    if (being_filled(app_id, vpn))
+    {
+        tenant.fault_deferred = true;
+        tenant.deferred_read = read;
+        tenant.deferred_vpn = vpn;
+        return;
+    }
+
+    auto resident = tenant.device_vpn_to_ppn.find(vpn);
+    VME *vme = find_vme(app_id, vpn << 12);
+    FSRF::MODE mode = vme != nullptr ? vme->mode : tenant.mode;
+
+    // MMAP VMEs map their reserved pages on first use, nothing to copy
+    if (mode == FSRF::MODE::MMAP && vme != nullptr && resident == tenant.device_vpn_to_ppn.end())
+    {
+        map_reserved(app_id, vme, vpn << 12, (vpn + 1) << 12);
+        respond_tlb(app_id, tenant.device_vpn_to_ppn[vpn], true);
+        return;
+    }
+    uint64_t batch_pages = (vme != nullptr ? vme->dma_size : tenant.mmap_dma_size) >> 12;
+    bool tuned = mode == FSRF::MODE::MANAGED && vme != nullptr && vme->adaptive && resident == tenant.device_vpn_to_ppn.end();
+    bool stream_hit;
+    if (tuned)
+        batch_pages = vme->tuner.on_fault(vpn, stream_hit);
+    policy::DevicePlan plan = policy::plan_device_fault((policy::MODE)mode, read, vpn,
+                                                        resident != tenant.device_vpn_to_ppn.end(),
+                                                        batch_pages);
+    if (!plan.valid)
+    {
+        std::cerr << "App " << app_id << " should not fault in mode " << mode << "\n";
+        respond_tlb(app_id, 0, false);
+        return;
+    }
+    if (plan.needs_vme && find_vme(app_id, plan.vpn << 12) == nullptr)
+    {
+        std::cerr << "App " << app_id << " made an invalid device access at " << (void *)(vpn << 12) << "\n";
+        respond_tlb(app_id, 0, false);
+        return;
+    }
+    if (mode == FSRF::MODE::MANAGED && plan.copy)
+        policy::trim_to_missing(plan, vpn, [&tenant](uint64_t page)
+                                { return tenant.device_vpn_to_ppn.find(page) != tenant.device_vpn_to_ppn.end(); });
+
+    uint64_t vaddr = plan.vpn << 12;
+    uint64_t bytes = plan.pages << 12;
+
+    // batches are allocated contiguously on the device, before the host
+    // loses access so a full slot leaves it as it was
+    int64_t device_ppn = plan.copy ? allocate_device_ppns(app_id, plan.pages) : 0;
+    if (device_ppn < 0)
+    {
+        respond_tlb(app_id, 0, false);
+        return;
+    }
+
+    if (plan.prot_before_copy != policy::KEEP_PROT && !set_host_prot(app_id, vaddr, bytes, plan.prot_before_copy))
+    {
+        respond_tlb(app_id, 0, false);
+        return;
+    }
+
+    if (plan.copy)
+    {
+        if (!remote_dma_write(app_id, vaddr, device_ppn, bytes))
+        {
+            respond_tlb(app_id, 0, false);
+            return;
+        }
+        for (uint64_t page = 0; page < plan.pages; ++page)
+            tenant.device_vpn_to_ppn[plan.vpn + page] = device_ppn + page;
+        if (mode == FSRF::MODE::MANAGED && vme != nullptr)
+            vme->batches[plan.vpn] = plan.pages;
+        if (tuned)
+            vme->tuner.migrated(vpn, plan.vpn + plan.pages);
+    }
+
+    if (plan.prot_after_copy != policy::KEEP_PROT && !set_host_prot(app_id, vaddr, bytes, plan.prot_after_copy))
+    {
+        respond_tlb(app_id, 0, false);
+        return;
+    }
+
+    if (plan.map)
+    {
+        for (uint64_t page = plan.vpn; page < plan.vpn + plan.pages; ++page)
+            write_tlb(app_id, page, tenant.device_vpn_to_ppn[page], plan.writeable, true, true);
+    }
+    respond_tlb(app_id, tenant.device_vpn_to_ppn[vpn], true);
+}
+
+bool FaultHandler::remote_dma_write(uint64_t app_id, uint64_t vaddr, uint64_t ppn, uint64_t bytes)
+{
+    FPGA &dev = *fpga[app_id];
+    for (uint64_t done = 0; done < bytes; done += XFER_SIZE)
+    {
+        uint64_t len = std::min<uint64_t>(XFER_SIZE, bytes - done);
+        if (!copy_remote(tenants[app_id].pid, dev.xfer_buf, vaddr + done, len, false))
+        {
+            std::cerr << "Reading client memory at " << (void *)(vaddr + done) << " failed: " << strerror(errno) << "\n";
+            return false;
+        }
+        dev.dma_wrapper(false, len / PAGE_SIZE, ppn + done / PAGE_SIZE, app_id);
+        memset(dev.xfer_buf, 0, len);
+    }
+    return true;
+}
+
+bool FaultHandler::remote_dma_read(uint64_t app_id, uint64_t vaddr, uint64_t ppn, uint64_t bytes)
+{
+    FPGA &dev = *fpga[app_id];
+    for (uint64_t done = 0; done < bytes; done += XFER_SIZE)
+    {
+        uint64_t len = std::min<uint64_t>(XFER_SIZE, bytes - done);
+        dev.dma_wrapper(true, len / PAGE_SIZE, ppn + done / PAGE_SIZE, app_id);
+        bool ok = copy_remote(tenants[app_id].pid, dev.xfer_buf, vaddr + done, len, true);
+        memset(dev.xfer_buf, 0, len);
+        if (!ok)
+        {
+            std::cerr << "Writing client memory at " << (void *)(vaddr + done) << " failed: " << strerror(errno) << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FaultHandler::set_host_prot(uint64_t app_id, uint64_t addr, uint64_t len, uint64_t prot)
+{
+    Protect &protect = shm->tenants[app_id].protect;
+    // still behind on an earlier change, don't rewrite it under the client
+    if (protect.ack.load(std::memory_order_acquire) != protect.seq.load())
+        return false;
+    protect.addr = addr;
+    protect.len = len;
+    protect.prot = prot;
+    uint32_t seq = protect.seq.fetch_add(1, std::memory_order_release) + 1;
+    futex_wake(&protect.seq);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds((uint64_t)protect_timeout_ms);
+    uint64_t spins = 0;
+    while (protect.ack.load(std::memory_order_acquire) != seq)
+    {
+        if (++spins % (1 << 10) == 0 && std::chrono::steady_clock::now() > deadline)
+        {
+            std::cerr << "App " << app_id << " didn't apply a protection change in " << protect_timeout_ms << " ms\n";
+            return false;
+        }
+        if (spins % (1 << 20) == 0 && !client_alive(app_id))
+            return false;
+        sched_yield();
+    }
+    return true;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <map>
+#include <stdint.h>
+#include <sys/types.h>
+#include <unordered_map>
+
+#include "fault_ipc.h"
+#include "fpga.h"
+#include "fsrf.h"
+
+// Out-of-process fault service. A single FaultHandler owns the PCIe BARs,
+// the PCIM DMA channels and the DRAM TLBs of all four app slots, and serves
+// every client process (see fsrf_client.h) from one polling listener.
+class FaultHandler
+{
+public:
+    FaultHandler(bool debug);
+    ~FaultHandler();
+
+    void listen();
+    void stop();
+
+private:
+    bool debug;
+    volatile bool abort = false;
+
+    int lock_fd;
+    fsrf_ipc::Shm *shm;
+    FPGA *fpga[max_apps];
+
+    struct VME
+    {
+        uint64_t addr;
+        uint64_t size;
+        uint64_t prot;
+        FSRF::MODE mode;       // migration policy of the allocation
+        uint64_t dma_size;     // its batch in bytes, the largest if adaptive
+        bool adaptive;
+        policy::BatchTuner tuner;
+        // MANAGED batches on the device, first vpn -> pages
+        std::map<uint64_t, uint64_t> batches;
+        // MMAP: start of the reserved device pages, each batch mapped on
+        // its first sync or device fault
+        uint64_t first_ppn;
+    } typedef VME;
+
+    struct Tenant
+    {
+        pid_t pid;
+        FSRF::MODE mode;
+        uint64_t mmap_dma_size;
+
+        std::unordered_map<uint64_t, uint64_t> device_vpn_to_ppn;
+        std::map<uint64_t, VME> vmes;
+        uint64_t phys_base;
+        uint64_t phys_bound;
+        uint64_t next_free_page;
+
+        // host_fault batches the client is still copying back, first vpn ->
+        // pages. A device fault on one waits for its OP_HOST_FILL.
+        std::map<uint64_t, uint64_t> filling;
+        bool fault_deferred;
+        bool deferred_read;
+        uint64_t deferred_vpn;
+
+        uint64_t num_credits;
+        // pending OP_DISCONNECT, completed once the credits drain
+        fsrf_ipc::Request *disconnect;
+    } typedef Tenant;
+
+    Tenant tenants[max_apps];
+
+    void connect(uint64_t app_id, pid_t pid, FSRF::MODE mode, uint64_t batch_size);
+    void reset(uint64_t app_id);
+    bool client_alive(uint64_t app_id);
+
+    void serve(uint64_t app_id, fsrf_ipc::Request &req);
+    void complete(fsrf_ipc::Request &req, int64_t result);
+
+    int64_t register_vme(uint64_t app_id, uint64_t addr, uint64_t length, uint64_t prot, uint64_t policy);
+    void free_vme(uint64_t app_id, uint64_t addr);
+    int64_t sync(uint64_t app_id, uint64_t addr, uint64_t length, bool to_device, bool exact);
+    int64_t host_fault(uint64_t app_id, uint64_t vaddr, bool write, uint64_t *out);
+    int64_t host_fill(uint64_t app_id, uint64_t addr, uint64_t len, uint64_t flags);
+
+    VME *find_vme(uint64_t app_id, uint64_t addr);
+    bool being_filled(uint64_t app_id, uint64_t vpn);
+    int64_t allocate_device_ppns(uint64_t app_id, uint64_t pages);
+    void map_reserved(uint64_t app_id, VME *vme, uint64_t start, uint64_t end);
+    void write_tlb(uint64_t app_id, uint64_t vpn, uint64_t ppn,
+                   uint64_t writeable, uint64_t readable, uint64_t present);
+    void write_tlb_run(uint64_t app_id, uint64_t vpn, uint64_t ppn, uint64_t pages, uint64_t writeable);
+    uint64_t read_tlb_fault(uint64_t app_id);
+    void respond_tlb(uint64_t app_id, uint64_t ppn, uint64_t valid);
+    void handle_device_fault(uint64_t app_id, bool read, uint64_t vpn);
+
+    // Move data between the client's address space and device DRAM
+    bool remote_dma_write(uint64_t app_id, uint64_t vaddr, uint64_t ppn, uint64_t bytes);
+    bool remote_dma_read(uint64_t app_id, uint64_t vaddr, uint64_t ppn, uint64_t bytes);
+    // Ask the client to mprotect part of its address space and wait for the
+    // ack. False if it doesn't come within protect_timeout_ms, e.g. the
+    // client is stopped, so only its fault fails and the listener moves on.
+    // Later changes fail at once until the client catches up.
+    static const uint64_t protect_timeout_ms = 1000;
+    bool set_host_prot(uint64_t app_id, uint64_t addr, uint64_t len, uint64_t prot);
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Shared memory protocol between the fault handling daemon (fault_handler.h)
+// and client processes (fsrf_client.h).
+//
+// The daemon owns one Tenant per app slot. A client claims a slot by swapping
+// its pid into Tenant::pid and then talks to the daemon through the request
+// ring. The daemon pushes host permission changes back to the client through
+// Tenant::protect, since only the client can mprotect its own address space.
+namespace fsrf_ipc
+{
+    const char *const shm_name = "/fsrf_daemon";
+    const char *const lock_path = "/tmp/fsrf_daemon.lock";
+    const uint64_t magic = 0x6673726664616531; // "fsrfdae1"
+    const uint64_t num_tenants = 4;
+    const uint64_t ring_slots = 16;
+
+    enum OP : uint32_t
+    {
+        OP_CONNECT = 0,         // args: mode, batch_size (or FSRF::BATCH_ADAPTIVE)
+        OP_DISCONNECT = 1,      // completes once the device has no credits out
+        OP_REG_READ = 2,        // args: addr -> out[0]: value
+        OP_REG_WRITE = 3,       // args: addr, value
+        OP_REGISTER_VME = 4,    // args: addr, length, device_prot, vme_policy
+        OP_FREE_VME = 5,        // args: addr
+        OP_SYNC_TO_DEVICE = 6,  // args: addr, length (0 for the whole VME), exact
+        OP_SYNC_TO_HOST = 7,    // args: addr, length (0 for the whole VME), exact
+        OP_HOST_FAULT = 8,      // args: vaddr, write -> out: addr, len, prot, need_fill
+        OP_HOST_FILL = 9,       // args: addr, len, fill flags (out[3] of OP_HOST_FAULT)
+    };
+
+    enum STATE : uint32_t
+    {
+        FREE = 0,
+        CLAIMED = 1,
+        SUBMITTED = 2,
+        DONE = 3,
+    };
+
+    struct Request
+    {
+        std::atomic<uint32_t> state;
+        uint32_t op;
+        uint64_t args[4];
+        int64_t result;
+        uint64_t out[4];
+    };
+
+    // Single outstanding protection change, daemon -> client
+    struct Protect
+    {
+        std::atomic<uint32_t> seq;
+        std::atomic<uint32_t> ack;
+        uint64_t addr;
+        uint64_t len;
+        uint64_t prot;
+    };
+
+    struct Tenant
+    {
+        std::atomic<int32_t> pid;
+        std::atomic<uint32_t> connected;
+        std::atomic<uint64_t> num_credits;
+        Request ring[ring_slots];
+        Protect protect;
+    };
+
+    struct Shm
+    {
+        uint64_t magic;
+        std::atomic<uint32_t> daemon_pid;
+        Tenant tenants[num_tenants];
+    };
+
+    // Packs an allocation's mode and batch in pages into one argument,
+    // adaptive batches tune themselves up to batch_pages
+    inline uint64_t vme_policy(uint64_t mode, uint64_t batch_pages, bool adaptive)
+    {
+        return mode | ((uint64_t)adaptive << 8) | (batch_pages << 32);
+    }
+
+    // Sleeps while *word == expected, for at most timeout_us
+    inline void futex_wait(std::atomic<uint32_t> *word, uint32_t expected, uint64_t timeout_us)
+    {
+        struct timespec timeout = {(time_t)(timeout_us / 1000000), (long)(timeout_us % 1000000) * 1000};
+        syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected, &timeout, nullptr, 0);
+    }
+
+    inline void futex_wake(std::atomic<uint32_t> *word)
+    {
+        syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+    }
+}
@@ -2,6 +2,12 @@
 #include <cstring>
 #include <iostream>
 #include "fpga.h"
+#include "perf.h"
+#ifdef SIM
+#include "sim/device.h"
+#endif
+#include "stats.h"
+#include "trace.h"
 
 using namespace std::chrono;
 
@@ -18,50 +24,39 @@ using namespace std::chrono;
 #endif
 
 #ifdef PERF
-#define TRACK(name)                                                \
-    {                                                              \
-        cumulative_times[name] = std::chrono::nanoseconds::zero(); \
-        num_calls[name] = 0;                                       \
-    }
-
-#define START(name)                                                    \
-    {                                                                  \
-        ASSERT(cumulative_times.find(name) != cumulative_times.end()); \
-        last_start[name] = high_resolution_clock::now();               \
-        num_calls[name] += 1;                                          \
-    }
-
-#define END(name)                                                      \
-    {                                                                  \
-        ASSERT(cumulative_times.find(name) != cumulative_times.end()); \
-        ASSERT(last_start.find(name) != last_start.end());             \
-        auto end = high_resolution_clock::now();                       \
-        cumulative_times[name] += end - last_start[name];              \
-    }
+#define START(id) perf::start(app_id, perf::id)
+#define END(id) perf::end(app_id, perf::id)
+#define HIST_START(var) uint64_t var = perf::now()
+#define HIST_END(id, var) perf::record(app_id, id, perf::now() - var)
 #else
-#define TRACK(name) \
-    {               \
+#define START(id) \
+    {             \
     }
-#define START(name) \
-    {               \
+#define END(id) \
+    {           \
     }
-#define END(name) \
-    {             \
+#define HIST_START(var) \
+    {                   \
+    }
+#define HIST_END(id, var) \
+    {                     \
     }
 #endif
 
+#define TRACE_EVENT(type, arg0, arg1)                     \
+    {                                                     \
+        if (tracing)                                      \
+            trace::emit(app_id, trace::type, arg0, arg1); \
+    }
+
 FPGA::FPGA(uint64_t slot, uint64_t app_id, uint64_t base_tlb_addr) : app_id(app_id)
 {
-    TRACK("APP_REG");
-    TRACK("SYS_REG");
-    TRACK("MEM_REG");
-    TRACK("DMA_READ");
-    TRACK("DMA_WRITE");
-    TRACK("ATTACH_PCI");
-    TRACK("HUGE_PAGE");
-    TRACK("ZERO_TLB");
-    //TRACK("DMA_READ_MEMCPY");
+#ifdef PERF
+    perf::reset(app_id, perf::FPGA_COUNTERS, perf::FSRF_COUNTERS);
+    perf::reset(app_id, perf::FPGA_HISTOGRAMS, perf::FSRF_HISTOGRAMS);
+#endif
 
+    
     int rc, fd;
     int xfer_buf_size = 2 << 20;
     // char xdma_str[19];
@@ -71,22 +66,34 @@ FPGA::FPGA(uint64_t slot, uint64_t app_id, uint64_t base_tlb_addr) : app_id(app_
 
     fail_on(rc, out, "Unable to initialize the fpga_mgmt library\n");
 
-    START("ATTACH_PCI");
+    START(ATTACH_PCI);
 
     // Attach PCIe BARs
     rc |= fpga_pci_attach(slot, FPGA_APP_PF, APP_PF_BAR0, 0, &app_bar_handle);
     rc |= fpga_pci_attach(slot, FPGA_APP_PF, APP_PF_BAR1, 0, &sys_bar_handle);
     rc |= fpga_pci_attach(slot, FPGA_APP_PF, APP_PF_BAR4, BURST_CAPABLE, &mem_bar_handle);
     fail_on(rc, out, "Unable to attach PCIe BAR(s)\n");
-    END("ATTACH_PCI");
+    END(ATTACH_PCI);
 
     read_sys_reg(9, app_id * 8, pages_xfered);
 
+#ifdef SIM
+    (void)fd;
+    START(HUGE_PAGE);
+    // the simulated PCIM engine reaches registered buffers, not host RAM
+    xfer_buf = sim::Device::get().dma_alloc(xfer_buf_size, phys_buf);
+    if (xfer_buf == MAP_FAILED)
+    {
+        perror("xfer_buf allocation error");
+        exit(EXIT_FAILURE);
+    }
+    END(HUGE_PAGE);
+#else
     fd = open("/proc/sys/vm/nr_hugepages", O_WRONLY);
     pwrite(fd, "4\n", 3, 0);
     close(fd);
 
-    START("HUGE_PAGE");
+    START(HUGE_PAGE);
 
     xfer_buf = ::mmap(NULL, xfer_buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
     if (xfer_buf == MAP_FAILED)
@@ -112,15 +119,16 @@ FPGA::FPGA(uint64_t slot, uint64_t app_id, uint64_t base_tlb_addr) : app_id(app_
             exit(EXIT_FAILURE);
         }
     }
-    END("HUGE_PAGE");
+    END(HUGE_PAGE);
+#endif
 
-    // zero out TLB
-    START("ZERO_TLB");
-    for (uint64_t ppn = base_tlb_addr; ppn <= 32768; ppn += 512)
+    // zero out TLB, which ends where the 128 MB data region starts
+    START(ZERO_TLB);
+    for (uint64_t ppn = base_tlb_addr; ppn < 32768; ppn += 512)
     {
         dma_wrapper(false, 512, ppn, app_id);
     }
-    END("ZERO_TLB");
+    END(ZERO_TLB);
 out:
     return;
 }
@@ -128,62 +136,56 @@ out:
 FPGA::~FPGA()
 {
 #ifdef PERF
-    for (auto it = cumulative_times.begin(); it != cumulative_times.end(); it++)
-    {
-        std::cout << it->first << "_MS, " << it->second.count() * microseconds::period::num / microseconds::period::den << "\n";
-    }
-    for (auto it = num_calls.begin(); it != num_calls.end(); it++)
-    {
-        std::cout << it->first << "_CALLS, " << it->second << "\n";
-    }
+    perf::report(app_id, perf::FPGA_COUNTERS, perf::FSRF_COUNTERS);
+    perf::report(app_id, perf::FPGA_HISTOGRAMS, perf::FSRF_HISTOGRAMS);
 #endif
 }
 
-int FPGA::read_app_reg(uint64_t app_id, uint64_t addr, uint64_t &value)
+int FPGA::read_app_reg(uint64_t target_app, uint64_t addr, uint64_t &value)
 {
-    START("APP_REG");
-    int res = reg_access(app_bar_handle, app_id, addr, value, false, true);
-    END("APP_REG");
+    START(APP_REG);
+    int res = reg_access(app_bar_handle, target_app, addr, value, false, true);
+    END(APP_REG);
     return res;
 }
 
-int FPGA::write_app_reg(uint64_t app_id, uint64_t addr, uint64_t value)
+int FPGA::write_app_reg(uint64_t target_app, uint64_t addr, uint64_t value)
 {
-    START("APP_REG");
-    int res = reg_access(app_bar_handle, app_id, addr, value, true, true);
-    END("APP_REG");
+    START(APP_REG);
+    int res = reg_access(app_bar_handle, target_app, addr, value, true, true);
+    END(APP_REG);
     return res;
 }
 
-int FPGA::read_sys_reg(uint64_t app_id, uint64_t addr, uint64_t &value)
+int FPGA::read_sys_reg(uint64_t target_app, uint64_t addr, uint64_t &value)
 {
-    START("SYS_REG");
-    int res = reg_access(sys_bar_handle, app_id, addr, value, false, true);
-    END("SYS_REG");
+    START(SYS_REG);
+    int res = reg_access(sys_bar_handle, target_app, addr, value, false, true);
+    END(SYS_REG);
     return res;
 }
 
-int FPGA::write_sys_reg(uint64_t app_id, uint64_t addr, uint64_t value)
+int FPGA::write_sys_reg(uint64_t target_app, uint64_t addr, uint64_t value)
 {
-    START("SYS_REG");
-    int res = reg_access(sys_bar_handle, app_id, addr, value, true, true);
-    END("SYS_REG");
+    START(SYS_REG);
+    int res = reg_access(sys_bar_handle, target_app, addr, value, true, true);
+    END(SYS_REG);
     return res;
 }
 
 int FPGA::read_mem_reg(uint64_t addr, uint64_t &value)
 {
-    START("MEM_REG");
+    START(MEM_REG);
     int res = reg_access(mem_bar_handle, 0, addr, value, false, false);
-    END("MEM_REG");
+    END(MEM_REG);
     return res;
 }
 
 int FPGA::write_mem_reg(uint64_t addr, uint64_t value)
 {
-    START("MEM_REG");
+    START(MEM_REG);
     int res = reg_access(mem_bar_handle, 0, addr, value, true, false);
-    END("MEM_REG");
+    END(MEM_REG);
     return res;
 }
 
@@ -207,34 +209,114 @@ uint64_t FPGA::virt_to_phys(uint64_t virt_addr)
     return (pfn << 12);
 }
 
+uint64_t FPGA::dram_tlb_addr(uint64_t app_id, uint64_t vpn)
+{
+    // these determine the set
+    const uint64_t app_offsets[4] = {0, 32ull << 30, 16ull << 30, 48ull << 30};
+    const uint64_t tlb_bits = 21;
+    uint64_t vpn_index = vpn & ((1 << tlb_bits) - 1);
+
+    // this determines the way
+    uint64_t vpn_offset = (vpn >> tlb_bits) & 0x7;
+    uint64_t dram_addr = vpn_index * 64 + app_offsets[app_id] + vpn_offset * 8;
+    return dram_addr;
+}
+
+uint64_t FPGA::tlb_entry(uint64_t vpn,
+                         uint64_t ppn,
+                         uint64_t writeable,
+                         uint64_t readable,
+                         uint64_t present)
+{
+    // Max of 36 vpn bits
+    ASSERT(vpn < ((uint64_t)1 << 36));
+    // Max of 24 ppn bits
+    ASSERT(ppn < (1 << 24));
+
+    return (vpn << 28) | (ppn << 4) | (writeable << 2) | (readable << 1) | present;
+}
+
 int FPGA::dma_read(void *buf, uint64_t addr, uint64_t bytes)
 {
-    START("DMA_READ");
+    START(DMA_READ);
+    HIST_START(start);
     ASSERT(addr % 0x1000 == 0);
     ASSERT(bytes % 0x1000 == 0);
     uint64_t num_pages = bytes / 0x1000;
     dma_wrapper(true, num_pages, addr / 0x1000, app_id);
-    //START("DMA_READ_MEMCPY");
+    //START(DMA_READ_MEMCPY);
     std::memcpy(buf, xfer_buf, bytes);
-    //END("DMA_READ_MEMCPY");
+    //END(DMA_READ_MEMCPY);
     std::memset(xfer_buf, 0, bytes);
-    END("DMA_READ");
+    stats::add(app_id, stats::BYTES_TO_HOST, bytes);
+    END(DMA_READ);
+    HIST_END(perf::dma_histogram(true, bytes), start);
     return 0;
 }
 
 int FPGA::dma_write(void *buf, uint64_t addr, uint64_t bytes)
 {
-    START("DMA_WRITE");
+    START(DMA_WRITE);
+    HIST_START(start);
     ASSERT(addr % 0x1000 == 0);
     ASSERT(bytes % 0x1000 == 0);
     uint64_t num_pages = bytes / 0x1000;
     std::memcpy(xfer_buf, buf, bytes);
     dma_wrapper(false, num_pages, addr / 0x1000, app_id);
     std::memset(xfer_buf, 0, bytes);
-    END("DMA_WRITE");
+    stats::add(app_id, stats::BYTES_TO_DEVICE, bytes);
+    END(DMA_WRITE);
+    HIST_END(perf::dma_histogram(false, bytes), start);
     return 0;
 }
 
+int FPGA::dma_read_to_file(int fd, uint64_t offset, uint64_t file_bytes, uint64_t addr, uint64_t bytes)
+{
+    START(DMA_READ);
+    HIST_START(start);
+    ASSERT(addr % 0x1000 == 0);
+    ASSERT(bytes % 0x1000 == 0);
+    ASSERT(file_bytes <= bytes);
+    dma_wrapper(true, bytes / 0x1000, addr / 0x1000, app_id);
+    uint64_t done = 0;
+    while (done < file_bytes)
+    {
+        ssize_t res = pwrite(fd, (char *)xfer_buf + done, file_bytes - done, offset + done);
+        if (res <= 0)
+            break;
+        done += res;
+    }
+    std::memset(xfer_buf, 0, bytes);
+    stats::add(app_id, stats::BYTES_TO_HOST, bytes);
+    END(DMA_READ);
+    HIST_END(perf::dma_histogram(true, bytes), start);
+    return done == file_bytes ? 0 : -1;
+}
+
+int FPGA::dma_write_from_file(int fd, uint64_t offset, uint64_t file_bytes, uint64_t addr, uint64_t bytes)
+{
+    START(DMA_WRITE);
+    HIST_START(start);
+    ASSERT(addr % 0x1000 == 0);
+    ASSERT(bytes % 0x1000 == 0);
+    ASSERT(file_bytes <= bytes);
+    // the buffer is zeroed after every transfer, so a short file pads itself
+    uint64_t done = 0;
+    while (done < file_bytes)
+    {
+        ssize_t res = pread(fd, (char *)xfer_buf + done, file_bytes - done, offset + done);
+        if (res <= 0)
+            break;
+        done += res;
+    }
+    dma_wrapper(false, bytes / 0x1000, addr / 0x1000, app_id);
+    std::memset(xfer_buf, 0, bytes);
+    stats::add(app_id, stats::BYTES_TO_DEVICE, bytes);
+    END(DMA_WRITE);
+    HIST_END(perf::dma_histogram(false, bytes), start);
+    return done == file_bytes ? 0 : -1;
+}
+
 void FPGA::dma_wrapper(bool from_device, uint64_t num_pages, uint64_t ppn, uint64_t app_id)
 {
     ASSERT(num_pages <= 512);
@@ -251,6 +333,9 @@ void FPGA::dma_wrapper(bool from_device, uint64_t num_pages, uint64_t ppn, uint6
 
             uint64_t command = pcie_addr | (fpga_addr << 28) | (count << 52) | (channel << 61) | (fpga_read << 63);
             // printf("pcim %lu: %lu %lu %lu %lu %lu -> %lu\n", app_id, pcie_addr, fpga_addr, count, channel, fpga_read, command);
+            TRACE_EVENT(DMA_SUBMIT, ppn, (num_pages << 12) | (fpga_read << 63));
+            stats::add(app_id, stats::DMA_TRANSFERS);
+            stats::add(app_id, stats::DMA_QUEUE_DEPTH);
             write_sys_reg(9, 0, command);
 
             uint64_t pages_done = pages_xfered + num_pages;
@@ -265,6 +350,8 @@ void FPGA::dma_wrapper(bool from_device, uint64_t num_pages, uint64_t ppn, uint6
                 }
                 // usleep(1000000);
             } while (pages_xfered < pages_done);
+            stats::sub(app_id, stats::DMA_QUEUE_DEPTH);
+            TRACE_EVENT(DMA_COMPLETE, ppn, (num_pages << 12) | (fpga_read << 63));
         }
         else
         {
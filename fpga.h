@@ -23,7 +23,17 @@
 const bool file_io = true;
 const bool send_data = true;
 const bool metrics = true;
+#ifdef TRACE
+const bool tracing = true;
+#else
 const bool tracing = false;
+#endif
+#ifdef SIM
+// software device model from sim/, see the sim Makefile targets
+const bool simulated = true;
+#else
+const bool simulated = false;
+#endif
 const bool pcim = true;
 const uint64_t max_apps = 4;
 
@@ -36,19 +46,32 @@ public:
     FPGA(uint64_t slot, uint64_t app_id, uint64_t base_tlb_addr);
     ~FPGA();
 
-    int read_app_reg(uint64_t app_id, uint64_t addr, uint64_t &value);
-    int write_app_reg(uint64_t app_id, uint64_t addr, uint64_t value);
+    int read_app_reg(uint64_t target_app, uint64_t addr, uint64_t &value);
+    int write_app_reg(uint64_t target_app, uint64_t addr, uint64_t value);
 
-    int read_sys_reg(uint64_t app_id, uint64_t addr, uint64_t &value);
-    int write_sys_reg(uint64_t app_id, uint64_t addr, uint64_t value);
+    int read_sys_reg(uint64_t target_app, uint64_t addr, uint64_t &value);
+    int write_sys_reg(uint64_t target_app, uint64_t addr, uint64_t value);
 
     int read_mem_reg(uint64_t addr, uint64_t &value);
     int write_mem_reg(uint64_t addr, uint64_t value);
 
     uint64_t virt_to_phys(uint64_t virt_addr);
 
+    // DRAM TLB layout, shared by every process that programs the TLB
+    static uint64_t dram_tlb_addr(uint64_t app_id, uint64_t vpn);
+    static uint64_t tlb_entry(uint64_t vpn,
+                              uint64_t ppn,
+                              uint64_t writeable,
+                              uint64_t readable,
+                              uint64_t present);
+
     int dma_read(void *buf, uint64_t addr, uint64_t bytes);
     int dma_write(void *buf, uint64_t addr, uint64_t bytes);
+    // Same, staged straight through a file instead of a host buffer: only
+    // file_bytes of the transfer come from or go to fd at offset, the rest
+    // of a write is zeros
+    int dma_read_to_file(int fd, uint64_t offset, uint64_t file_bytes, uint64_t addr, uint64_t bytes);
+    int dma_write_from_file(int fd, uint64_t offset, uint64_t file_bytes, uint64_t addr, uint64_t bytes);
 
     // data management
     void *xfer_buf;
@@ -74,7 +97,4 @@ private:
     int reg_access(pci_bar_handle_t &bar_handle, uint64_t app_id, uint64_t addr,
                    uint64_t &value, bool write, bool mask);
 
-    std::unordered_map<std::string, std::chrono::duration<int64_t, std::nano>> cumulative_times;
-    std::unordered_map<std::string, std::chrono::high_resolution_clock::time_point> last_start;
-    std::unordered_map<std::string, uint64_t> num_calls;
 };
@@ -1,9 +1,18 @@
 #include <assert.h>
 #include <chrono>
 #include <iostream>
+#include <fcntl.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
 
 #include "fsrf.h"
+#include "perf.h"
+#include "policy.h"
+#include "stats.h"
+#include "trace.h"
 
 using namespace std::chrono;
 
@@ -14,8 +23,8 @@ using namespace std::chrono;
     }
 
 #ifdef DEBUG
-#define DBG(x)       \
-    if (fsrf->debug) \
+#define DBG(x) \
+    if (debug)   \
     std::cout << "[" << __FUNCTION__ << ":" << __LINE__ << "]\t" << x << std::endl
 #define ASSERT(b) assert(b)
 #else
@@ -28,67 +37,64 @@ using namespace std::chrono;
 #endif
 
 #ifdef PERF
-#define TRACK(name)                                                      \
-    {                                                                    \
-        fsrf->cumulative_times[name] = std::chrono::nanoseconds::zero(); \
-        fsrf->num_calls[name] = 0;                                       \
-    }
-
-#define START(name)                                                                \
-    {                                                                              \
-        ASSERT(fsrf->cumulative_times.find(name) != fsrf->cumulative_times.end()); \
-        fsrf->last_start[name] = high_resolution_clock::now();                     \
-        fsrf->num_calls[name] += 1;                                                \
-    }
-
-#define END(name)                                                                  \
-    {                                                                              \
-        ASSERT(fsrf->cumulative_times.find(name) != fsrf->cumulative_times.end()); \
-        ASSERT(fsrf->last_start.find(name) != fsrf->last_start.end());             \
-        auto end = high_resolution_clock::now();                                   \
-        fsrf->cumulative_times[name] += end - fsrf->last_start[name];              \
-    }
+#define START(id) perf::start(app_id, perf::id)
+#define END(id) perf::end(app_id, perf::id)
+#define HIST_START(var) uint64_t var = perf::now()
+#define HIST_END(id, var) perf::record(app_id, id, perf::now() - var)
 #else
-#define TRACK(name) \
-    {               \
+#define START(id) \
+    {             \
     }
-#define START(name) \
-    {               \
+#define END(id) \
+    {           \
     }
-#define END(name) \
-    {             \
+#define HIST_START(var) \
+    {                   \
+    }
+#define HIST_END(id, var) \
+    {                     \
     }
 #endif
 
+#define TRACE_EVENT(type, arg0, arg1)                     \
+    {                                                     \
+        if (tracing)                                      \
+            trace::emit(app_id, trace::type, arg0, arg1); \
+    }
+
 #define PAGE_SIZE 0x1000
-// Global instance for the SIGSEGV handler to use
-FSRF *fsrf = nullptr;
+#define XFER_SIZE (2 << 20)
+// runs of TLB entries at least this long are installed by DMA
+#define BULK_TLB_ENTRIES 64
+// Live instances, one per app slot, for the SIGSEGV handler to route faults
+std::atomic<FSRF *> FSRF::instances[max_apps];
 
 FSRF::FSRF(uint64_t app_id, MODE mode, bool debug, int batch_size) : debug(debug),
                                                                      app_id(app_id),
                                                                      mode(mode),
+                                                                     adaptive(batch_size == BATCH_ADAPTIVE),
                                                                      fpga(0, app_id, dram_tlb_addr(0)),
                                                                      num_credits(0),
+                                                                     wait_spin_us(getenv("FSRF_WAIT_SPIN_US") ? strtoull(getenv("FSRF_WAIT_SPIN_US"), nullptr, 0) : 100),
+                                                                     watch_active(false),
+                                                                     credit_waiters(0),
                                                                      lock(),
-                                                                     mmap_dma_size(batch_size * 0x1000)
+                                                                     mmap_dma_size((adaptive ? policy::adaptive_max_pages : batch_size) * 0x1000)
 {
-    if (fsrf != nullptr)
-    {
-        ERR("Global fsrf object already initialized");
-    }
-    fsrf = this;
-
-    TRACK("MMAP");
-    TRACK("MPROTECT");
-    TRACK("MPROTECT_NONE");
-    TRACK("MPROTECT_NONE_TO_R");
-    TRACK("MPROTECT_NONE_TO_RW");
-    TRACK("MPROTECT_RW_TO_R");
 
     if (app_id > 3)
         ERR("app_id must be in range [0, 3]\nGiven: " << app_id);
-    if (mode == FSRF::MODE::NONE)
-        ERR("Mode must not be none");
+    FSRF *expected = nullptr;
+    if (!instances[app_id].compare_exchange_strong(expected, this))
+        ERR("app_id " << app_id << " already has an fsrf object");
+#ifdef PERF
+    perf::reset(app_id, perf::FSRF_COUNTERS, perf::NUM_COUNTERS);
+    perf::reset(app_id, perf::FSRF_HISTOGRAMS, perf::NUM_HISTOGRAMS);
+#endif
+    stats::reset(app_id);
+
+    if (mode == FSRF::MODE::NONE || mode == FSRF::MODE::CPU)
+        ERR("Mode must be a device mode");
     DBG("app_id: " << app_id);
     DBG("mode: " << mode_str(mode));
     DBG("batch_size: " << (void *)mmap_dma_size);
@@ -100,12 +106,15 @@ FSRF::FSRF(uint64_t app_id, MODE mode, bool debug, int batch_size) : debug(debug
     fpga.write_sys_reg(app_id + 4, 0x10, 0x0); // Coyote striping
     fpga.write_sys_reg(8, 0x18, 0x0);          // PCIe coyote striping
 
-    DBG("Registering host signal handler");
-
-    struct sigaction act = {0};
-    act.sa_sigaction = FSRF::handle_host_fault;
-    act.sa_flags = SA_SIGINFO;
-    sigaction(SIGSEGV, &act, NULL);
+    // shared by every instance in the process
+    static std::once_flag registered;
+    std::call_once(registered, []()
+                   {
+                       struct sigaction act = {0};
+                       act.sa_sigaction = FSRF::handle_host_fault;
+                       act.sa_flags = SA_SIGINFO;
+                       sigaction(SIGSEGV, &act, NULL);
+                   });
 
     uint64_t addrs[4] = {0, 8 << 20, 4 << 20, 12 << 20};
     // offset 128 MB for TLB
@@ -113,9 +122,13 @@ FSRF::FSRF(uint64_t app_id, MODE mode, bool debug, int batch_size) : debug(debug
     phys_bound = addrs[app_id] + (16 << 20) / max_apps;
 
     next_free_page = phys_base >> 12;
+    reserve_cached_datasets();
 
     ASSERT(mmap_dma_size % 0x1000 == 0);
 
+    reporter.reset(new stats::Reporter(app_id));
+    TRACE_EVENT(RUN_CONFIG, mode, mmap_dma_size >> 12);
+
     // flush_tlb();
 }
 
@@ -123,21 +136,32 @@ FSRF::~FSRF()
 {
     abort = true;
     faultHandlerThread.join();
-#ifdef PERF
-    for (auto it = cumulative_times.begin(); it != cumulative_times.end(); it++)
+    reporter.reset();
+    instances[app_id] = nullptr;
+    for (auto &entry : vmes)
     {
-        std::cout << it->first << "_MS, " << it->second.count() * microseconds::period::num / microseconds::period::den << "\n";
+        if (entry.second.file != nullptr)
+        {
+            close(entry.second.file->fd);
+            delete entry.second.file;
+        }
     }
-    for (auto it = num_calls.begin(); it != num_calls.end(); it++)
+#ifdef PERF
+    perf::report(app_id, perf::FSRF_COUNTERS, perf::NUM_COUNTERS);
+    perf::report(app_id, perf::FSRF_HISTOGRAMS, perf::NUM_HISTOGRAMS);
+#endif
+    if (tracing)
     {
-        std::cout << it->first << "_CALLS, " << it->second << "\n";
+        const char *prefix = getenv("FSRF_TRACE") ? getenv("FSRF_TRACE") : "fsrf_trace";
+        std::string path = std::string(prefix) + "." + std::to_string(app_id) + ".bin";
+        int64_t events = trace::dump(path.c_str(), app_id);
+        std::cerr << "Wrote " << events << " trace events to " << path << "\n";
     }
-#endif
 }
 
 const char *FSRF::mode_str(MODE mode)
 {
-    constexpr const char *mode_string[4] = {"inv_read", "inv_write", "mmap", "managed"};
+    constexpr const char *mode_string[5] = {"inv_read", "inv_write", "mmap", "managed", "cpu"};
     return mode_string[mode];
 }
 
@@ -158,22 +182,134 @@ uint64_t FSRF::get_num_credits()
     return num_credits;
 }
 
-void *FSRF::fsrf_malloc_managed(uint64_t orig_length, uint64_t host_permissions, uint64_t device_permissions)
+void FSRF::set_wait_spin(uint64_t spin_us)
+{
+    wait_spin_us = spin_us;
+}
+
+bool FSRF::wait_reg(uint64_t addr, uint64_t mask, uint64_t value, uint64_t timeout_us)
+{
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point deadline = start + microseconds(timeout_us);
+    steady_clock::time_point spin_end = start + microseconds(wait_spin_us);
+    if (timeout_us && deadline < spin_end)
+        spin_end = deadline;
+
+    do
+    {
+        if ((cntrlreg_read(addr) & mask) == value)
+            return true;
+    } while (steady_clock::now() < spin_end);
+    if (timeout_us && steady_clock::now() >= deadline)
+        return false;
+
+    // the listener already polls the device, have it check the register too
+    std::lock_guard<std::mutex> serialize(wait_reg_lock);
+    std::unique_lock<std::mutex> guard(wait_lock);
+    watch = {addr, mask, value};
+    watch_matched = false;
+    watch_active = true;
+    if (timeout_us)
+        wait_cv.wait_until(guard, deadline, [this]
+                           { return watch_matched; });
+    else
+        wait_cv.wait(guard, [this]
+                     { return watch_matched; });
+    watch_active = false;
+    return watch_matched;
+}
+
+bool FSRF::wait_credits_drained(uint64_t timeout_us)
+{
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point deadline = start + microseconds(timeout_us);
+    steady_clock::time_point spin_end = start + microseconds(wait_spin_us);
+    if (timeout_us && deadline < spin_end)
+        spin_end = deadline;
+
+    do
+    {
+        if (num_credits == 0)
+            return true;
+    } while (steady_clock::now() < spin_end);
+
+    std::unique_lock<std::mutex> guard(wait_lock);
+    // the listener reads credit_waiters after storing num_credits, so
+    // either it notifies or the predicate already sees 0
+    ++credit_waiters;
+    bool drained;
+    if (timeout_us)
+        drained = wait_cv.wait_until(guard, deadline, [this]
+                                     { return num_credits == 0; });
+    else
+    {
+        wait_cv.wait(guard, [this]
+                     { return num_credits == 0; });
+        drained = true;
+    }
+    --credit_waiters;
+    return drained;
+}
+
+// Called by the listener between fault reads
+void FSRF::poll_watch()
+{
+    std::lock_guard<std::mutex> guard(wait_lock);
+    if (!watch_active)
+        return;
+    if ((cntrlreg_read(watch.addr) & watch.mask) != watch.value)
+        return;
+    watch_matched = true;
+    watch_active = false;
+    wait_cv.notify_all();
+}
+
+perf::LatencySummary FSRF::get_latency(perf::HISTOGRAM id)
+{
+    return perf::summarize(app_id, id);
+}
+
+stats::Snapshot FSRF::fsrf_get_stats()
+{
+    return stats::snapshot(app_id);
+}
+
+void *FSRF::fsrf_malloc_managed(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, int batch_size)
+{
+    return fsrf_malloc(length, host_permissions, device_permissions, MANAGED, batch_size);
+}
+
+void *FSRF::fsrf_malloc(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, MODE mode, int batch_size)
 {
+    if (mode == NONE)
+        mode = this->mode;
+    if (mode < INV_READ || mode > MANAGED)
+        ERR("Allocation mode must be a device mode");
+    if (batch_size < BATCH_ADAPTIVE || batch_size > MAX_BATCH)
+        ERR("Invalid batch size " << batch_size);
+    bool adaptive = batch_size == BATCH_ADAPTIVE || (batch_size == 0 && this->adaptive);
+    uint64_t dma_size = adaptive ? policy::adaptive_max_pages * 0x1000 : batch_size ? (uint64_t)batch_size * 0x1000 : mmap_dma_size;
+
     const std::lock_guard<std::mutex> guard(lock);
+    return allocate_vme(length, host_permissions, device_permissions, mode, dma_size, adaptive);
+}
 
-    ASSERT(mode == MANAGED);
+// Host range aligned on, and rounded up to, the VME's batch. MMAP
+// allocations reserve their device pages here and map them on first use,
+// the others migrate on faults.
+void *FSRF::allocate_vme(uint64_t orig_length, uint64_t host_permissions, uint64_t device_permissions, MODE mode, uint64_t dma_size, bool adaptive)
+{
     uint64_t length = orig_length;
-    DBG("Length " << (void *)length);
-    if (length % mmap_dma_size != 0)
+    DBG("Length " << (void *)length << ", mode " << mode_str(mode));
+    if (length % dma_size != 0)
     {
-        length += mmap_dma_size - (length % mmap_dma_size);
+        length += dma_size - (length % dma_size);
         DBG("Rounding up length to " << (void *)length);
     }
 
-    START("MMAP");
-    void *ptr = mmap(0, length + mmap_dma_size, host_permissions, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    END("MMAP");
+    START(MMAP);
+    void *ptr = mmap(0, length + dma_size, host_permissions, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    END(MMAP);
     if (ptr == MAP_FAILED)
     {
         ERR("mmap failed");
@@ -181,220 +317,461 @@ void *FSRF::fsrf_malloc_managed(uint64_t orig_length, uint64_t host_permissions,
 
     DBG("mmap returned pointer: " << ptr);
     ASSERT(length % PAGE_SIZE == 0);
-    ASSERT(length % mmap_dma_size == 0);
+    ASSERT(length % dma_size == 0);
 
     uint64_t toReturn = (uint64_t)ptr;
 
-    if (toReturn % mmap_dma_size != 0)
+    if (toReturn % dma_size != 0)
     {
-        toReturn = toReturn + (mmap_dma_size - (toReturn % mmap_dma_size));
+        toReturn = toReturn + (dma_size - (toReturn % dma_size));
     }
 
-    DBG("Final mmap range: " << (void *)toReturn << " - " << (void *)(((uint64_t)ptr) + length + mmap_dma_size));
-    ASSERT(toReturn % mmap_dma_size == 0);
-    ASSERT(toReturn + orig_length <= ((uint64_t)ptr) + length + mmap_dma_size);
-    ASSERT(((uint64_t)toReturn + length) % mmap_dma_size == 0);
+    DBG("Final mmap range: " << (void *)toReturn << " - " << (void *)(((uint64_t)ptr) + length + dma_size));
+    ASSERT(toReturn % dma_size == 0);
+    ASSERT(toReturn + orig_length <= ((uint64_t)ptr) + length + dma_size);
+    ASSERT(((uint64_t)toReturn + length) % dma_size == 0);
     ASSERT(toReturn >= (uint64_t)ptr);
 
-    VME vme{toReturn, length, device_permissions, nullptr};
+    VME vme{toReturn, length, device_permissions, nullptr, stats::track_vme(app_id, toReturn, length), nullptr, mode, dma_size, adaptive,
+            policy::BatchTuner(adaptive ? policy::adaptive_start_pages : dma_size >> 12, dma_size >> 12)};
+    stats::set(vme.stats, stats::VME_BATCH_PAGES, vme.tuner.pages);
+    if (mode == MMAP)
+        vme.first_ppn = reserve_device_ppns(length >> 12);
     vmes[toReturn] = vme;
+    TRACE_EVENT(VME_ALLOC, toReturn, length);
+
     return (void *)toReturn;
 }
 
-void *FSRF::fsrf_malloc(uint64_t orig_length, uint64_t host_permissions, uint64_t device_permissions)
+// Maps the batches of an MMAP allocation overlapping [start, end) that
+// aren't mapped yet onto the device pages reserved for them
+void FSRF::map_reserved(VME *vme, uint64_t start, uint64_t end)
 {
-    const std::lock_guard<std::mutex> guard(lock);
+    ASSERT(vme->first_ppn != 0);
+    start -= (start - vme->addr) % vme->dma_size;
+    end = std::min(vme->addr + vme->size, end);
 
-    ASSERT(mode == MMAP);
-    uint64_t length = orig_length;
-    DBG("Length " << (void *)length);
-    if (length % mmap_dma_size != 0)
+    // runs of unmapped batches, each mapped in one go
+    uint64_t run = start;
+    for (uint64_t vaddr = start;; vaddr += vme->dma_size)
     {
-        length += mmap_dma_size - (length % mmap_dma_size);
-        DBG("Rounding up length to " << (void *)length);
+        // a batch is mapped all at once, so its first page tells
+        if (vaddr < end && device_vpn_to_ppn.find(vaddr >> 12) == device_vpn_to_ppn.end())
+            continue;
+        if (vaddr > run)
+        {
+            uint64_t vpn = run >> 12;
+            uint64_t ppn = vme->first_ppn + ((run - vme->addr) >> 12);
+            uint64_t pages = (vaddr - run) >> 12;
+            for (uint64_t page = 0; page < pages; ++page)
+                device_vpn_to_ppn[vpn + page] = ppn + page;
+            stats::add(app_id, stats::PAGES_RESIDENT, pages);
+            write_tlb_run(vpn, ppn, pages, /*writeable*/ true);
+        }
+        if (vaddr >= end)
+            break;
+        run = vaddr + vme->dma_size;
     }
+}
+
+// fd of path, which must hold [offset, offset + length) at a page aligned offset
+static int open_range(const char *path, uint64_t offset, uint64_t length, bool writeable, struct stat &st)
+{
+    if (offset % PAGE_SIZE != 0)
+        ERR("File offset must be page aligned");
+    int fd = open(path, writeable ? O_RDWR : O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0)
+        ERR("Can't open " << path << ": " << strerror(errno));
+    if (offset + length > (uint64_t)st.st_size)
+        ERR(path << " is shorter than the mapping");
+    return fd;
+}
 
-    START("MMAP");
+// Shared host mapping of the file at an mmap_dma_size aligned address,
+// length rounded up. The padding after the file's part stays anonymous, so
+// batches never reach past the end of the file.
+uint64_t FSRF::map_file(int fd, uint64_t offset, uint64_t orig_length, uint64_t length, uint64_t host_permissions)
+{
+    START(MMAP);
     void *ptr = mmap(0, length + mmap_dma_size, host_permissions, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    END("MMAP");
     if (ptr == MAP_FAILED)
     {
         ERR("mmap failed");
     }
-
-    DBG("mmap returned pointer: " << ptr);
-    ASSERT(length % PAGE_SIZE == 0);
-    ASSERT(length % mmap_dma_size == 0);
-
     uint64_t toReturn = (uint64_t)ptr;
-
     if (toReturn % mmap_dma_size != 0)
     {
         toReturn = toReturn + (mmap_dma_size - (toReturn % mmap_dma_size));
     }
+    uint64_t file_pages = (orig_length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (file_pages != 0 && mmap((void *)toReturn, file_pages, host_permissions, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED)
+    {
+        ERR("File mmap failed: " << strerror(errno));
+    }
+    END(MMAP);
+    DBG("File mapping: " << (void *)toReturn << " - " << (void *)(toReturn + length));
+    return toReturn;
+}
 
-    DBG("Final mmap range: " << (void *)toReturn << " - " << (void *)(((uint64_t)ptr) + length + mmap_dma_size));
-    ASSERT(toReturn % mmap_dma_size == 0);
-    ASSERT(toReturn + orig_length <= ((uint64_t)ptr) + length + mmap_dma_size);
-    ASSERT(((uint64_t)toReturn + length) % mmap_dma_size == 0);
-    ASSERT(toReturn >= (uint64_t)ptr);
+void *FSRF::fsrf_mmap(const char *path, uint64_t offset, uint64_t orig_length, uint64_t host_permissions, uint64_t device_permissions)
+{
+    const std::lock_guard<std::mutex> guard(lock);
 
-    VME vme{toReturn, length, device_permissions, nullptr};
+    struct stat st;
+    int fd = open_range(path, offset, orig_length, (host_permissions | device_permissions) & PROT_WRITE, st);
+    uint64_t length = orig_length;
+    if (length % mmap_dma_size != 0)
+        length += mmap_dma_size - (length % mmap_dma_size);
+    uint64_t toReturn = map_file(fd, offset, orig_length, length, host_permissions);
+
+    File *file = new File{fd, offset, orig_length, {}, false};
+    VME vme{toReturn, length, device_permissions, nullptr, stats::track_vme(app_id, toReturn, length), file, mode, mmap_dma_size, adaptive,
+            policy::BatchTuner(adaptive ? policy::adaptive_start_pages : mmap_dma_size >> 12, mmap_dma_size >> 12)};
+    stats::set(vme.stats, stats::VME_BATCH_PAGES, vme.tuner.pages);
     vmes[toReturn] = vme;
+    TRACE_EVENT(VME_ALLOC, toReturn, length);
 
-    uint64_t vpn = toReturn >> 12;
-    for (uint64_t page = 0; page < length >> 12; ++page)
+    if (mode == MMAP)
     {
-        uint64_t device_ppn = allocate_device_ppn();
-        // allocations guaranteed to be contiguous
-        device_vpn_to_ppn[vpn + page] = device_ppn;
-        write_tlb(vpn + page, device_ppn, /*writeable*/ true, true, true, false);
+        // the file is loaded right away, so the whole range is mapped now
+        uint64_t vpn = toReturn >> 12, pages = length >> 12;
+        uint64_t first_ppn = reserve_device_ppns(pages);
+        for (uint64_t page = 0; page < pages; ++page)
+            device_vpn_to_ppn[vpn + page] = first_ppn + page;
+        stats::add(app_id, stats::PAGES_RESIDENT, pages);
+        write_tlb_run(vpn, first_ppn, pages, /*writeable*/ false);
+        file_to_device(&vmes[toReturn], toReturn, first_ppn, length);
     }
 
     return (void *)toReturn;
 }
 
-// Sync entire VME containing addr to host 
-void FSRF::sync_device_to_host(uint64_t *addr)
+// Dataset cache manifest, one file per app slot and name
+struct Manifest
 {
-    ASSERT(mode == MMAP);
-    const std::lock_guard<std::mutex> guard(lock);
-    auto it = vmes.begin();
-    while (it != vmes.end())
-    {
-        VME vme = it->second;
-        // intervals overlap
-        if (((uint64_t) addr >= vme.addr && (uint64_t) addr < (vme.addr + vme.size)))
-        {
-            DBG("VME addr: " << (void*) vme.addr << "\n");
-            // unmap from addr to addr + size
-            for (uint64_t vaddr = vme.addr; vaddr < vme.addr + vme.size; vaddr += mmap_dma_size)
-            {
-                ASSERT(vaddr % mmap_dma_size == 0);
-                ASSERT(vme.size % mmap_dma_size == 0);
+    uint64_t magic;
+    // file identity when the hash was taken, a match skips rehashing
+    uint64_t dev, ino, size, mtime_ns;
+    uint64_t offset, length;
+    uint64_t hash;
+    uint64_t first_ppn, pages;
+};
+
+static const uint64_t manifest_magic = 0x3146454443525346; // "FSRCDEF1"
 
-                ASSERT(device_vpn_to_ppn.find(vaddr >> 12) != device_vpn_to_ppn.end());
+static std::string cache_dir()
+{
+    return getenv("FSRF_CACHE_DIR") ? getenv("FSRF_CACHE_DIR") : "/tmp/fsrf_cache";
+}
 
-                // DBG("Reading " << (uint64_t *)vaddr << " from fpga to host");
+static std::string manifest_path(uint64_t app_id, const char *name)
+{
+    return cache_dir() + "/" + std::to_string(app_id) + "." + name;
+}
 
-                // dma from device to host
-                ASSERT(device_vpn_to_ppn.find(vaddr >> 12) != device_vpn_to_ppn.end());
-                fpga.dma_read((void *)vaddr, device_vpn_to_ppn[vaddr >> 12] << 12, mmap_dma_size);
+static bool read_manifest(const std::string &path, Manifest &manifest)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool ok = pread(fd, &manifest, sizeof(manifest), 0) == sizeof(manifest) && manifest.magic == manifest_magic;
+    close(fd);
+    return ok;
+}
 
-                // DBG("Finished dma read");
-            }
-            return;
-        }
-        else
-        {
-            ++it;
-        }
+// Written aside and renamed, so a crash never leaves half a manifest
+static void write_manifest(const std::string &path, const Manifest &manifest)
+{
+    mkdir(cache_dir().c_str(), 0755);
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, &manifest, sizeof(manifest)) != sizeof(manifest) || fsync(fd) != 0)
+        ERR("Can't write " << tmp << ": " << strerror(errno));
+    close(fd);
+    if (rename(tmp.c_str(), path.c_str()) != 0)
+        ERR("Can't write " << path << ": " << strerror(errno));
+}
+
+static void set_identity(Manifest &manifest, const struct stat &st)
+{
+    manifest.dev = st.st_dev;
+    manifest.ino = st.st_ino;
+    manifest.size = st.st_size;
+    manifest.mtime_ns = st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+}
+
+// 64 bit multiply-xorshift over 8 byte words, tail zero padded
+static uint64_t content_hash(const uint8_t *data, uint64_t bytes)
+{
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ bytes;
+    for (uint64_t i = 0; i < bytes; i += 8)
+    {
+        uint64_t word = 0;
+        memcpy(&word, data + i, std::min<uint64_t>(8, bytes - i));
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ull;
+        hash ^= hash >> 31;
     }
-    ERR("Invalid sync");
+    return hash;
 }
 
-// Sync entire VME containing addr to device
-void FSRF::sync_host_to_device(void *addr)
+// Keeps this slot's allocations clear of every cached dataset's pages
+void FSRF::reserve_cached_datasets()
+{
+    DIR *dir = opendir(cache_dir().c_str());
+    if (dir == nullptr)
+        return;
+    std::string prefix = std::to_string(app_id) + ".";
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        Manifest manifest;
+        if (strncmp(entry->d_name, prefix.c_str(), prefix.size()) == 0 &&
+            read_manifest(cache_dir() + "/" + entry->d_name, manifest))
+            next_free_page = std::max(next_free_page, manifest.first_ppn + manifest.pages);
+    }
+    closedir(dir);
+}
+
+// The device's copy still matches the file on pages spread evenly over the
+// range, ends included, e.g. the FPGA wasn't reloaded since. Reading every
+// page back would cost about as much as loading it.
+bool FSRF::device_holds(int fd, uint64_t offset, uint64_t orig_length, uint64_t first_ppn, uint64_t pages)
+{
+    const uint64_t samples = 64;
+    std::vector<uint8_t> device(PAGE_SIZE), host(PAGE_SIZE);
+    uint64_t file_pages = (orig_length + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (pages < file_pages)
+        return false;
+    for (uint64_t sample = 0; sample < std::min(samples, file_pages); ++sample)
+    {
+        uint64_t page = file_pages <= samples ? sample : sample * (file_pages - 1) / (samples - 1);
+        uint64_t bytes = std::min<uint64_t>(PAGE_SIZE, orig_length - page * PAGE_SIZE);
+        fpga.dma_read(device.data(), (first_ppn + page) << 12, PAGE_SIZE);
+        if (pread(fd, host.data(), bytes, offset + page * PAGE_SIZE) != (ssize_t)bytes ||
+            memcmp(device.data(), host.data(), bytes) != 0)
+            return false;
+    }
+    return true;
+}
+
+void *FSRF::fsrf_mmap_cached(const char *name, const char *path, uint64_t offset, uint64_t orig_length, bool *attached)
 {
-    ASSERT(mode == MMAP);
     const std::lock_guard<std::mutex> guard(lock);
-    auto it = vmes.begin();
-    while (it != vmes.end())
+
+    if (*name == '\0' || strchr(name, '/') != nullptr)
+        ERR("Invalid dataset name " << name);
+    if (orig_length == 0)
+        ERR("Empty dataset " << name);
+    struct stat st;
+    int fd = open_range(path, offset, orig_length, false, st);
+    uint64_t length = orig_length;
+    if (length % mmap_dma_size != 0)
+        length += mmap_dma_size - (length % mmap_dma_size);
+    uint64_t pages = length >> 12;
+    uint64_t toReturn = map_file(fd, offset, orig_length, length, PROT_READ);
+
+    // a changed identity costs a rehash, a changed hash a reload
+    std::string manifest_file = manifest_path(app_id, name);
+    Manifest manifest = {}, current = {manifest_magic};
+    set_identity(current, st);
+    current.offset = offset;
+    current.length = orig_length;
+    // a manifest's pages stay reserved, reused by any dataset they fit
+    bool reserved = read_manifest(manifest_file, manifest);
+    bool fits = reserved && manifest.pages >= pages;
+    bool same_range = fits && manifest.offset == offset && manifest.length == orig_length;
+    bool same_file = same_range && manifest.dev == current.dev && manifest.ino == current.ino &&
+                     manifest.size == current.size && manifest.mtime_ns == current.mtime_ns;
+    bool hashed = false;
+    if (!same_file)
     {
-        VME vme = it->second;
-        if (((uint64_t)addr >= vme.addr && (uint64_t)addr < (vme.addr + vme.size)))
-        {
-            for (uint64_t vaddr = vme.addr; vaddr < vme.addr + vme.size; vaddr += mmap_dma_size)
-            {
-                ASSERT(vaddr % mmap_dma_size == 0);
-                ASSERT(vme.size % mmap_dma_size == 0);
+        current.hash = content_hash((const uint8_t *)toReturn, orig_length);
+        hashed = true;
+        same_file = same_range && current.hash == manifest.hash;
+    }
+    bool attach = same_file && device_holds(fd, offset, orig_length, manifest.first_ppn, pages);
+    DBG("Dataset " << name << (attach ? " attached" : " loading"));
 
-                DBG("Reading " << (uint64_t *)vaddr << " from host to device");
+    File *file = new File{fd, offset, orig_length, {}, true};
+    VME vme{toReturn, length, PROT_READ, nullptr, stats::track_vme(app_id, toReturn, length), file, mode, mmap_dma_size, false};
+    vmes[toReturn] = vme;
+    TRACE_EVENT(VME_ALLOC, toReturn, length);
 
-                // dma from device to host
-                ASSERT(device_vpn_to_ppn.find(vaddr >> 12) != device_vpn_to_ppn.end());
-                fpga.dma_write((void *)vaddr, device_vpn_to_ppn[vaddr >> 12] << 12, mmap_dma_size);
+    // reuse the old pages if they fit, or grow them if nothing was
+    // allocated past them, else the dataset moves to fresh pages
+    uint64_t first_ppn = next_free_page;
+    uint64_t reserved_pages = pages;
+    if (fits)
+    {
+        first_ppn = manifest.first_ppn;
+        reserved_pages = manifest.pages;
+        stats::add(app_id, stats::PAGES_ALLOCATED, pages);
+        stats::add(app_id, stats::PAGES_RESIDENT, pages);
+    }
+    else if (reserved && manifest.first_ppn + manifest.pages == next_free_page)
+    {
+        first_ppn = manifest.first_ppn;
+        stats::add(app_id, stats::PAGES_ALLOCATED, manifest.pages);
+        stats::add(app_id, stats::PAGES_RESIDENT, manifest.pages);
+        for (uint64_t page = manifest.pages; page < pages; ++page)
+            allocate_device_ppn();
+    }
+    else
+    {
+        for (uint64_t page = 0; page < pages; ++page)
+            allocate_device_ppn();
+    }
+    uint64_t vpn = toReturn >> 12;
+    for (uint64_t page = 0; page < pages; ++page)
+        device_vpn_to_ppn[vpn + page] = first_ppn + page;
+    write_tlb_run(vpn, first_ppn, pages, /*writeable*/ false);
 
-                DBG("Finished dma write");
-            }
-            return;
-        }
-        else
+    if (!attach)
+    {
+        if (!hashed)
+            current.hash = content_hash((const uint8_t *)toReturn, orig_length);
+        file_to_device(&vmes[toReturn], toReturn, first_ppn, length);
+    }
+    else if (!hashed)
+    {
+        current.hash = manifest.hash;
+    }
+    current.first_ppn = first_ppn;
+    current.pages = reserved_pages;
+    // new contents, pages or file identity
+    if (memcmp(&current, &manifest, sizeof(current)) != 0)
+        write_manifest(manifest_file, current);
+
+    if (attached != nullptr)
+        *attached = attach;
+    return (void *)toReturn;
+}
+
+void FSRF::fsrf_msync(void *addr)
+{
+    const std::lock_guard<std::mutex> guard(lock);
+    VME *vme = find_vme((uint64_t)addr);
+    if (vme == nullptr || vme->file == nullptr)
+        ERR("Not an fsrf_mmap allocation: " << addr);
+    File *file = vme->file;
+
+    // runs of dirty pages that are contiguous on the device, one DMA each
+    auto it = file->dirty_vpns.begin();
+    while (it != file->dirty_vpns.end())
+    {
+        uint64_t vpn = *it, ppn = device_vpn_to_ppn[vpn], pages = 0;
+        while (it != file->dirty_vpns.end() && *it == vpn + pages && device_vpn_to_ppn[*it] == ppn + pages &&
+               pages < XFER_SIZE / PAGE_SIZE)
         {
+            // clean again before the copy, so later writes fault and count
+            write_tlb(*it, ppn + pages, false, true, true, false);
+            ++pages;
             ++it;
         }
+
+        uint64_t pos = (vpn << 12) - vme->addr;
+        uint64_t file_bytes = pos < file->length ? std::min(pages << 12, file->length - pos) : 0;
+        if (fpga.dma_read_to_file(file->fd, file->offset + pos, file_bytes, ppn << 12, pages << 12) != 0)
+            ERR("Write back failed: " << strerror(errno));
+        stats::add(vme->stats, stats::VME_BYTES_TO_HOST, pages << 12);
     }
-    ERR("Invalid sync");
+    file->dirty_vpns.clear();
+
+    // host writes went to the page cache through the shared mapping
+    if (fdatasync(file->fd) != 0)
+        ERR("fdatasync failed: " << strerror(errno));
 }
 
-// brings back the dma batch size containing addr to the host
-void FSRF::sync_managed(uint64_t *addr)
+// Device pages from ppn get the file's bytes for [vaddr, vaddr + bytes),
+// zeros past the part the file backs
+void FSRF::file_to_device(VME *vme, uint64_t vaddr, uint64_t ppn, uint64_t bytes)
 {
-    DBG("In method");
-    uint64_t vaddr = (uint64_t)addr;
-    if (vaddr % mmap_dma_size != 0)
-        vaddr -= vaddr % mmap_dma_size;
-    ASSERT(mode == MANAGED);
-    DBG("Getting VMEs");
-    auto it = vmes.begin();
-    DBG("Entering while loop");
-    while (it != vmes.end())
+    File *file = vme->file;
+    for (uint64_t done = 0; done < bytes; done += XFER_SIZE)
     {
-        VME vme = it->second;
-        DBG("VME addr: " << (void *)vme.addr);
-        // this is the right vme entry
-        if (vaddr >= vme.addr && (vaddr < (vme.addr + vme.size)))
-        {
-            DBG("MANAGED mode bringing back " << (void *)addr << "\n");
-            // make available on the host
-            timed_mprotect((void *)addr, mmap_dma_size, PROT_READ | PROT_WRITE);
-
-            // unmap from addr to vaddr + mmap_dma_size on device
-            ASSERT(vaddr % mmap_dma_size == 0);
-            ASSERT(vme.size % mmap_dma_size == 0);
+        uint64_t len = std::min<uint64_t>(XFER_SIZE, bytes - done);
+        uint64_t pos = vaddr + done - vme->addr;
+        uint64_t file_bytes = pos < file->length ? std::min(len, file->length - pos) : 0;
+        if (fpga.dma_write_from_file(file->fd, file->offset + pos, file_bytes, (ppn << 12) + done, len) != 0)
+            ERR("Read of the backing file failed: " << strerror(errno));
+    }
+    stats::add(vme->stats, stats::VME_BYTES_TO_DEVICE, bytes);
+}
 
-            // this page was never put on the device
-            if (device_vpn_to_ppn.find(vaddr >> 12) == device_vpn_to_ppn.end())
-                continue;
+// Sync entire VME containing addr to host 
+void FSRF::sync_device_to_host(uint64_t *addr)
+{
+    sync_range((uint64_t)addr, 0, false);
+}
 
-            for (uint64_t curr = vaddr; curr < vaddr + mmap_dma_size; curr += 0x1000)
-            {
-                uint64_t vpn = curr >> 12;
-                ASSERT(device_vpn_to_ppn.find(vpn) != device_vpn_to_ppn.end());
-                write_tlb(vpn, device_vpn_to_ppn[vpn], false, false, false, false);
-            }
-            // timed_mprotect((void *)vaddr, mmap_dma_size, PROT_READ | PROT_WRITE);
+// Sync entire VME containing addr to device
+void FSRF::sync_host_to_device(void *addr)
+{
+    sync_range((uint64_t)addr, 0, true);
+}
 
-            DBG("Reading " << (uint64_t *)vaddr << " from fpga to host");
+void FSRF::sync_device_to_host(void *addr, uint64_t length)
+{
+    if (length != 0)
+        sync_range((uint64_t)addr, length, false);
+}
 
-            // dma from device to host
-            ASSERT(device_vpn_to_ppn.find(vaddr >> 12) != device_vpn_to_ppn.end());
-            fpga.dma_read((void *)vaddr, device_vpn_to_ppn[vaddr >> 12] << 12, mmap_dma_size);
+void FSRF::sync_host_to_device(void *addr, uint64_t length)
+{
+    if (length != 0)
+        sync_range((uint64_t)addr, length, true);
+}
 
-            DBG("Finished dma read");
+// Copy the batches of the VME containing addr that overlap
+// [addr, addr + length), or the whole VME if length is 0
+void FSRF::sync_range(uint64_t addr, uint64_t length, bool to_device)
+{
+    const std::lock_guard<std::mutex> guard(lock);
+    VME *vme = find_vme(addr);
+    if (vme == nullptr || vme->mode != MMAP)
+        ERR("Invalid sync");
+    uint64_t dma_size = vme->dma_size;
+    ASSERT(vme->size % dma_size == 0);
+
+    uint64_t start = vme->addr, end = vme->addr + vme->size;
+    if (length != 0)
+    {
+        start = addr - (addr - vme->addr) % dma_size;
+        end = std::min(end, addr + length);
+    }
+    if (to_device && vme->first_ppn != 0)
+        map_reserved(vme, start, end);
 
-            for (uint64_t curr = vaddr; curr < vaddr + mmap_dma_size; curr += 0x1000)
-            {
-                uint64_t vpn = curr >> 12;
-                // this page was never put on the device
-                if (device_vpn_to_ppn.find(vpn) == device_vpn_to_ppn.end())
-                    continue;
-                // free up device page
-                fsrf->free_device_vpn(vpn);
-            }
-            return;
+    DBG("VME addr: " << (void *)vme->addr << "\n");
+    TRACE_EVENT(SYNC_BEGIN, start, to_device);
+    for (uint64_t vaddr = start; vaddr < end; vaddr += dma_size)
+    {
+        ASSERT(vaddr % dma_size == 0);
+        auto mapped = device_vpn_to_ppn.find(vaddr >> 12);
+        // the device never used this batch
+        if (mapped == device_vpn_to_ppn.end())
+        {
+            ASSERT(!to_device);
+            continue;
+        }
+        uint64_t device_addr = mapped->second << 12;
+        if (to_device)
+        {
+            fpga.dma_write((void *)vaddr, device_addr, dma_size);
+            stats::add(vme->stats, stats::VME_BYTES_TO_DEVICE, dma_size);
         }
         else
         {
-            ++it;
+            fpga.dma_read((void *)vaddr, device_addr, dma_size);
+            stats::add(vme->stats, stats::VME_BYTES_TO_HOST, dma_size);
         }
     }
-    ERR("Couldn't find vme entry");
+    TRACE_EVENT(SYNC_END, start, to_device);
 }
 
 void FSRF::fsrf_free(uint64_t *addr)
 {
-    ASSERT(mode == MMAP);
+    const std::lock_guard<std::mutex> guard(lock);
     auto it = vmes.begin();
     while (it != vmes.end())
     {
@@ -414,8 +791,15 @@ void FSRF::fsrf_free(uint64_t *addr)
                 // No DMA back on free
 
                 // free up device page
-                fsrf->free_device_vpn(vpn);
+                free_device_vpn(vpn);
+            }
+            if (vme.file != nullptr)
+            {
+                close(vme.file->fd);
+                delete vme.file;
             }
+            stats::untrack_vme(vme.stats);
+            TRACE_EVENT(VME_FREE, vme.addr, vme.size);
             it = vmes.erase(it);
         }
         else
@@ -425,10 +809,128 @@ void FSRF::fsrf_free(uint64_t *addr)
     }
 }
 
+void *FSRF::fsrf_malloc_small(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, MODE mode)
+{
+    if (mode == NONE)
+        mode = this->mode;
+    if (length > SlabAllocator::max_object)
+        return fsrf_malloc(length, host_permissions, device_permissions, mode);
+
+    const std::lock_guard<std::mutex> guard(slab_lock);
+    std::unique_ptr<SlabAllocator> &slab = slabs[mode | host_permissions << 8 | device_permissions << 16];
+    if (!slab)
+    {
+        auto new_region = [=](uint64_t bytes)
+        { return fsrf_malloc(bytes, host_permissions, device_permissions, mode); };
+        slab.reset(new SlabAllocator(new_region, mmap_dma_size > SlabAllocator::min_region ? mmap_dma_size : SlabAllocator::min_region));
+    }
+    return slab->allocate(length);
+}
+
+void FSRF::fsrf_free_small(void *addr)
+{
+    {
+        const std::lock_guard<std::mutex> guard(slab_lock);
+        for (auto &slab : slabs)
+        {
+            if (!slab.second->owns(addr))
+                continue;
+            // never fall back to freeing the region under its neighbors
+            if (!slab.second->free(addr))
+                ERR("Invalid small free of " << addr);
+            return;
+        }
+    }
+    // a large object with its own allocation
+    fsrf_free((uint64_t *)addr);
+}
+
+void FSRF::sync_small_to_host(void *addr)
+{
+    sync_small(addr, false);
+}
+
+void FSRF::sync_small_to_device(void *addr)
+{
+    sync_small(addr, true);
+}
+
+void FSRF::sync_small(void *addr, bool to_device)
+{
+    uint64_t bytes = 0;
+    bool owned = false;
+    {
+        const std::lock_guard<std::mutex> guard(slab_lock);
+        for (auto &slab : slabs)
+        {
+            if (slab.second->owns(addr))
+            {
+                owned = true;
+                bytes = slab.second->size_of(addr);
+                break;
+            }
+        }
+    }
+    if (!owned)
+    {
+        sync_range((uint64_t)addr, 0, to_device);
+        return;
+    }
+    if (bytes == 0)
+        ERR("Invalid small sync of " << addr);
+
+    const std::lock_guard<std::mutex> guard(lock);
+    VME *vme = find_vme((uint64_t)addr);
+    if (vme == nullptr || vme->mode != MMAP)
+        ERR("Invalid sync");
+    // objects never straddle a page
+    uint64_t page = (uint64_t)addr & ~0xFFFull;
+    if (to_device && vme->first_ppn != 0)
+        map_reserved(vme, page, page + 0x1000);
+    auto mapped = device_vpn_to_ppn.find(page >> 12);
+    // the device never used this batch
+    if (mapped == device_vpn_to_ppn.end())
+    {
+        ASSERT(!to_device);
+        return;
+    }
+
+    char copy[0x1000];
+    fpga.dma_read(copy, mapped->second << 12, 0x1000);
+    if (to_device)
+    {
+        memcpy(copy + ((uint64_t)addr - page), addr, bytes);
+        fpga.dma_write(copy, mapped->second << 12, 0x1000);
+        stats::add(vme->stats, stats::VME_BYTES_TO_DEVICE, bytes);
+    }
+    else
+    {
+        memcpy(addr, copy + ((uint64_t)addr - page), bytes);
+        stats::add(vme->stats, stats::VME_BYTES_TO_HOST, bytes);
+    }
+}
+
+// Contiguous device pages, mapped later
+uint64_t FSRF::reserve_device_ppns(uint64_t pages)
+{
+    uint64_t toReturn = next_free_page;
+    next_free_page += pages;
+    stats::add(app_id, stats::PAGES_ALLOCATED, pages);
+
+    if (toReturn < phys_bound >> 12 && next_free_page >= phys_bound >> 12)
+    {
+        ERR("Too many pages allocated");
+    }
+
+    return toReturn;
+}
+
 uint64_t FSRF::allocate_device_ppn()
 {
     uint64_t toReturn = next_free_page;
     next_free_page += 1;
+    stats::add(app_id, stats::PAGES_ALLOCATED);
+    stats::add(app_id, stats::PAGES_RESIDENT);
 
     if (next_free_page == phys_bound >> 12)
     {
@@ -443,6 +945,23 @@ void FSRF::free_device_vpn(uint64_t vpn)
     // allocated_device_ppns.erase(device_vpn_to_ppn[vpn]);
     ASSERT(device_vpn_to_ppn.find(vpn) != device_vpn_to_ppn.end());
     device_vpn_to_ppn.erase(vpn);
+    stats::sub(app_id, stats::PAGES_RESIDENT);
+    // the data went back to the host's file mapping
+    VME *vme = find_vme(vpn << 12);
+    if (vme != nullptr && vme->file != nullptr)
+        vme->file->dirty_vpns.erase(vpn);
+}
+
+// VME containing vaddr, null if it isn't an fsrf allocation
+FSRF::VME *FSRF::find_vme(uint64_t vaddr)
+{
+    auto it = vmes.upper_bound(vaddr);
+    if (it == vmes.begin())
+        return nullptr;
+    --it;
+    if (vaddr >= it->second.addr + it->second.size)
+        return nullptr;
+    return &it->second;
 }
 
 uint64_t FSRF::read_tlb_fault()
@@ -456,6 +975,8 @@ void FSRF::respond_tlb(uint64_t ppn, uint64_t valid)
 {
     uint64_t resp = 0 | (ppn << 1) | valid;
     fpga.write_sys_reg(app_id, 0x0, resp);
+    HIST_END(perf::RESPOND_TLB_LATENCY, fault_arrival);
+    TRACE_EVENT(DEVICE_FAULT_END, ppn, valid);
 }
 
 void FSRF::flush_tlb()
@@ -479,194 +1000,192 @@ void FSRF::write_tlb(uint64_t vpn,
 {
     ASSERT(!huge);
 
-    // Max of 36 vpn bits
-    ASSERT(vpn < ((uint64_t)1 << 36));
-    // Max of 24 ppn bits
-    ASSERT(ppn < (1 << 24));
-
     uint64_t tlb_addr = dram_tlb_addr(vpn);
-    uint64_t entry = (vpn << 28) | (ppn << 4) | (writeable << 2) | (readable << 1) | present;
+    uint64_t entry = FPGA::tlb_entry(vpn, ppn, writeable, readable, present);
     // DBG("Entry " << (void *)entry);
+    TRACE_EVENT(TLB_WRITE, vpn, entry);
 
     fpga.write_mem_reg(tlb_addr, entry);
 }
 
-uint64_t FSRF::dram_tlb_addr(uint64_t vpn)
+// Entries for pages consecutive vpns, mapped to consecutive ppns. The sets
+// of consecutive vpns lie 64 bytes apart in DRAM, so long runs read their
+// sets back by DMA, fill in their way and write them out again instead of
+// taking one MMIO write per entry.
+void FSRF::write_tlb_run(uint64_t vpn, uint64_t ppn, uint64_t pages, uint64_t writeable)
 {
-    // these determine the set
-    const uint64_t app_offsets[4] = {0, 32ull << 30, 16ull << 30, 48ull << 30};
-    const uint64_t tlb_bits = 21;
-    uint64_t vpn_index = vpn & ((1 << tlb_bits) - 1);
+    const uint64_t set_mask = (1ull << 21) - 1; // see FPGA::dram_tlb_addr
+    while (pages != 0)
+    {
+        uint64_t tlb_addr = dram_tlb_addr(vpn);
+        uint64_t first = tlb_addr & ~(uint64_t)(PAGE_SIZE - 1);
+        // the way changes where the set index wraps
+        uint64_t run = std::min(pages, (set_mask + 1) - (vpn & set_mask));
+        run = std::min(run, (XFER_SIZE - (tlb_addr - first)) / 64);
+        if (run < BULK_TLB_ENTRIES)
+        {
+            for (uint64_t page = 0; page < run; ++page)
+                write_tlb(vpn + page, ppn + page, writeable, true, true, false);
+        }
+        else
+        {
+            uint64_t bytes = (tlb_addr - first + run * 64 + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+            uint64_t *sets = (uint64_t *)fpga.xfer_buf;
+            fpga.dma_wrapper(true, bytes >> 12, first >> 12, app_id);
+            for (uint64_t page = 0; page < run; ++page)
+                sets[(tlb_addr - first) / 8 + page * 8] = FPGA::tlb_entry(vpn + page, ppn + page, writeable, true, true);
+            fpga.dma_wrapper(false, bytes >> 12, first >> 12, app_id);
+            memset(fpga.xfer_buf, 0, bytes);
+        }
+        vpn += run;
+        ppn += run;
+        pages -= run;
+    }
+}
 
-    // this determines the way
-    uint64_t vpn_offset = (vpn >> tlb_bits) & 0x7;
-    uint64_t dram_addr = vpn_index * 64 + app_offsets[app_id] + vpn_offset * 8;
-    return dram_addr;
+uint64_t FSRF::dram_tlb_addr(uint64_t vpn)
+{
+    return FPGA::dram_tlb_addr(app_id, vpn);
 }
 
-void FSRF::handle_device_fault(bool read, uint64_t vpn)
+// Returns the mode whose policy handled the fault
+FSRF::MODE FSRF::handle_device_fault(bool read, uint64_t vpn)
 {
     // TODO: check permissions of vpn on the host
     // for now assume R/W on my vpn
-
-    // if permissions are readable or writeable
-    // set to read only while we copy it over
-    // this ensures no one is editing during the DMA
-    uint64_t vaddr = vpn << 12;
-    uint64_t bytes = 1 << 12;
-
-    DBG("Handling device fault at: " << (uint64_t *)vaddr);
+    DBG("Handling device fault at: " << (uint64_t *)(vpn << 12));
 
     // make sure the host fault handler isn't messing with my data structures
     // at the same time
     const std::lock_guard<std::mutex> guard(lock);
 
-    if (mode == MODE::INV_READ)
-    {
-        // find a place to put the data
-        uint64_t device_ppn = allocate_device_ppn();
-        // put the data there
-        fpga.dma_write((void *)vaddr, device_ppn << 12, bytes);
-        // remember where we put it
-        device_vpn_to_ppn[vpn] = device_ppn;
-
-        // make it inaccessible on the host
-        timed_mprotect((void *)vaddr, bytes, PROT_NONE);
+    bool resident = device_vpn_to_ppn.find(vpn) != device_vpn_to_ppn.end();
+    VME *fault_vme = find_vme(vpn << 12);
+    stats::Vme *vme_stats = fault_vme != nullptr ? fault_vme->stats : nullptr;
+    File *file = fault_vme != nullptr ? fault_vme->file : nullptr;
+    // memory outside any allocation follows the instance's policy
+    MODE fault_mode = fault_vme != nullptr ? fault_vme->mode : mode;
+    uint64_t batch_pages = (fault_vme != nullptr ? fault_vme->dma_size : mmap_dma_size) >> 12;
 
-        // create a tlb entry
-        write_tlb(vpn, device_ppn, /*writeable*/ true, true, true, false);
+    if (file != nullptr && file->cached && !read)
+        ERR("Device wrote to a cached dataset, which is read only");
 
-        // respond to the fault
-        respond_tlb(device_ppn, true);
-    }
-    else if (mode == MODE::INV_WRITE)
+    // first device write to a clean file page, INV_WRITE's own upgrade
+    // below also takes the page from the host
+    if (file != nullptr && resident && !read && fault_mode != INV_WRITE)
     {
+        stats::add(vme_stats, stats::VME_DEVICE_FAULTS);
+        TRACE_EVENT(MODE_DECISION, trace::UPGRADE_WRITEABLE, 1);
+        file->dirty_vpns.insert(vpn);
+        write_tlb(vpn, device_vpn_to_ppn[vpn], true, true, true, false);
+        respond_tlb(device_vpn_to_ppn[vpn], true);
+        return fault_mode;
+    }
 
-        // If we are reading, we need to make it readable on the host and device
-        if (read)
-        {
-            START("MPROTECT_RW_TO_R");
-            timed_mprotect((void *)vaddr, bytes, PROT_READ);
-            // it is already readonly on the host at this point
-            END("MPROTECT_RW_TO_R");
-
-            // find a place to put the data
-            uint64_t device_ppn = allocate_device_ppn();
-            // put the data there
-            fpga.dma_write((void *)vaddr, device_ppn << 12, bytes);
-            // remember where we put it
-            device_vpn_to_ppn[vpn] = device_ppn;
-
-            // create a tlb entry
-            write_tlb(vpn, device_ppn, /*writeable*/ false, true, true, false);
+    // MMAP allocations map their reserved pages on first use, nothing to copy
+    if (fault_mode == MMAP && fault_vme != nullptr && fault_vme->first_ppn != 0 && !resident)
+    {
+        stats::add(vme_stats, stats::VME_DEVICE_FAULTS);
+        TRACE_EVENT(MODE_DECISION, trace::MAP_RESERVED, fault_vme->dma_size >> 12);
+        map_reserved(fault_vme, vpn << 12, (vpn + 1) << 12);
+        respond_tlb(device_vpn_to_ppn[vpn], true);
+        return fault_mode;
+    }
 
-            // respond to the fault
-            respond_tlb(device_ppn, true);
-        }
-        // if it's a write, there are two cases.
-        // either the page is already readable on the device, or this is a blind write.
-        else
-        {
-            // the page is already on the device, we just need to invalidate it on the host
-            // and make it writeable on the device
-            if (device_vpn_to_ppn.find(vpn) != device_vpn_to_ppn.end())
-            {
-                timed_mprotect((void *)vaddr, bytes, PROT_NONE);
-                write_tlb(vpn, device_vpn_to_ppn[vpn], /*writeable*/ true, true, true, false);
-                respond_tlb(device_vpn_to_ppn[vpn], true);
-            }
-            // we need to allocate a page on the device. invalidate on host. RW on device
-            else
-            {
-                // find a place to put the data
-                uint64_t device_ppn = allocate_device_ppn();
-                // put the data there
-                fpga.dma_write((void *)vaddr, device_ppn << 12, bytes);
-                // remember where we put it
-                device_vpn_to_ppn[vpn] = device_ppn;
+    bool tuned = fault_mode == MANAGED && fault_vme != nullptr && fault_vme->adaptive && !resident;
+    bool stream_hit = false;
+    if (tuned)
+        batch_pages = fault_vme->tuner.on_fault(vpn, stream_hit);
 
-                // create a tlb entry
-                write_tlb(vpn, device_ppn, /*writeable*/ true, true, true, false);
+    policy::DevicePlan plan = policy::plan_device_fault((policy::MODE)fault_mode, read, vpn, resident, batch_pages);
+    if (!plan.valid)
+        ERR("Device should not fault for " << mode_str(fault_mode) << " mode");
+    if (fault_mode == MANAGED && plan.copy)
+        policy::trim_to_missing(plan, vpn, [this](uint64_t page)
+                                { return device_vpn_to_ppn.find(page) != device_vpn_to_ppn.end(); });
 
-                // invalidate on host
-                timed_mprotect((void *)vaddr, bytes, PROT_NONE);
+    stats::add(vme_stats, stats::VME_DEVICE_FAULTS);
+    if (plan.needs_vme && fault_vme == nullptr)
+        ERR("Invalid device access");
+    TRACE_EVENT(MODE_DECISION, plan.decision, plan.map ? plan.pages : 0);
 
-                // respond to the fault
-                respond_tlb(device_ppn, true);
-            }
-        }
-    }
-    else if (mode == MMAP)
+    if (plan.decision == trace::ALREADY_PRESENT)
     {
-        ERR("Device should not fault for MMAP mode");
+        DBG("Data is already there!");
+        std::cout << "data already here\n";
     }
-    else
-    {
-        ASSERT(mode == MANAGED);
-        // and make it writeable on the device
-        if (device_vpn_to_ppn.find(vpn) != device_vpn_to_ppn.end())
-        {
-            DBG("Data is already there!");
-            std::cout << "data already here\n";
-            respond_tlb(device_vpn_to_ppn[vpn], true);
-            return;
-        }
-
-        uint64_t device_ppn = -1;
-        VME vme;
-
-        uint64_t fault_vpn = vaddr >> 12;
 
-        // align vaddr / vpn to mmap_dma_size
-        vaddr -= vaddr % mmap_dma_size;
-        vpn = vaddr >> 12;
+    uint64_t vaddr = plan.vpn << 12;
+    uint64_t bytes = plan.pages << 12;
 
-        DBG("Aligned vaddr: " << (void *)vaddr);
+    // e.g. read only while we copy it over, so no one edits during the DMA
+    if (plan.prot_before_copy != policy::KEEP_PROT)
+    {
+        if (plan.prot_before_copy == PROT_READ)
+            START(MPROTECT_RW_TO_R);
+        timed_mprotect((void *)vaddr, bytes, plan.prot_before_copy);
+        if (plan.prot_before_copy == PROT_READ)
+            END(MPROTECT_RW_TO_R);
+    }
 
-        for (auto it = vmes.begin(); it != vmes.end(); ++it)
+    if (plan.copy)
+    {
+        // find a place to put the data, allocations guaranteed to be contiguous
+        uint64_t device_ppn = allocate_device_ppn();
+        device_vpn_to_ppn[plan.vpn] = device_ppn;
+        for (uint64_t page = 1; page < plan.pages; ++page)
         {
-            vme = it->second;
-            // This is a valid mmapped address
-            if (vaddr >= vme.addr && vaddr < vme.addr + vme.size)
-            {
-                ASSERT(vme.addr % mmap_dma_size == 0);
-                ASSERT(vme.size % mmap_dma_size == 0);
-                DBG("Found suitable VME");
-                device_ppn = allocate_device_ppn();
-                device_vpn_to_ppn[vpn] = device_ppn;
-                for (uint64_t page = 1; page < mmap_dma_size >> 12; ++page)
-                {
-                    // allocations guaranteed to be contiguous
 #ifdef DEBUG
-                    uint64_t next_ppn = allocate_device_ppn();
-                    ASSERT(next_ppn == device_ppn + page);
+            uint64_t next_ppn = allocate_device_ppn();
+            ASSERT(next_ppn == device_ppn + page);
 #else
-                    allocate_device_ppn();
+            allocate_device_ppn();
 #endif
-                    device_vpn_to_ppn[vpn + page] = device_ppn + page;
-                }
+            device_vpn_to_ppn[plan.vpn + page] = device_ppn + page;
+        }
 
-                // fpga.dma_write((void *)vaddr, device_ppn << 12, mmap_dma_size);
+        // put the data there
+        if (file != nullptr)
+        {
+            file_to_device(fault_vme, vaddr, device_ppn, bytes);
+        }
+        else
+        {
+            fpga.dma_write((void *)vaddr, device_ppn << 12, bytes);
+            stats::add(vme_stats, stats::VME_BYTES_TO_DEVICE, bytes);
+        }
 
-                // write_tlb(vpn, device_ppn, /*writeable*/ true, true, true, false);
-                // respond_tlb(device_ppn, true);
+        if (fault_mode == MANAGED && fault_vme != nullptr)
+            fault_vme->batches[plan.vpn] = plan.pages;
+        if (tuned)
+        {
+            fault_vme->tuner.migrated(vpn, plan.vpn + plan.pages);
+            stats::set(vme_stats, stats::VME_BATCH_PAGES, fault_vme->tuner.pages);
+            if (stream_hit)
+                stats::add(vme_stats, stats::VME_BATCH_HITS);
+        }
+    }
 
-                // for (uint64_t page = 1; page < mmap_dma_size >> 12; ++page)
-                for (uint64_t page = 0; page < mmap_dma_size >> 12; ++page)
-                {
-                    ASSERT(device_vpn_to_ppn[vpn + page] == device_ppn + page);
-                    write_tlb(vpn + page, device_ppn + page, /*writeable*/ true, true, true, false);
-                }
+    if (plan.prot_after_copy != policy::KEEP_PROT)
+        timed_mprotect((void *)vaddr, bytes, plan.prot_after_copy);
 
-                fpga.dma_write((void *)vaddr, device_ppn << 12, mmap_dma_size);
-                timed_mprotect((void *)vaddr, mmap_dma_size, PROT_NONE);
-                ASSERT(device_vpn_to_ppn.find(fault_vpn) != device_vpn_to_ppn.end());
-                respond_tlb(device_vpn_to_ppn[fault_vpn], true);
-                return;
-            }
+    if (plan.map)
+    {
+        for (uint64_t page = 0; page < plan.pages; ++page)
+        {
+            ASSERT(device_vpn_to_ppn.find(plan.vpn + page) != device_vpn_to_ppn.end());
+            // only the page being written starts out dirty
+            bool writeable = plan.writeable && (file == nullptr || (!read && plan.vpn + page == vpn));
+            if (file != nullptr && writeable)
+                file->dirty_vpns.insert(vpn);
+            write_tlb(plan.vpn + page, device_vpn_to_ppn[plan.vpn + page], writeable, true, true, false);
         }
-        ERR("Invalid device access");
     }
+
+    // respond to the fault
+    ASSERT(device_vpn_to_ppn.find(vpn) != device_vpn_to_ppn.end());
+    respond_tlb(device_vpn_to_ppn[vpn], true);
+    return fault_mode;
 }
 
 void FSRF::device_fault_listener()
@@ -680,12 +1199,38 @@ void FSRF::device_fault_listener()
         ASSERT(fault != (uint64_t)-1);
         if (!(fault & 1))
         {
+            uint64_t prev_credits = num_credits;
             num_credits = fault >> 57;
+            stats::set(app_id, stats::CREDITS_OUTSTANDING, num_credits);
+            if (prev_credits == 0 && num_credits != 0)
+                stats::add(app_id, stats::CREDIT_STALLS);
+            if (num_credits == 0 && credit_waiters)
+            {
+                std::lock_guard<std::mutex> guard(wait_lock);
+                wait_cv.notify_all();
+            }
+            if (watch_active)
+                poll_watch();
+#ifdef PERF
+            // time the device holds credits, i.e. has requests outstanding
+            if (num_credits != 0 && credit_wait_start == 0)
+            {
+                credit_wait_start = perf::now();
+            }
+            else if (num_credits == 0 && credit_wait_start != 0)
+            {
+                HIST_END(perf::CREDIT_WAIT_LATENCY, credit_wait_start);
+                credit_wait_start = 0;
+            }
+#endif
             if (abort && num_credits == 0)
                 return;
             continue;
         }
         DBG("Found fault");
+#ifdef PERF
+        fault_arrival = perf::now();
+#endif
 
         bool read = fault & 0x2;
         if (read)
@@ -700,8 +1245,12 @@ void FSRF::device_fault_listener()
         uint64_t vpn = (fault >> 2) & 0xFFFFFFFFFFFFF;
 
         DBG("vpn: " << (void *)vpn);
+        TRACE_EVENT(DEVICE_FAULT_BEGIN, vpn, read);
+        stats::add(app_id, read ? stats::DEVICE_READ_FAULTS : stats::DEVICE_WRITE_FAULTS);
 
-        handle_device_fault(read, vpn);
+        MODE fault_mode = handle_device_fault(read, vpn);
+        HIST_END(perf::device_fault_histogram(fault_mode, read), fault_arrival);
+        (void)fault_mode; // only read by PERF builds
     }
     ERR("Fault listener should never return!");
 }
@@ -711,92 +1260,132 @@ void FSRF::handle_host_fault(int sig, siginfo_t *info, void *ucontext)
     ASSERT(sig == SIGSEGV);
     uint64_t missAddress = (uint64_t)info->si_addr;
     uint64_t err = ((ucontext_t *)ucontext)->uc_mcontext.gregs[REG_ERR];
-    bool write_fault = !(err & 0x2);
-    uint64_t vpn = missAddress >> 12;
-
-    DBG("Host trying to access address: " << info->si_addr);
-
-    const std::lock_guard<std::mutex> guard(fsrf->lock);
+    bool write_fault = err & 0x2; // W/R bit of the page fault error code
 
-    // if this page is on the device
-    if (fsrf->device_vpn_to_ppn.find(vpn) != fsrf->device_vpn_to_ppn.end())
+    // route the fault to the instance that owns the address
+    for (uint64_t app_id = 0; app_id < max_apps; ++app_id)
     {
-        uint64_t vaddr = vpn << 12;
+        FSRF *instance = instances[app_id].load();
+        if (instance != nullptr && instance->host_fault(missAddress, write_fault))
+            return;
+    }
 
-        if (fsrf->mode == MODE::INV_READ || (write_fault && fsrf->mode == MODE::INV_WRITE))
-        {
-            DBG("Removing " << (uint64_t *)vaddr << " from fpga tlb");
+    // Page wasn't supposed to be accessible after all
+    ERR("Host tried to access illegal address: " << info->si_addr);
+}
 
-            // invalidate on tlb
-            fsrf->write_tlb(vpn, fsrf->device_vpn_to_ppn[vpn], false, false, false, false);
-            fsrf->timed_mprotect((void *)vaddr, 1 << 12, PROT_READ | PROT_WRITE);
+// Returns false if the address doesn't belong to this instance
+bool FSRF::host_fault(uint64_t missAddress, bool write_fault)
+{
+    uint64_t vpn = missAddress >> 12;
 
-            DBG("Reading " << (uint64_t *)vaddr << " from fpga to host");
+    const std::lock_guard<std::mutex> guard(lock);
 
-            // dma from device to host
-            fsrf->fpga.dma_read((void *)vaddr, fsrf->device_vpn_to_ppn[vpn] << 12, (uint64_t)1 << 12);
+    // if this page is on the device
+    if (device_vpn_to_ppn.find(vpn) == device_vpn_to_ppn.end())
+        return false;
+
+    // cached datasets stay on the device, the host only reads its mapping
+    VME *fault_vme = find_vme(missAddress);
+    if (fault_vme != nullptr && fault_vme->file != nullptr && fault_vme->file->cached)
+        return false;
+
+    DBG("Host trying to access address: " << (void *)missAddress);
+    HIST_START(start);
+    TRACE_EVENT(HOST_FAULT_BEGIN, missAddress, write_fault);
+    stats::add(app_id, write_fault ? stats::HOST_WRITE_FAULTS : stats::HOST_READ_FAULTS);
+    stats::Vme *vme_stats = fault_vme != nullptr ? fault_vme->stats : nullptr;
+    stats::add(vme_stats, stats::VME_HOST_FAULTS);
+
+    MODE fault_mode = fault_vme != nullptr ? fault_vme->mode : mode;
+    uint64_t batch_pages = (fault_vme != nullptr ? fault_vme->dma_size : mmap_dma_size) >> 12;
+    policy::HostPlan plan = policy::plan_host_fault((policy::MODE)fault_mode, write_fault, vpn, batch_pages);
+    if (!plan.valid)
+        ERR("MMAP should not have host faults, something is wrong");
+    if (plan.pages > 1 && fault_vme == nullptr)
+        ERR("Couldn't find vme entry");
+    if (fault_mode == MANAGED && fault_vme != nullptr)
+    {
+        // the whole batch the page went over in, sizes vary when adaptive
+        auto batch = fault_vme->batches.upper_bound(vpn);
+        if (batch != fault_vme->batches.begin() && vpn < std::prev(batch)->first + std::prev(batch)->second)
+        {
+            --batch;
+            plan.vpn = batch->first;
+            plan.pages = batch->second;
+            fault_vme->batches.erase(batch);
+        }
+    }
 
-            DBG("Finished dma read");
+    uint64_t vaddr = plan.vpn << 12;
+    uint64_t bytes = plan.pages << 12;
+    DBG("Bringing back " << (uint64_t *)vaddr << " - " << (uint64_t *)(vaddr + bytes));
 
-            // free up device page
-            fsrf->free_device_vpn(vpn);
-        }
-        else if (fsrf->mode == MODE::INV_WRITE)
-        {
-            DBG("Marking " << (uint64_t *)vaddr << " as readonly on fpga tlb");
-            // set to readonly on TLB
-            fsrf->write_tlb(vpn, fsrf->device_vpn_to_ppn[vpn], false, true, true, false);
+    // invalidate on tlb, or set to readonly if the device keeps a copy
+    for (uint64_t page = plan.vpn; page < plan.vpn + plan.pages; ++page)
+    {
+        auto it = device_vpn_to_ppn.find(page);
+        if (it != device_vpn_to_ppn.end())
+            write_tlb(page, it->second, false, plan.device_keeps, plan.device_keeps, false);
+    }
+    timed_mprotect((void *)vaddr, bytes, PROT_READ | PROT_WRITE);
 
-            START("MPROTECT_NONE_TO_R");
-            fsrf->timed_mprotect((void *)vaddr, 1 << 12, PROT_READ);
-            END("MPROTECT_NONE_TO_R");
+    // dma from device to host, we have to even if the device keeps the page
+    // because it may have written to it. Batches are contiguous on the device.
+    ASSERT(device_vpn_to_ppn.find(plan.vpn) != device_vpn_to_ppn.end());
+    fpga.dma_read((void *)vaddr, device_vpn_to_ppn[plan.vpn] << 12, bytes);
+    stats::add(vme_stats, stats::VME_BYTES_TO_HOST, bytes);
+    DBG("Finished dma read");
 
-            // dma from device to host
-            // we have to dma because the device has written to this page
-            fsrf->fpga.dma_read((void *)vaddr, fsrf->device_vpn_to_ppn[vpn] << 12, (uint64_t)1 << 12);
+    if (plan.prot != (PROT_READ | PROT_WRITE))
+    {
+        START(MPROTECT_NONE_TO_R);
+        timed_mprotect((void *)vaddr, bytes, plan.prot);
+        END(MPROTECT_NONE_TO_R);
+    }
 
-            DBG("Finished dma read");
-        }
-        else if (fsrf->mode == MODE::MANAGED)
-        {
-            DBG("About to call sync managed");
-            fsrf->sync_managed((uint64_t *)vaddr);
-            DBG("Returned from sync managed");
-        }
-        else
+    if (!plan.device_keeps)
+    {
+        // free up device pages
+        for (uint64_t page = plan.vpn; page < plan.vpn + plan.pages; ++page)
         {
-            ERR("MMAP should not have host faults, something is wrong");
+            if (device_vpn_to_ppn.find(page) != device_vpn_to_ppn.end())
+                free_device_vpn(page);
         }
-        return;
     }
-
-    // Page wasn't supposed to be accessible after all
-    ERR("Host tried to access illegal address: " << info->si_addr);
+    HIST_END(perf::host_fault_histogram(!write_fault), start);
+    TRACE_EVENT(HOST_FAULT_END, missAddress, write_fault);
+    return true;
 }
 
 int FSRF::timed_mprotect(void *addr, size_t len, int prot)
 {
-    // START("MPROTECT");
+    // START(MPROTECT);
     if (prot == PROT_NONE)
     {
-        START("MPROTECT_NONE");
+        START(MPROTECT_NONE);
     }
     else if (prot == (PROT_READ | PROT_WRITE))
     {
-        START("MPROTECT_NONE_TO_RW");
+        START(MPROTECT_NONE_TO_RW);
     }
 
+    HIST_START(start);
+    TRACE_EVENT(MPROTECT_BEGIN, (uint64_t)addr, len | ((uint64_t)prot << 48));
     int res = mprotect(addr, len, prot);
+    stats::add(app_id, stats::MPROTECTS);
+    TRACE_EVENT(MPROTECT_END, (uint64_t)addr, len | ((uint64_t)prot << 48));
+    HIST_END(perf::MPROTECT_LATENCY, start);
     assert(res == 0);
     if (prot == PROT_NONE)
     {
-        END("MPROTECT_NONE");
+        END(MPROTECT_NONE);
     }
     else if (prot == (PROT_READ | PROT_WRITE))
     {
-        END("MPROTECT_NONE_TO_RW");
+        END(MPROTECT_NONE_TO_RW);
     }
 
-    // END("MPROTECT");
+    // END(MPROTECT);
     return res;
 }
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <signal.h>
@@ -10,9 +13,10 @@
 #include <unordered_map>
 
 #include "fpga.h"
-
-class FSRF;
-extern FSRF *fsrf;
+#include "perf.h"
+#include "policy.h"
+#include "slab.h"
+#include "stats.h"
 
 class FSRF
 {
@@ -20,12 +24,19 @@ public:
     enum MODE
     {
         NONE = -1,
-        INV_READ = 0,
-        INV_WRITE = 1,
-        MMAP = 2,
-        MANAGED = 3,
+        INV_READ = policy::INV_READ,
+        INV_WRITE = policy::INV_WRITE,
+        MMAP = policy::MMAP,
+        MANAGED = policy::MANAGED,
+        CPU, // apps only, the host baseline runs without an FSRF instance
     };
 
+    // batch_size in pages, or BATCH_ADAPTIVE for MANAGED allocations to
+    // tune their own between 1 and 512 pages from their fault locality
+    static const int BATCH_ADAPTIVE = -1;
+    // pages, a batch moves in one DMA through the 2 MB transfer buffer
+    static const int MAX_BATCH = 512;
+
     FSRF(uint64_t app_id, MODE mode, bool debug, int batch_size);
     ~FSRF();
 
@@ -35,6 +46,22 @@ public:
     uint64_t cntrlreg_read(uint64_t addr);
 
     uint64_t get_num_credits();
+
+    // Block until (reg & mask) == value, or until the device has no
+    // requests outstanding. Both poll for the spin time first, then sleep
+    // until the fault listener sees the condition. timeout_us 0 waits
+    // forever; false on timeout.
+    bool wait_reg(uint64_t addr, uint64_t mask, uint64_t value, uint64_t timeout_us = 0);
+    bool wait_credits_drained(uint64_t timeout_us = 0);
+    // Default from FSRF_WAIT_SPIN_US, 0 blocks right away
+    void set_wait_spin(uint64_t spin_us);
+
+    // Latency distribution of one perf::HISTOGRAM for this app slot, only
+    // populated in PERF builds
+    perf::LatencySummary get_latency(perf::HISTOGRAM id);
+
+    // Live counters of this app slot, safe to call from any thread
+    stats::Snapshot fsrf_get_stats();
     /*
     flags -
     permissions on fpga
@@ -42,18 +69,54 @@ public:
     random access vs sequential
     */
 
-    void *fsrf_malloc(uint64_t length, uint64_t host_permissions, uint64_t device_permissions);
-    void *fsrf_malloc_managed(uint64_t length, uint64_t host_permissions, uint64_t device_permissions);
+    // mode and batch_size (in pages or BATCH_ADAPTIVE) default to the instance's. Each
+    // allocation keeps its own, so one process can mix policies per buffer:
+    // MMAP buffers reserve their device pages up front, map them on first
+    // sync or device fault and are synced explicitly, the others migrate
+    // on faults.
+    void *fsrf_malloc(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, MODE mode = NONE, int batch_size = 0);
+    void *fsrf_malloc_managed(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, int batch_size = 0);
     void sync_device_to_host(uint64_t *addr);
     void sync_host_to_device(void *addr);
+    // Only the batches overlapping [addr, addr + length) of the allocation
+    void sync_device_to_host(void *addr, uint64_t length);
+    void sync_host_to_device(void *addr, uint64_t length);
+
+    // File backed allocation of length bytes of path from offset, which
+    // must be page aligned. The host maps the file shared. The device gets
+    // the contents straight from the file through the DMA staging buffer:
+    // eagerly in MMAP mode, a batch at a time on first access otherwise.
+    void *fsrf_mmap(const char *path, uint64_t offset, uint64_t length, uint64_t host_permissions, uint64_t device_permissions);
+    // Writes the pages the device wrote since the last fsrf_msync back to
+    // the file, then flushes it like msync(MS_SYNC)
+    void fsrf_msync(void *addr);
+    // Read only fsrf_mmap of a named dataset that stays in this app slot's
+    // device DRAM after the process exits. A manifest in FSRF_CACHE_DIR
+    // (/tmp/fsrf_cache by default) records its device pages and the file's
+    // identity and content hash. A later run whose file still matches, and
+    // whose device still holds the data, attaches without loading it.
+    void *fsrf_mmap_cached(const char *name, const char *path, uint64_t offset, uint64_t length, bool *attached = nullptr);
 
     void fsrf_free(uint64_t *addr);
 
+    // Objects of up to SlabAllocator::max_object bytes packed into shared
+    // fsrf_malloc regions, one set per mode and permissions, so they share
+    // VMEs and device pages. Larger lengths get their own fsrf_malloc.
+    void *fsrf_malloc_small(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, MODE mode = NONE);
+    void fsrf_free_small(void *addr);
+    // Sync just the object at addr, by a read-modify-write of its device
+    // page. The other syncs move whole batches, or the whole region, and
+    // would overwrite the neighbors' newer data on the other side. Larger
+    // objects sync their whole allocation.
+    void sync_small_to_host(void *addr);
+    void sync_small_to_device(void *addr);
+
 private:
     bool debug;
     uint64_t app_id;
     bool abort = false;
     MODE mode;
+    bool adaptive; // BATCH_ADAPTIVE
 
     // device paging
     std::unordered_map<uint64_t, uint64_t>
@@ -64,7 +127,27 @@ private:
 
     // device
     FPGA fpga;
-    uint64_t num_credits;
+    std::atomic<uint64_t> num_credits;
+
+    // blocking waits, see wait_reg
+    struct Watch
+    {
+        uint64_t addr;
+        uint64_t mask;
+        uint64_t value;
+    };
+    uint64_t wait_spin_us;
+    std::mutex wait_reg_lock; // one register watch at a time
+    std::mutex wait_lock;
+    std::condition_variable wait_cv;
+    Watch watch;
+    std::atomic<bool> watch_active;
+    bool watch_matched = false;
+    std::atomic<uint64_t> credit_waiters;
+
+    // PERF timestamps, owned by the listener thread
+    uint64_t fault_arrival = 0;
+    uint64_t credit_wait_start = 0;
 
     std::mutex lock;
 
@@ -72,6 +155,16 @@ private:
     std::thread faultHandlerThread;
 
     // mmap info
+    struct File
+    {
+        int fd;
+        uint64_t offset; // of the VME's first byte
+        uint64_t length; // bytes of the VME the file backs
+        // device pages map read only until the device writes them
+        std::set<uint64_t> dirty_vpns;
+        bool cached; // fsrf_mmap_cached, the device pages outlive the process
+    };
+
     struct VME
     {
         uint64_t addr;
@@ -79,23 +172,46 @@ private:
         uint64_t prot;
 
         VME *next;
+        stats::Vme *stats; // null if the stats table is full
+        File *file;        // null unless from fsrf_mmap
+        MODE mode;         // migration policy of the allocation
+        uint64_t dma_size; // its batch in bytes, the largest if adaptive
+        bool adaptive;
+        policy::BatchTuner tuner;
+        // MANAGED batches on the device, first vpn -> pages
+        std::map<uint64_t, uint64_t> batches;
+        // MMAP fsrf_malloc: device pages reserved for the whole allocation,
+        // each batch mapped on its first sync or device fault
+        uint64_t first_ppn;
     } typedef VME;
 
     std::map<uint64_t, VME> vmes;
 
+    // fsrf_malloc_small, by mode and permissions. Its own lock, as regions
+    // come from fsrf_malloc.
+    std::mutex slab_lock;
+    std::map<uint64_t, std::unique_ptr<SlabAllocator>> slabs;
+
     uint64_t mmap_dma_size;
 
-public:
-    std::unordered_map<std::string, std::chrono::duration<int64_t, std::nano>> cumulative_times;
-    std::unordered_map<std::string, std::chrono::high_resolution_clock::time_point> last_start;
-    std::unordered_map<std::string, uint64_t> num_calls;
+    // periodic stats dump, see stats::Reporter
+    std::unique_ptr<stats::Reporter> reporter;
 
 private:
     void
     respond_tlb(uint64_t ppn, uint64_t valid);
     uint64_t allocate_device_ppn();
+    uint64_t reserve_device_ppns(uint64_t pages);
+    void map_reserved(VME *vme, uint64_t start, uint64_t end);
     void free_device_vpn(uint64_t vpn);
-    void sync_managed(uint64_t *addr);
+    VME *find_vme(uint64_t vaddr);
+    void *allocate_vme(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, MODE mode, uint64_t dma_size, bool adaptive);
+    void sync_range(uint64_t addr, uint64_t length, bool to_device);
+    void sync_small(void *addr, bool to_device);
+    void file_to_device(VME *vme, uint64_t vaddr, uint64_t ppn, uint64_t bytes);
+    uint64_t map_file(int fd, uint64_t offset, uint64_t orig_length, uint64_t length, uint64_t host_permissions);
+    bool device_holds(int fd, uint64_t offset, uint64_t orig_length, uint64_t first_ppn, uint64_t pages);
+    void reserve_cached_datasets();
     uint64_t read_tlb_fault();
     uint64_t dram_tlb_addr(uint64_t vpn);
     void flush_tlb();
@@ -105,6 +221,7 @@ private:
                    uint64_t readable,
                    uint64_t present,
                    uint64_t huge);
+    void write_tlb_run(uint64_t vpn, uint64_t ppn, uint64_t pages, uint64_t writeable);
 
     void evict_tlb();
 
@@ -112,10 +229,13 @@ private:
     void dmaRead();
 
     bool should_handle_fault(uint64_t fault);
-    void handle_device_fault(bool read, uint64_t vpn);
+    MODE handle_device_fault(bool read, uint64_t vpn);
     void device_fault_listener();
+    void poll_watch();
 
+    static std::atomic<FSRF *> instances[max_apps];
     static void handle_host_fault(int sig, siginfo_t *info, void *ucontext);
+    bool host_fault(uint64_t vaddr, bool write_fault);
 
     int timed_mprotect(void *addr, size_t len, int prot);
 };
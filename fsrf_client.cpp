@@ -0,0 +1,440 @@
+#include <chrono>
+#include <fcntl.h>
+#include <iostream>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fsrf_client.h"
+
+#define ERR(x)                                                                          \
+    {                                                                                   \
+        std::cerr << "[" << __FUNCTION__ << ":" << __LINE__ << "]\t" << x << std::endl; \
+        exit(1);                                                                        \
+    }
+
+#ifdef DEBUG
+#define DBG(x)              \
+    if (fsrf_client->debug) \
+    std::cout << "[" << __FUNCTION__ << ":" << __LINE__ << "]\t" << x << std::endl
+#define ASSERT(b) assert(b)
+#else
+#define DBG(x) \
+    {          \
+    }
+#define ASSERT(b) \
+    {             \
+    }
+#endif
+
+#define PAGE_SIZE 0x1000
+
+using namespace fsrf_ipc;
+
+// Global instance for the SIGSEGV handler to use
+FSRFClient *fsrf_client = nullptr;
+
+FSRFClient::FSRFClient(uint64_t app_id, FSRF::MODE mode, bool debug, int batch_size) : debug(debug),
+                                                                                 app_id(app_id),
+                                                                                 mode(mode),
+                                                                                 adaptive(batch_size == FSRF::BATCH_ADAPTIVE),
+                                                                                 mmap_dma_size((adaptive ? policy::adaptive_max_pages : batch_size) * PAGE_SIZE),
+                                                                                 wait_spin_us(getenv("FSRF_WAIT_SPIN_US") ? strtoull(getenv("FSRF_WAIT_SPIN_US"), nullptr, 0) : 100)
+{
+    if (fsrf_client != nullptr)
+    {
+        ERR("Global fsrf_client object already initialized");
+    }
+    fsrf_client = this;
+
+    if (app_id >= num_tenants)
+        ERR("app_id must be in range [0, 3]\nGiven: " << app_id);
+    if (mode == FSRF::MODE::NONE)
+        ERR("Mode must not be none");
+
+    int fd = shm_open(shm_name, O_RDWR, 0);
+    if (fd == -1)
+        ERR("Could not open " << shm_name << ", is the fault handler running?");
+    shm = (Shm *)mmap(0, sizeof(Shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED || shm->magic != magic)
+        ERR("Fault handler shared memory is invalid");
+
+    tenant = &shm->tenants[app_id];
+    int32_t expected = 0;
+    if (!tenant->pid.compare_exchange_strong(expected, getpid()))
+        ERR("App " << app_id << " is in use by pid " << expected);
+
+    protectThread = std::thread(&FSRFClient::protect_listener, this);
+
+    if (call(OP_CONNECT, mode, batch_size) != 0)
+        ERR("Fault handler refused connection");
+    DBG("Connected to app " << app_id);
+
+    struct sigaction act = {0};
+    act.sa_sigaction = FSRFClient::handle_host_fault;
+    act.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &act, NULL);
+}
+
+FSRFClient::~FSRFClient()
+{
+    // waits for the device to return its credits
+    call(OP_DISCONNECT);
+    abort = true;
+    protectThread.join();
+    tenant->pid = 0;
+    munmap(shm, sizeof(Shm));
+    fsrf_client = nullptr;
+}
+
+int64_t FSRFClient::call(uint32_t op, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t *out)
+{
+    Request *req = nullptr;
+    while (req == nullptr)
+    {
+        for (uint64_t slot = 0; slot < ring_slots && req == nullptr; ++slot)
+        {
+            uint32_t expected = FREE;
+            if (tenant->ring[slot].state.compare_exchange_strong(expected, CLAIMED))
+                req = &tenant->ring[slot];
+        }
+        if (req == nullptr)
+            sched_yield();
+    }
+
+    req->op = op;
+    req->args[0] = arg0;
+    req->args[1] = arg1;
+    req->args[2] = arg2;
+    req->args[3] = arg3;
+    req->state.store(SUBMITTED, std::memory_order_release);
+
+    // spin briefly, then sleep until the daemon wakes us
+    uint64_t spins = 0;
+    while (req->state.load(std::memory_order_acquire) != DONE)
+    {
+        if (++spins < 1024)
+            continue;
+        futex_wait(&req->state, SUBMITTED, 1000);
+        if (spins % 1024 == 0 && shm->daemon_pid.load() == 0)
+            ERR("Fault handler exited");
+    }
+
+    int64_t result = req->result;
+    if (out != nullptr)
+    {
+        for (int i = 0; i < 4; ++i)
+            out[i] = req->out[i];
+    }
+    req->state.store(FREE, std::memory_order_release);
+    return result;
+}
+
+void FSRFClient::protect_listener()
+{
+    Protect &protect = tenant->protect;
+    uint32_t seen = protect.seq.load();
+    while (!abort)
+    {
+        uint32_t seq = protect.seq.load(std::memory_order_acquire);
+        if (seq == seen)
+        {
+            futex_wait(&protect.seq, seq, 10000);
+            continue;
+        }
+        DBG("mprotect " << (void *)protect.addr << " - " << (void *)(protect.addr + protect.len) << " to " << protect.prot);
+        if (mprotect((void *)protect.addr, protect.len, protect.prot) != 0)
+            ERR("mprotect requested by fault handler failed");
+        seen = seq;
+        protect.ack.store(seq, std::memory_order_release);
+    }
+}
+
+void FSRFClient::cntrlreg_write(uint64_t addr, uint64_t value)
+{
+    call(OP_REG_WRITE, addr, value);
+}
+
+uint64_t FSRFClient::cntrlreg_read(uint64_t addr)
+{
+    uint64_t out[4];
+    call(OP_REG_READ, addr, 0, 0, 0, out);
+    return out[0];
+}
+
+uint64_t FSRFClient::get_num_credits()
+{
+    return tenant->num_credits.load(std::memory_order_acquire);
+}
+
+void FSRFClient::set_wait_spin(uint64_t spin_us)
+{
+    wait_spin_us = spin_us;
+}
+
+// Polls done() for the spin time, then sleeps 10 us doubling up to 1 ms
+// between polls
+template <typename Done>
+bool FSRFClient::wait_until(Done done, uint64_t timeout_us)
+{
+    using namespace std::chrono;
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point deadline = start + microseconds(timeout_us);
+    steady_clock::time_point spin_end = start + microseconds(wait_spin_us);
+    uint64_t sleep_us = 10;
+    while (!done())
+    {
+        steady_clock::time_point now = steady_clock::now();
+        if (timeout_us && now >= deadline)
+            return false;
+        if (now < spin_end)
+            continue;
+        std::this_thread::sleep_for(microseconds(sleep_us));
+        sleep_us = std::min<uint64_t>(sleep_us * 2, 1000);
+    }
+    return true;
+}
+
+bool FSRFClient::wait_reg(uint64_t addr, uint64_t mask, uint64_t value, uint64_t timeout_us)
+{
+    return wait_until([&]
+                      { return (cntrlreg_read(addr) & mask) == value; },
+                      timeout_us);
+}
+
+bool FSRFClient::wait_credits_drained(uint64_t timeout_us)
+{
+    return wait_until([this]
+                      { return get_num_credits() == 0; },
+                      timeout_us);
+}
+
+// mmap length rounded up to, and aligned on, dma_size
+void *FSRFClient::map_aligned(uint64_t length, uint64_t dma_size, uint64_t host_permissions)
+{
+    void *ptr = mmap(0, length + dma_size, host_permissions, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+    {
+        ERR("mmap failed");
+    }
+
+    uint64_t toReturn = (uint64_t)ptr;
+    if (toReturn % dma_size != 0)
+    {
+        toReturn = toReturn + (dma_size - (toReturn % dma_size));
+    }
+    return (void *)toReturn;
+}
+
+void *FSRFClient::fsrf_malloc(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, FSRF::MODE mode, int batch_size)
+{
+    if (mode == FSRF::MODE::NONE)
+        mode = this->mode;
+    if (mode < FSRF::MODE::INV_READ || mode > FSRF::MODE::MANAGED)
+        ERR("Allocation mode must be a device mode");
+    if (batch_size < FSRF::BATCH_ADAPTIVE || batch_size > FSRF::MAX_BATCH)
+        ERR("Invalid batch size " << batch_size);
+    bool adaptive = batch_size == FSRF::BATCH_ADAPTIVE || (batch_size == 0 && this->adaptive);
+    uint64_t dma_size = adaptive ? policy::adaptive_max_pages * PAGE_SIZE : batch_size ? (uint64_t)batch_size * PAGE_SIZE : mmap_dma_size;
+    if (length % dma_size != 0)
+        length += dma_size - (length % dma_size);
+
+    void *ptr = map_aligned(length, dma_size, host_permissions);
+    if (call(OP_REGISTER_VME, (uint64_t)ptr, length, device_permissions, vme_policy(mode, dma_size / PAGE_SIZE, adaptive)) != 0)
+        ERR("Fault handler refused the allocation");
+    return ptr;
+}
+
+void *FSRFClient::fsrf_malloc_managed(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, int batch_size)
+{
+    return fsrf_malloc(length, host_permissions, device_permissions, FSRF::MODE::MANAGED, batch_size);
+}
+
+void *FSRFClient::fsrf_mmap(const char *path, uint64_t offset, uint64_t length, uint64_t host_permissions, uint64_t device_permissions)
+{
+    return map_file(path, offset, length, host_permissions, device_permissions, mode);
+}
+
+void *FSRFClient::map_file(const char *path, uint64_t offset, uint64_t orig_length, uint64_t host_permissions, uint64_t device_permissions, FSRF::MODE file_mode)
+{
+    if (offset % PAGE_SIZE != 0)
+        ERR("File offset must be page aligned");
+    bool writeable = (host_permissions | device_permissions) & PROT_WRITE;
+    int fd = open(path, writeable ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+        ERR("Can't open " << path << ": " << strerror(errno));
+    if (offset + orig_length > (uint64_t)st.st_size)
+        ERR(path << " is shorter than the mapping");
+
+    uint64_t length = orig_length;
+    if (length % mmap_dma_size != 0)
+        length += mmap_dma_size - (length % mmap_dma_size);
+
+    // the padding after the file's part stays anonymous
+    void *ptr = map_aligned(length, mmap_dma_size, host_permissions);
+    uint64_t file_pages = (orig_length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (file_pages != 0 && mmap(ptr, file_pages, host_permissions, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED)
+        ERR("mmap of " << path << " failed: " << strerror(errno));
+    close(fd);
+
+    if (call(OP_REGISTER_VME, (uint64_t)ptr, length, device_permissions, vme_policy(file_mode, mmap_dma_size / PAGE_SIZE, adaptive)) != 0)
+        ERR("Fault handler refused the allocation");
+    if (file_mode == FSRF::MODE::MMAP)
+        sync_host_to_device(ptr);
+    file_maps[(uint64_t)ptr] = file_pages;
+    return ptr;
+}
+
+void FSRFClient::fsrf_msync(void *addr)
+{
+    auto it = file_maps.upper_bound((uint64_t)addr);
+    if (it == file_maps.begin() || (uint64_t)addr >= std::prev(it)->first + std::prev(it)->second)
+        ERR("Not an fsrf_mmap allocation: " << addr);
+    --it;
+
+    // bring device pages back into the mapping, then flush it
+    if (mode == FSRF::MODE::MMAP)
+    {
+        sync_device_to_host((uint64_t *)it->first);
+    }
+    else
+    {
+        for (uint64_t page = it->first; page < it->first + it->second; page += PAGE_SIZE)
+            (void)*(volatile uint8_t *)page;
+    }
+    if (msync((void *)it->first, it->second, MS_SYNC) != 0)
+        ERR("msync failed: " << strerror(errno));
+}
+
+void *FSRFClient::fsrf_mmap_cached(const char *name, const char *path, uint64_t offset, uint64_t length, bool *attached)
+{
+    if (attached != nullptr)
+        *attached = false;
+    return map_file(path, offset, length, PROT_READ, PROT_READ, FSRF::MODE::MMAP);
+}
+
+void FSRFClient::sync_device_to_host(uint64_t *addr)
+{
+    if (call(OP_SYNC_TO_HOST, (uint64_t)addr) != 0)
+        ERR("Invalid sync");
+}
+
+void FSRFClient::sync_host_to_device(void *addr)
+{
+    if (call(OP_SYNC_TO_DEVICE, (uint64_t)addr) != 0)
+        ERR("Invalid sync");
+}
+
+void FSRFClient::sync_device_to_host(void *addr, uint64_t length)
+{
+    if (length != 0 && call(OP_SYNC_TO_HOST, (uint64_t)addr, length) != 0)
+        ERR("Invalid sync");
+}
+
+void FSRFClient::sync_host_to_device(void *addr, uint64_t length)
+{
+    if (length != 0 && call(OP_SYNC_TO_DEVICE, (uint64_t)addr, length) != 0)
+        ERR("Invalid sync");
+}
+
+void FSRFClient::fsrf_free(uint64_t *addr)
+{
+    call(OP_FREE_VME, (uint64_t)addr);
+}
+
+void *FSRFClient::fsrf_malloc_small(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, FSRF::MODE mode)
+{
+    if (mode == FSRF::MODE::NONE)
+        mode = this->mode;
+    if (length > SlabAllocator::max_object)
+        return fsrf_malloc(length, host_permissions, device_permissions, mode);
+
+    const std::lock_guard<std::mutex> guard(slab_lock);
+    std::unique_ptr<SlabAllocator> &slab = slabs[mode | host_permissions << 8 | device_permissions << 16];
+    if (!slab)
+    {
+        auto new_region = [=](uint64_t bytes)
+        { return fsrf_malloc(bytes, host_permissions, device_permissions, mode); };
+        slab.reset(new SlabAllocator(new_region, mmap_dma_size > SlabAllocator::min_region ? mmap_dma_size : SlabAllocator::min_region));
+    }
+    return slab->allocate(length);
+}
+
+void FSRFClient::fsrf_free_small(void *addr)
+{
+    {
+        const std::lock_guard<std::mutex> guard(slab_lock);
+        for (auto &slab : slabs)
+        {
+            if (!slab.second->owns(addr))
+                continue;
+            // never fall back to freeing the region under its neighbors
+            if (!slab.second->free(addr))
+                ERR("Invalid small free of " << addr);
+            return;
+        }
+    }
+    // a large object with its own allocation
+    fsrf_free((uint64_t *)addr);
+}
+
+void FSRFClient::sync_small_to_host(void *addr)
+{
+    sync_small(addr, false);
+}
+
+void FSRFClient::sync_small_to_device(void *addr)
+{
+    sync_small(addr, true);
+}
+
+// The daemon does the read-modify-write of the object's device page
+void FSRFClient::sync_small(void *addr, bool to_device)
+{
+    uint64_t bytes = 0;
+    bool owned = false;
+    {
+        const std::lock_guard<std::mutex> guard(slab_lock);
+        for (auto &slab : slabs)
+        {
+            if (slab.second->owns(addr))
+            {
+                owned = true;
+                bytes = slab.second->size_of(addr);
+                break;
+            }
+        }
+    }
+    if (owned && bytes == 0)
+        ERR("Invalid small sync of " << addr);
+    if (call(to_device ? OP_SYNC_TO_DEVICE : OP_SYNC_TO_HOST, (uint64_t)addr, bytes, owned) != 0)
+        ERR("Invalid sync");
+}
+
+void FSRFClient::handle_host_fault(int sig, siginfo_t *info, void *ucontext)
+{
+    ASSERT(sig == SIGSEGV);
+    uint64_t missAddress = (uint64_t)info->si_addr;
+    uint64_t err = ((ucontext_t *)ucontext)->uc_mcontext.gregs[REG_ERR];
+    bool write_fault = err & 0x2; // W/R bit of the page fault error code
+
+    DBG("Host trying to access address: " << info->si_addr);
+
+    // out: range, final host protection, how to fill it
+    uint64_t out[4];
+    if (fsrf_client->call(OP_HOST_FAULT, missAddress, write_fault, 0, 0, out) != 0)
+        ERR("Host tried to access illegal address: " << info->si_addr);
+
+    if (out[3])
+    {
+        if (mprotect((void *)out[0], out[1], PROT_READ | PROT_WRITE) != 0)
+            ERR("mprotect failed");
+        if (fsrf_client->call(OP_HOST_FILL, out[0], out[1], out[3]) != 0)
+            ERR("Could not copy " << (void *)out[0] << " back from the device");
+    }
+    if (out[2] != (PROT_READ | PROT_WRITE))
+        mprotect((void *)out[0], out[1], out[2]);
+}
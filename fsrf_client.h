@@ -0,0 +1,94 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <signal.h>
+#include <stdint.h>
+#include <thread>
+
+#include "fault_ipc.h"
+#include "fsrf.h"
+#include "slab.h"
+
+class FSRFClient;
+extern FSRFClient *fsrf_client;
+
+// Application side of the fault handling daemon (fault_handler.h). Exposes the
+// same interface as FSRF, but every device operation is a request to the
+// daemon, so construction only maps the shared ring and claims an app slot.
+class FSRFClient
+{
+public:
+    FSRFClient(uint64_t app_id, FSRF::MODE mode, bool debug, int batch_size);
+    ~FSRFClient();
+
+    void cntrlreg_write(uint64_t addr, uint64_t value);
+    uint64_t cntrlreg_read(uint64_t addr);
+
+    uint64_t get_num_credits();
+
+    // Same contract as FSRF::wait_reg. The daemon owns the listener, so
+    // after the spin these poll with exponential backoff instead of sleeping
+    // on a condition variable.
+    bool wait_reg(uint64_t addr, uint64_t mask, uint64_t value, uint64_t timeout_us = 0);
+    bool wait_credits_drained(uint64_t timeout_us = 0);
+    void set_wait_spin(uint64_t spin_us);
+
+    // Same contract as FSRF::fsrf_malloc, the daemon keeps each
+    // allocation's mode and batch
+    void *fsrf_malloc(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, FSRF::MODE mode = FSRF::MODE::NONE, int batch_size = 0);
+    void *fsrf_malloc_managed(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, int batch_size = 0);
+    void sync_device_to_host(uint64_t *addr);
+    void sync_host_to_device(void *addr);
+    void sync_device_to_host(void *addr, uint64_t length);
+    void sync_host_to_device(void *addr, uint64_t length);
+
+    // Same contract as FSRF::fsrf_mmap. The daemon can't reach the file,
+    // so contents move through the client's shared mapping of it instead.
+    void *fsrf_mmap(const char *path, uint64_t offset, uint64_t length, uint64_t host_permissions, uint64_t device_permissions);
+    void fsrf_msync(void *addr);
+    // The daemon's device pages don't outlive a client, so this loads the
+    // dataset every time. Read only on both sides and loaded up front as an
+    // MMAP VME, so the host's read only mapping never needs a fill.
+    void *fsrf_mmap_cached(const char *name, const char *path, uint64_t offset, uint64_t length, bool *attached = nullptr);
+
+    void fsrf_free(uint64_t *addr);
+
+    // Same contract as FSRF::fsrf_malloc_small
+    void *fsrf_malloc_small(uint64_t length, uint64_t host_permissions, uint64_t device_permissions, FSRF::MODE mode = FSRF::MODE::NONE);
+    void fsrf_free_small(void *addr);
+    void sync_small_to_host(void *addr);
+    void sync_small_to_device(void *addr);
+
+private:
+    bool debug;
+    uint64_t app_id;
+    volatile bool abort = false;
+    FSRF::MODE mode;
+    bool adaptive; // FSRF::BATCH_ADAPTIVE
+    uint64_t mmap_dma_size;
+    uint64_t wait_spin_us;
+
+    std::map<uint64_t, uint64_t> file_maps; // fsrf_mmap start -> length
+
+    // fsrf_malloc_small, by mode and permissions
+    std::mutex slab_lock;
+    std::map<uint64_t, std::unique_ptr<SlabAllocator>> slabs;
+
+    fsrf_ipc::Shm *shm;
+    fsrf_ipc::Tenant *tenant;
+
+    // applies protection changes requested by the daemon
+    std::thread protectThread;
+
+    int64_t call(uint32_t op, uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t arg2 = 0, uint64_t arg3 = 0, uint64_t *out = nullptr);
+    void *map_aligned(uint64_t length, uint64_t dma_size, uint64_t host_permissions);
+    void *map_file(const char *path, uint64_t offset, uint64_t length, uint64_t host_permissions, uint64_t device_permissions, FSRF::MODE file_mode);
+    void sync_small(void *addr, bool to_device);
+    void protect_listener();
+    template <typename Done>
+    bool wait_until(Done done, uint64_t timeout_us);
+
+    static void handle_host_fault(int sig, siginfo_t *info, void *ucontext);
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+// Log-linear (HDR style) histogram of 64 bit values. Every power of two is
+// split into 2^SUB_BITS linear buckets, so any recorded value is known to
+// within 1/16th. Recording is a relaxed atomic add, safe from any thread.
+class Histogram
+{
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    Histogram()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        for (int i = 0; i < NUM_BUCKETS; ++i)
+            buckets[i].store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        largest.store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t value)
+    {
+        buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t prev = largest.load(std::memory_order_relaxed);
+        while (value > prev && !largest.compare_exchange_weak(prev, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    uint64_t count() const
+    {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const
+    {
+        return largest.load(std::memory_order_relaxed);
+    }
+
+    double mean() const
+    {
+        uint64_t n = count();
+        return n ? (double)sum.load(std::memory_order_relaxed) / n : 0;
+    }
+
+    // Smallest value v such that at least p percent of samples are <= v,
+    // reported as the midpoint of its bucket and capped at the maximum
+    uint64_t percentile(double p) const
+    {
+        uint64_t n = count();
+        if (n == 0)
+            return 0;
+        uint64_t target = (uint64_t)(p / 100.0 * n + 0.5);
+        if (target == 0)
+            target = 1;
+
+        uint64_t seen = 0;
+        for (int i = 0; i < NUM_BUCKETS; ++i)
+        {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= target)
+            {
+                uint64_t value = lowest(i) + width(i) / 2;
+                return value < max() ? value : max();
+            }
+        }
+        return max();
+    }
+
+    static int bucket(uint64_t value)
+    {
+        if (value < SUB_BUCKETS)
+            return value;
+        int exponent = 63 - __builtin_clzll(value);
+        uint64_t sub = (value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+        return ((exponent - SUB_BITS + 1) << SUB_BITS) | sub;
+    }
+
+    static uint64_t lowest(int index)
+    {
+        if (index < SUB_BUCKETS)
+            return index;
+        int exponent = (index >> SUB_BITS) + SUB_BITS - 1;
+        uint64_t sub = index & (SUB_BUCKETS - 1);
+        return ((uint64_t)1 << exponent) | (sub << (exponent - SUB_BITS));
+    }
+
+    static uint64_t width(int index)
+    {
+        if (index < SUB_BUCKETS)
+            return 1;
+        int exponent = (index >> SUB_BITS) + SUB_BITS - 1;
+        return (uint64_t)1 << (exponent - SUB_BITS);
+    }
+
+private:
+    std::atomic<uint64_t> buckets[NUM_BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> largest;
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+
+// Layout of the .bin graphs matrix2graph writes and apps/Pagerank.h loads.
+// A header page comes first so the sections stay page aligned when the file
+// is mapped, followed by the sections at the offsets the header records:
+// per vertex in and out degree (8 bytes each), in-edge sources grouped by
+// destination, source ranks, destination ranks. Vertices and edges are
+// padded to multiples of 512, the counts below include the padding.
+namespace graph_format
+{
+	const uint64_t magic = 0x3146524746525346; // "FSRFGRF1"
+	const uint64_t version = 1;
+	const uint64_t header_bytes = 4096;
+
+	// Vertex relabeling matrix2graph -r applied, see Header::order
+	enum ORDER {
+		ORIGINAL = 0, // Matrix Market order
+		DEGREE,       // by out-degree, descending
+		HUB,          // above average out-degree first, otherwise original
+		RCM,          // reverse Cuthill-McKee
+	};
+
+	struct Header {
+		uint64_t magic;
+		uint64_t version;
+		uint64_t verts;
+		uint64_t edges;
+		uint64_t vert_offset;
+		uint64_t edge_offset;
+		uint64_t src_rank_offset;
+		uint64_t dst_rank_offset;
+		uint64_t file_bytes;
+		uint64_t orig_verts; // before padding
+		uint64_t orig_edges;
+		uint64_t order; // ORDER, files from before this field read 0
+	};
+
+	inline Header make_header(uint64_t orig_verts, uint64_t orig_edges, uint64_t verts, uint64_t edges) {
+		Header header = {magic, version, verts, edges};
+		header.vert_offset = header_bytes;
+		header.edge_offset = header.vert_offset + verts * 16;
+		header.src_rank_offset = header.edge_offset + edges * 8;
+		header.dst_rank_offset = header.src_rank_offset + verts * 8;
+		header.file_bytes = header.dst_rank_offset + verts * 8;
+		header.orig_verts = orig_verts;
+		header.orig_edges = orig_edges;
+		header.order = ORIGINAL;
+		return header;
+	}
+
+	inline bool valid(const Header &header) {
+		return header.magic == magic && header.version == version &&
+			header.verts % 512 == 0 && header.edges % 512 == 0 &&
+			header.vert_offset == header_bytes &&
+			header.edge_offset == header.vert_offset + header.verts * 16 &&
+			header.src_rank_offset == header.edge_offset + header.edges * 8 &&
+			header.dst_rank_offset == header.src_rank_offset + header.verts * 8;
+	}
+}
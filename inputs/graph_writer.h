@@ -0,0 +1,137 @@
+#pragma once
+#include <algorithm>
+#include <assert.h>
+#include <fcntl.h>
+#include <limits>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "graph_format.h"
+
+// Runs body(t) on num_threads threads
+template <typename Body>
+static void parallel(uint64_t num_threads, Body body) {
+	std::vector<std::thread> threads;
+	for (uint64_t t = 0; t < num_threads; ++t) threads.push_back(std::thread(body, t));
+	for (std::thread &t : threads) t.join();
+}
+
+// Builds a graph_format file in place in the mapped output, shared by the
+// converters. build() runs a two pass parallel counting sort: the edge
+// source is asked twice for every thread's share, once to count degrees
+// and once to place each source at its destination's next slot. Sources
+// are then sorted within each destination so the file does not depend on
+// the thread count. finish() adds the padding and initial ranks.
+class GraphWriter {
+public:
+	// verts and edges before padding
+	GraphWriter(const char *path, uint64_t verts, uint64_t edges, uint64_t num_threads) : verts(verts), edges(edges), num_threads(num_threads) {
+		// Page-length padding metadata
+		extra_verts = 512 - (verts % 512);
+		extra_edges = 512 - (edges % 512);
+
+		// Map output, the file starts out zeroed
+		graph_format::Header header = graph_format::make_header(verts, edges, verts + extra_verts, edges + extra_edges);
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		assert(fd >= 0);
+		assert(ftruncate(fd, header.file_bytes) == 0);
+		output = (char *)mmap(NULL, header.file_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		assert(output != MAP_FAILED);
+		memcpy(output, &header, sizeof(header));
+		this->header = (graph_format::Header *)output;
+		degrees = (uint64_t *)(output + header.vert_offset);
+		in_edges = (uint64_t *)(output + header.edge_offset);
+	}
+
+	// Passed to the edge source: counts degrees on the first pass, places
+	// sources on the second
+	class Emit {
+	public:
+		void operator()(uint64_t src, uint64_t dst) const {
+			if (next_slot == NULL) {
+				__atomic_fetch_add(&writer->degrees[2 * dst], 1, __ATOMIC_RELAXED);
+				__atomic_fetch_add(&writer->degrees[2 * src + 1], 1, __ATOMIC_RELAXED);
+			} else {
+				writer->in_edges[__atomic_fetch_add(&next_slot[dst], 1, __ATOMIC_RELAXED)] = src;
+			}
+		}
+
+	private:
+		friend class GraphWriter;
+		Emit(GraphWriter *writer, uint64_t *next_slot) : writer(writer), next_slot(next_slot) {}
+		GraphWriter *writer;
+		uint64_t *next_slot;
+	};
+
+	// source(t, emit) calls emit(src, dst), 0 based, for thread t's share
+	// of the edges, the same edges both times it is called
+	template <typename Source>
+	void build(Source source) {
+		// Pass 1: degrees
+		parallel(num_threads, [&](uint64_t t) {
+			source(t, Emit(this, NULL));
+		});
+
+		// Exclusive prefix sum of in-degrees, the next free slot per vertex
+		std::vector<uint64_t> next_slot(verts);
+		uint64_t sum = 0;
+		for (uint64_t i = 0; i < verts; ++i) {
+			next_slot[i] = sum;
+			sum += degrees[2 * i];
+		}
+		assert(sum == edges);
+
+		// Pass 2: place sources
+		parallel(num_threads, [&](uint64_t t) {
+			source(t, Emit(this, next_slot.data()));
+		});
+
+		// Sort each vertex's sources, next_slot now holds the end of its range
+		parallel(num_threads, [&](uint64_t t) {
+			for (uint64_t i = t; i < verts; i += num_threads) {
+				uint64_t end = next_slot[i];
+				std::sort(in_edges + end - degrees[2 * i], in_edges + end);
+			}
+		});
+	}
+
+	void finish() {
+		// Vertex padding
+		degrees[2 * verts] = extra_edges;
+		degrees[2 * verts + 1] = extra_edges;
+
+		// Edge padding
+		for (uint64_t i = 0; i < extra_edges; ++i) in_edges[edges + i] = verts;
+
+		// Source pageranks, destination pageranks stay 0
+		uint64_t *src_ranks = (uint64_t *)(output + header->src_rank_offset);
+		const uint64_t rank = std::numeric_limits<uint64_t>::max() / verts;
+		for (uint64_t i = 0; i < verts; ++i) src_ranks[i] = rank;
+
+		// Print metadata
+		printf("Final vertices, edges: %lu %lu\n", header->verts, header->edges);
+
+		uint64_t file_bytes = header->file_bytes;
+		assert(msync(output, file_bytes, MS_SYNC) == 0);
+		munmap(output, file_bytes);
+		close(fd);
+	}
+
+	const uint64_t verts;
+	const uint64_t edges;
+	const uint64_t num_threads;
+	graph_format::Header *header;
+	uint64_t *degrees; // in, out per vertex
+	uint64_t *in_edges;
+
+private:
+	uint64_t extra_verts;
+	uint64_t extra_edges;
+	int fd;
+	char *output;
+};
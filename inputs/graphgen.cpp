@@ -0,0 +1,116 @@
+#include <assert.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <thread>
+
+#include "graph_format.h"
+#include "graph_writer.h"
+
+using namespace std;
+
+static uint64_t mix(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+// Counter based random numbers, so edge i is the same on every pass and for
+// any thread count. Each edge's start is mixed, so neighboring edges don't
+// get shifted copies of one stream.
+struct Random {
+	uint64_t state;
+
+	Random(uint64_t seed, uint64_t i) : state(mix(seed ^ mix(i))) {}
+
+	// splitmix64
+	uint64_t next() {
+		return mix(state += 0x9E3779B97F4A7C15ull);
+	}
+
+	// in [0, bound)
+	uint64_t below(uint64_t bound) {
+		return (uint64_t)(((unsigned __int128)next() * bound) >> 64);
+	}
+
+	double unit() {
+		return (next() >> 11) * (1.0 / (1ull << 53));
+	}
+};
+
+// Relabels vertices so R-MAT's high degree vertices are not all low ids.
+// Every step is a bijection on [0, 2^scale).
+static uint64_t scramble(uint64_t v, uint64_t scale, uint64_t seed) {
+	const uint64_t mask = scale == 64 ? ~0ull : (1ull << scale) - 1;
+	v = (v * 0x9E3779B97F4A7C15ull + seed) & mask;
+	v ^= v >> (scale / 2 + 1);
+	v = (v * 0xD6E8FEB86659FD93ull) & mask;
+	return v;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-g rmat|uniform] [-s scale] [-n verts] [-e edge_factor] [-x seed] [-p a,b,c] output.bin\n", name);
+	exit(1);
+}
+
+// Synthetic pagerank inputs in the layout matrix2graph writes. R-MAT (the
+// Graph500 Kronecker generator) has 2^scale vertices and picks each edge by
+// recursively choosing a quadrant of the adjacency matrix with
+// probabilities a, b, c and 1 - a - b - c. Uniform picks both endpoints
+// uniformly among -n vertices, 2^scale by default. Both make edge_factor
+// edges per vertex, the same graph for the same seed.
+int main(int argc, char *argv[]) {
+	bool rmat = true;
+	uint64_t scale = 16;
+	uint64_t verts = 0;
+	uint64_t edge_factor = 16;
+	uint64_t seed = 1;
+	double a = 0.57, b = 0.19, c = 0.19;
+
+	const char *name = argv[0];
+	int opt;
+	while ((opt = getopt(argc, argv, "e:g:n:p:s:x:")) != -1) {
+		string arg = opt == '?' ? "" : optarg;
+		if (opt == 'g' && (arg == "rmat" || arg == "uniform")) rmat = arg == "rmat";
+		else if (opt == 's') scale = strtoull(optarg, NULL, 0);
+		else if (opt == 'n') verts = strtoull(optarg, NULL, 0);
+		else if (opt == 'e') edge_factor = strtoull(optarg, NULL, 0);
+		else if (opt == 'x') seed = strtoull(optarg, NULL, 0);
+		else if (opt == 'p' && sscanf(optarg, "%lf,%lf,%lf", &a, &b, &c) == 3) continue;
+		else usage(name);
+	}
+	if (optind + 1 != argc) usage(name);
+	if (scale == 0 || scale > 40 || edge_factor == 0) usage(name);
+	if (rmat && verts != 0) usage(name);
+	if (a < 0 || b < 0 || c < 0 || a + b + c > 1) usage(name);
+	if (verts == 0) verts = 1ull << scale;
+
+	const uint64_t edges = verts * edge_factor;
+	const uint64_t num_threads = max(1u, min(thread::hardware_concurrency(), 64u));
+	printf("%s vertices, edges: %lu %lu (seed %lu)\n", rmat ? "R-MAT" : "Uniform", verts, edges, seed);
+
+	GraphWriter writer(argv[optind], verts, edges, num_threads);
+	writer.build([&](uint64_t t, const GraphWriter::Emit &emit) {
+		for (uint64_t i = edges * t / num_threads; i < edges * (t + 1) / num_threads; ++i) {
+			Random random(seed, i);
+			if (!rmat) {
+				uint64_t src = random.below(verts);
+				emit(src, random.below(verts));
+				continue;
+			}
+			uint64_t src = 0, dst = 0;
+			for (uint64_t bit = 0; bit < scale; ++bit) {
+				double r = random.unit();
+				bool right = r >= a && (r < a + b || r >= a + b + c); // b or d
+				bool down = r >= a + b;                                // c or d
+				src = (src << 1) | down;
+				dst = (dst << 1) | right;
+			}
+			emit(scramble(src, scale, seed), scramble(dst, scale, seed));
+		}
+	});
+	writer.finish();
+}
@@ -1,138 +1,268 @@
+#include <algorithm>
 #include <assert.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
-#include <limits>
+
+#include "graph_format.h"
+#include "graph_writer.h"
 
 using namespace std;
+
+static const char *skip_line(const char *p, const char *end) {
+	while (p < end && *p != '\n') ++p;
+	return p < end ? p + 1 : end;
+}
+
+static uint64_t parse_uint(const char *&p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t')) ++p;
+	uint64_t value = 0;
+	const char *start = p;
+	while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+	assert(p != start);
+	return value;
+}
+
+// Calls edge(src, dst) for every entry in [p, end), 0 based, and returns
+// how many there were. Blank and comment lines are skipped.
+template <typename Edge>
+static uint64_t parse_entries(const char *p, const char *end, uint64_t verts, Edge edge) {
+	uint64_t count = 0;
+	while (p < end) {
+		if (*p == '%' || *p == '\n' || *p == '\r') {
+			p = skip_line(p, end);
+			continue;
+		}
+		uint64_t src = parse_uint(p, end);
+		uint64_t dst = parse_uint(p, end);
+		assert(src != 0 && src <= verts);
+		assert(dst != 0 && dst <= verts);
+		edge(src - 1, dst - 1);
+		++count;
+		p = skip_line(p, end);
+	}
+	return count;
+}
+
+// Destination pages of 512 vertices, summed over each page's distinct source
+// rank pages: the gather pages a batch of destinations touches
+static uint64_t page_touches(uint64_t verts, const uint64_t *in_degrees, const uint64_t *in_edges, uint64_t num_threads) {
+	const uint64_t page = 512;
+	const uint64_t pages = (verts + page - 1) / page;
+	vector<uint64_t> offsets(pages + 1, 0);
+	for (uint64_t i = 0; i < verts; ++i) offsets[i / page + 1] += in_degrees[2 * i];
+	for (uint64_t p = 0; p < pages; ++p) offsets[p + 1] += offsets[p];
+
+	vector<uint64_t> touches(num_threads, 0);
+	parallel(num_threads, [&](uint64_t t) {
+		vector<uint64_t> seen(pages + 1, ~0ull);
+		for (uint64_t p = t; p < pages; p += num_threads) {
+			for (uint64_t e = offsets[p]; e < offsets[p + 1]; ++e) {
+				uint64_t src_page = in_edges[e] / page;
+				if (seen[src_page] != p) {
+					seen[src_page] = p;
+					++touches[t];
+				}
+			}
+		}
+	});
+	uint64_t total = 0;
+	for (uint64_t count : touches) total += count;
+	return total;
+}
+
+// Reverse Cuthill-McKee over the undirected graph: breadth first from the
+// lowest degree vertex of each component, neighbors by increasing degree
+static vector<uint64_t> rcm_order(uint64_t verts, const uint64_t *degrees, const vector<uint64_t> &in_offsets, const uint64_t *in_edges) {
+	vector<uint64_t> out_offsets(verts + 1, 0);
+	for (uint64_t i = 0; i < verts; ++i) out_offsets[i + 1] = out_offsets[i] + degrees[2 * i + 1];
+	vector<uint64_t> out_edges(out_offsets[verts]);
+	vector<uint64_t> next(out_offsets.begin(), out_offsets.end() - 1);
+	for (uint64_t dst = 0; dst < verts; ++dst)
+		for (uint64_t e = in_offsets[dst]; e < in_offsets[dst + 1]; ++e) out_edges[next[in_edges[e]]++] = dst;
+
+	auto degree = [&](uint64_t v) { return degrees[2 * v] + degrees[2 * v + 1]; };
+	auto by_degree = [&](uint64_t a, uint64_t b) { return degree(a) != degree(b) ? degree(a) < degree(b) : a < b; };
+	vector<uint64_t> starts(verts);
+	for (uint64_t i = 0; i < verts; ++i) starts[i] = i;
+	sort(starts.begin(), starts.end(), by_degree);
+
+	vector<uint64_t> order;
+	order.reserve(verts);
+	vector<char> visited(verts, false);
+	vector<uint64_t> neighbors;
+	for (uint64_t start : starts) {
+		if (visited[start]) continue;
+		visited[start] = true;
+		order.push_back(start);
+		for (uint64_t head = order.size() - 1; head < order.size(); ++head) {
+			uint64_t v = order[head];
+			neighbors.clear();
+			for (uint64_t e = in_offsets[v]; e < in_offsets[v + 1]; ++e)
+				if (!visited[in_edges[e]]) visited[in_edges[e]] = true, neighbors.push_back(in_edges[e]);
+			for (uint64_t e = out_offsets[v]; e < out_offsets[v + 1]; ++e)
+				if (!visited[out_edges[e]]) visited[out_edges[e]] = true, neighbors.push_back(out_edges[e]);
+			sort(neighbors.begin(), neighbors.end(), by_degree);
+			order.insert(order.end(), neighbors.begin(), neighbors.end());
+		}
+	}
+	reverse(order.begin(), order.end());
+	return order;
+}
+
+// Old vertex ids in their new order
+static vector<uint64_t> vertex_order(graph_format::ORDER method, uint64_t verts, const uint64_t *degrees, const vector<uint64_t> &in_offsets, const uint64_t *in_edges) {
+	vector<uint64_t> order(verts);
+	for (uint64_t i = 0; i < verts; ++i) order[i] = i;
+	// sources are gathered once per out-edge
+	auto out_degree = [&](uint64_t v) { return degrees[2 * v + 1]; };
+	if (method == graph_format::DEGREE) {
+		stable_sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) { return out_degree(a) > out_degree(b); });
+	} else if (method == graph_format::HUB) {
+		uint64_t total = 0;
+		for (uint64_t i = 0; i < verts; ++i) total += out_degree(i);
+		stable_partition(order.begin(), order.end(), [&](uint64_t v) { return out_degree(v) * verts > total; });
+	} else if (method == graph_format::RCM) {
+		order = rcm_order(verts, degrees, in_offsets, in_edges);
+	}
+	return order;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-r degree|hub|rcm] [-p permutation_out] input.mtx output.bin [sym]\n", name);
+	exit(1);
+}
+
+// Converts a Matrix Market file to the graph_format layout. The input is
+// mapped and parsed by every core twice: once to count degrees, once to
+// place each edge at its destination's slot, so the in-edge CSR is built
+// in place in the mapped output without per vertex allocations. Sources
+// are sorted within each destination to keep the output deterministic.
+// -r relabels the vertices for gather locality, -p then writes the new id
+// of every original vertex as 8 byte integers so results can be mapped back.
 int main(int argc, char *argv[]) {
-	assert(argc >= 3);
-	
+	graph_format::ORDER method = graph_format::ORIGINAL;
+	const char *permutation_path = NULL;
+	const char *name = argv[0];
+	int opt;
+	while ((opt = getopt(argc, argv, "p:r:")) != -1) {
+		string arg = opt == '?' ? "" : optarg;
+		if (opt == 'p') permutation_path = optarg;
+		else if (opt == 'r' && arg == "degree") method = graph_format::DEGREE;
+		else if (opt == 'r' && arg == "hub") method = graph_format::HUB;
+		else if (opt == 'r' && arg == "rcm") method = graph_format::RCM;
+		else usage(name);
+	}
+	// positional arguments as before: input output [sym]
+	argv += optind - 1;
+	argc -= optind - 1;
+	if (argc < 3) usage(name);
+
 	const bool symmetric = argc >= 4;
-	
-	// Open files
-	FILE *ifp = fopen(argv[1], "r");
-	assert(ifp != NULL);
-	FILE *ofp = fopen(argv[2], "w");
-	assert(ofp != NULL);
-	
-	// Allocate line buffer
-	const uint64_t line_size = 1025;
-	char line[line_size];
-	char *lp;
-	
+	const uint64_t num_threads = max(1u, min(thread::hardware_concurrency(), 64u));
+
+	// Map input
+	int ifd = open(argv[1], O_RDONLY);
+	assert(ifd >= 0);
+	struct stat st;
+	assert(fstat(ifd, &st) == 0);
+	assert(st.st_size != 0);
+	const char *input = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, ifd, 0);
+	assert(input != MAP_FAILED);
+	madvise((void *)input, st.st_size, MADV_SEQUENTIAL);
+	const char *input_end = input + st.st_size;
+
 	// Skip comments
-	while (true) {
-		lp = fgets(line, line_size, ifp);
-		assert(lp != NULL);
-		if (line[0] != '%') break;
-	}
-	
+	const char *body = input;
+	while (body < input_end && *body == '%') body = skip_line(body, input_end);
+	assert(body < input_end);
+
 	// Get dimensions
 	uint64_t rows, cols, entries;
-	assert(sscanf(line, "%lu %lu %lu", &rows, &cols, &entries) == 3);
+	assert(sscanf(body, "%lu %lu %lu", &rows, &cols, &entries) == 3);
 	assert(rows != 0);
 	assert(rows == cols);
 	assert(entries != 0);
+	body = skip_line(body, input_end);
 
 	const uint64_t verts = rows;
 	const uint64_t edges = symmetric ? 2 * entries : entries;
 	printf("Matrix vertices, edges: %lu %lu %s\n", verts, edges, symmetric ? "(with sym)" : "");
-	
-	// Get vertex data
-	vector<uint64_t> num_in_edges(verts, 0);
-	vector<uint64_t> num_out_edges(verts, 0);
-	vector<vector<uint64_t>> in_edges(verts, vector<uint64_t>());
-	for (uint64_t i = 0; i < entries; ++i) {
-		lp = fgets(line, line_size, ifp);
-		assert(lp != NULL);
-		
-		uint64_t src, dst;
-		//assert(sscanf(line, "%lu %lu", &src, &dst) == 2);
-		src = strtoul(line, &lp, 10);
-		assert(lp != NULL);
-		dst = strtoul(lp+1, &lp, 10);
-		assert(lp != NULL);
-		
-		assert(src != 0);
-		assert(dst != 0);
-		
-		src -= 1;
-		dst -= 1;
-		
-		assert(src < verts);
-		assert(dst < verts);
-		
-		num_in_edges[dst]++;
-		num_out_edges[src]++;
-		in_edges[dst].push_back(src);
-		
-		if (symmetric) {
-			num_in_edges[src]++;
-			num_out_edges[dst]++;
-			in_edges[src].push_back(dst);
-		}
-	}
-	
-	// Page-length padding metadata
-	const uint64_t extra_verts = 512 - (verts % 512);
-	const uint64_t extra_edges = 512 - (edges % 512);
-	
-	uint64_t val;
-
-	// Write vertex metadata
-	for (uint64_t i = 0; i < verts; ++i) {
-		fwrite(&num_in_edges[i], 8, 1, ofp);
-		fwrite(&num_out_edges[i], 8, 1, ofp);
-	}
-	
-	// Write vertex padding
-	for (uint64_t i = 0; i < extra_verts; ++i) {
-		val = (i == 0) ? extra_edges : 0;
-		
-		fwrite(&val, 8, 1, ofp);
-		fwrite(&val, 8, 1, ofp);
+
+	GraphWriter writer(argv[2], verts, edges, num_threads);
+	uint64_t *degrees = writer.degrees;
+	uint64_t *in_edges = writer.in_edges;
+
+	// Split the entries into chunks at line boundaries
+	vector<const char *> chunks(num_threads + 1, input_end);
+	chunks[0] = body;
+	for (uint64_t t = 1; t < num_threads; ++t) {
+		const char *p = body + (input_end - body) * t / num_threads;
+		chunks[t] = max(chunks[t - 1], p == body ? p : skip_line(p - 1, input_end));
 	}
-	
-	// Write edge data
-	for (auto srcs : in_edges) {
-		for (uint64_t src : srcs) {
-			fwrite(&src, 8, 1, ofp);
+
+	vector<uint64_t> parsed(num_threads, 0);
+	writer.build([&](uint64_t t, const GraphWriter::Emit &emit) {
+		parsed[t] = parse_entries(chunks[t], chunks[t + 1], verts, [&](uint64_t src, uint64_t dst) {
+			emit(src, dst);
+			if (symmetric) emit(dst, src);
+		});
+	});
+	uint64_t total = 0;
+	for (uint64_t count : parsed) total += count;
+	assert(total == entries);
+
+	if (method != graph_format::ORIGINAL) {
+		// Relabel from copies of the original CSR
+		vector<uint64_t> old_degrees(degrees, degrees + 2 * verts);
+		vector<uint64_t> old_edges(in_edges, in_edges + edges);
+		vector<uint64_t> old_offsets(verts + 1, 0);
+		for (uint64_t i = 0; i < verts; ++i) old_offsets[i + 1] = old_offsets[i] + old_degrees[2 * i];
+		uint64_t touches_before = page_touches(verts, degrees, in_edges, num_threads);
+
+		vector<uint64_t> order = vertex_order(method, verts, old_degrees.data(), old_offsets, old_edges.data());
+		vector<uint64_t> new_id(verts);
+		for (uint64_t i = 0; i < verts; ++i) new_id[order[i]] = i;
+
+		vector<uint64_t> new_offsets(verts + 1, 0);
+		for (uint64_t i = 0; i < verts; ++i) {
+			degrees[2 * i] = old_degrees[2 * order[i]];
+			degrees[2 * i + 1] = old_degrees[2 * order[i] + 1];
+			new_offsets[i + 1] = new_offsets[i] + degrees[2 * i];
+		}
+		parallel(num_threads, [&](uint64_t t) {
+			for (uint64_t i = t; i < verts; i += num_threads) {
+				uint64_t *out = in_edges + new_offsets[i];
+				for (uint64_t e = old_offsets[order[i]]; e < old_offsets[order[i] + 1]; ++e) *out++ = new_id[old_edges[e]];
+				sort(in_edges + new_offsets[i], out);
+			}
+		});
+		writer.header->order = method;
+
+		uint64_t touches_after = page_touches(verts, degrees, in_edges, num_threads);
+		printf("Source rank page touches per destination page: %lu -> %lu (%.1f%% fewer)\n", touches_before, touches_after,
+			touches_before ? 100.0 * ((double)touches_before - touches_after) / touches_before : 0.0);
+
+		if (permutation_path != NULL) {
+			FILE *pfp = fopen(permutation_path, "w");
+			assert(pfp != NULL);
+			assert(fwrite(new_id.data(), 8, verts, pfp) == verts);
+			fclose(pfp);
 		}
 	}
-	
-	// Write edge padding
-	for (uint64_t i = 0; i < extra_edges; ++i) {
-		val = rows;
-		fwrite(&val, 8, 1, ofp);
-	}
-	
-	// Write source pageranks
-	val = std::numeric_limits<uint64_t>::max() / verts;
-	for (uint64_t i = 0; i < rows; ++i) {
-		fwrite(&val, 8, 1, ofp);
-	}
-	
-	val = 0;
-	for (uint64_t i = 0; i < extra_verts; ++i) {
-		fwrite(&val, 8, 1, ofp);
-	}
-	
-	// Write destination pageranks
-	for (uint64_t i = 0; i < verts; ++i) {
-		fwrite(&val, 8, 1, ofp);
-	}
-	for (uint64_t i = 0; i < extra_verts; ++i) {
-		fwrite(&val, 8, 1, ofp);
-	}
-	
-	// Print metadata
-	const uint64_t final_verts = verts + extra_verts;
-	const uint64_t final_edges = edges + extra_edges;
-	printf("Final vertices, edges: %lu %lu\n", final_verts, final_edges);
-	
+
+	writer.finish();
+
 	// Close files
-	fclose(ofp);
-	fclose(ifp);
+	munmap((void *)input, st.st_size);
+	close(ifd);
 }
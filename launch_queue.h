@@ -0,0 +1,140 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "fsrf.h"
+
+// One accelerator launch: the register writes that program and start it,
+// the register condition that means it finished, and the buffers it reads
+// and writes so MMAP mode can move them around the run.
+struct KernelJob
+{
+    // written in order, the last one starts the kernel
+    std::vector<std::pair<uint64_t, uint64_t>> regs;
+    uint64_t done_addr = 0;
+    uint64_t done_mask = ~0ull;
+    uint64_t done_value = 0;
+    bool drain_credits = true;
+
+    // [addr, addr + length) ranges of fsrf_malloc allocations
+    std::vector<std::pair<void *, uint64_t>> inputs;
+    std::vector<std::pair<void *, uint64_t>> outputs;
+};
+
+// Runs KernelJobs back to back on one app slot. While a job runs, the
+// worker syncs the next job's inputs to the device. The next job is
+// programmed as soon as the running one completes, and only then are the
+// finished job's outputs synced back and its future made ready. While jobs
+// are queued the worker owns the kernel's registers.
+template <typename Runtime>
+class LaunchQueue
+{
+public:
+    LaunchQueue(Runtime *fsrf, FSRF::MODE mode) : fsrf(fsrf), mode(mode)
+    {
+        worker = std::thread(&LaunchQueue::run, this);
+    }
+
+    // Finishes every submitted job first
+    ~LaunchQueue()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        queued_cv.notify_all();
+        worker.join();
+    }
+
+    std::future<void> submit(KernelJob job)
+    {
+        std::unique_ptr<Entry> entry(new Entry);
+        entry->job = std::move(job);
+        std::future<void> done = entry->done.get_future();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            queue.push_back(std::move(entry));
+        }
+        queued_cv.notify_one();
+        return done;
+    }
+
+private:
+    struct Entry
+    {
+        KernelJob job;
+        std::promise<void> done;
+    };
+
+    // Next job, or nullptr if there is none and either wait is false or
+    // the queue is shutting down
+    std::unique_ptr<Entry> take(bool wait)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if (wait)
+            queued_cv.wait(guard, [this]
+                           { return stopping || !queue.empty(); });
+        if (queue.empty())
+            return nullptr;
+        std::unique_ptr<Entry> entry = std::move(queue.front());
+        queue.pop_front();
+        return entry;
+    }
+
+    void run()
+    {
+        std::unique_ptr<Entry> running;
+        while (true)
+        {
+            std::unique_ptr<Entry> next = take(running == nullptr);
+            if (next == nullptr && running == nullptr)
+                return;
+
+            if (next != nullptr && mode == FSRF::MODE::MMAP)
+            {
+                for (auto &input : next->job.inputs)
+                    fsrf->sync_host_to_device(input.first, input.second);
+            }
+            if (running != nullptr)
+            {
+                KernelJob &job = running->job;
+                fsrf->wait_reg(job.done_addr, job.done_mask, job.done_value);
+                if (job.drain_credits)
+                    fsrf->wait_credits_drained();
+            }
+            if (next != nullptr)
+            {
+                for (auto &reg : next->job.regs)
+                    fsrf->cntrlreg_write(reg.first, reg.second);
+            }
+            if (running != nullptr)
+            {
+                if (mode == FSRF::MODE::MMAP)
+                {
+                    for (auto &output : running->job.outputs)
+                        fsrf->sync_device_to_host(output.first, output.second);
+                }
+                running->done.set_value();
+            }
+            running = std::move(next);
+        }
+    }
+
+    Runtime *fsrf;
+    FSRF::MODE mode;
+
+    std::mutex lock;
+    std::condition_variable queued_cv;
+    std::deque<std::unique_ptr<Entry>> queue;
+    bool stopping = false;
+
+    std::thread worker;
+};
@@ -1,19 +1,35 @@
 #include <iostream>
 #include <memory>
+#include <signal.h>
+#include <string.h>
 #include <thread>
 
 #include "fault_handler.h"
 
+static FaultHandler *faultHandler = nullptr;
+
+static void handle_stop(int sig)
+{
+    if (faultHandler != nullptr)
+        faultHandler->stop();
+}
+
 int main(int argc, char **argv)
 {
-    int app_id = 0;
+    bool debug = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+    // flock in the FaultHandler keeps this the only process driving the device
+    faultHandler = new FaultHandler(debug);
 
-    // flock for interprocess locking
+    struct sigaction act = {0};
+    act.sa_handler = handle_stop;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
 
-    FaultHandler faultHandler(app_id);
     std::thread fsrf_fault_handler(&FaultHandler::listen, faultHandler);
 
     fsrf_fault_handler.join();
-    std::cerr << "Fault handler failed.";
-    return -1;
-}
\ No newline at end of file
+    delete faultHandler;
+    std::cerr << "Fault handler stopped.\n";
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "perf.h"
+
+using namespace std::chrono;
+
+namespace perf
+{
+    const char *const counter_names[NUM_COUNTERS] = {
+        "APP_REG",
+        "SYS_REG",
+        "MEM_REG",
+        "DMA_READ",
+        "DMA_WRITE",
+        "ATTACH_PCI",
+        "HUGE_PAGE",
+        "ZERO_TLB",
+        "MMAP",
+        "MPROTECT",
+        "MPROTECT_NONE",
+        "MPROTECT_NONE_TO_R",
+        "MPROTECT_NONE_TO_RW",
+        "MPROTECT_RW_TO_R",
+    };
+
+    Histogram histograms[num_slots][NUM_HISTOGRAMS];
+
+    // Live per-thread blocks, plus the totals of threads that already exited
+    static std::mutex registry_lock;
+    static std::set<ThreadCounters *> live;
+    static uint64_t retired_cycles[num_slots][NUM_COUNTERS];
+    static uint64_t retired_calls[num_slots][NUM_COUNTERS];
+
+    // TSC calibration against the steady clock over the process lifetime
+    static const uint64_t tsc_origin = __rdtsc();
+    static const steady_clock::time_point clock_origin = steady_clock::now();
+
+    thread_local ThreadCounters counters;
+
+    ThreadCounters::ThreadCounters()
+    {
+        for (uint64_t app_id = 0; app_id < num_slots; ++app_id)
+        {
+            for (int id = 0; id < NUM_COUNTERS; ++id)
+            {
+                cycles[app_id][id] = 0;
+                calls[app_id][id] = 0;
+                last_start[app_id][id] = 0;
+            }
+        }
+        const std::lock_guard<std::mutex> guard(registry_lock);
+        live.insert(this);
+    }
+
+    ThreadCounters::~ThreadCounters()
+    {
+        const std::lock_guard<std::mutex> guard(registry_lock);
+        for (uint64_t app_id = 0; app_id < num_slots; ++app_id)
+        {
+            for (int id = 0; id < NUM_COUNTERS; ++id)
+            {
+                retired_cycles[app_id][id] += cycles[app_id][id].load(std::memory_order_relaxed);
+                retired_calls[app_id][id] += calls[app_id][id].load(std::memory_order_relaxed);
+            }
+        }
+        live.erase(this);
+    }
+
+    double cycles_per_ns()
+    {
+        uint64_t elapsed_ns = duration_cast<nanoseconds>(steady_clock::now() - clock_origin).count();
+        if (elapsed_ns < 10000000)
+        {
+            std::this_thread::sleep_for(milliseconds(10));
+            elapsed_ns = duration_cast<nanoseconds>(steady_clock::now() - clock_origin).count();
+        }
+        return (double)(__rdtsc() - tsc_origin) / elapsed_ns;
+    }
+
+    uint64_t total_cycles(uint64_t app_id, COUNTER id)
+    {
+        const std::lock_guard<std::mutex> guard(registry_lock);
+        uint64_t total = retired_cycles[app_id][id];
+        for (auto it = live.begin(); it != live.end(); ++it)
+            total += (*it)->cycles[app_id][id].load(std::memory_order_relaxed);
+        return total;
+    }
+
+    uint64_t total_calls(uint64_t app_id, COUNTER id)
+    {
+        const std::lock_guard<std::mutex> guard(registry_lock);
+        uint64_t total = retired_calls[app_id][id];
+        for (auto it = live.begin(); it != live.end(); ++it)
+            total += (*it)->calls[app_id][id].load(std::memory_order_relaxed);
+        return total;
+    }
+
+    void reset(uint64_t app_id, COUNTER first, COUNTER last)
+    {
+        const std::lock_guard<std::mutex> guard(registry_lock);
+        for (int id = first; id < last; ++id)
+        {
+            retired_cycles[app_id][id] = 0;
+            retired_calls[app_id][id] = 0;
+            for (auto it = live.begin(); it != live.end(); ++it)
+            {
+                (*it)->cycles[app_id][id].store(0, std::memory_order_relaxed);
+                (*it)->calls[app_id][id].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void report(uint64_t app_id, COUNTER first, COUNTER last)
+    {
+        double rate = cycles_per_ns();
+        for (int id = first; id < last; ++id)
+        {
+            uint64_t ns = total_cycles(app_id, (COUNTER)id) / rate;
+            std::cout << counter_names[id] << "_MS, " << ns * microseconds::period::num / microseconds::period::den << "\n";
+        }
+        for (int id = first; id < last; ++id)
+        {
+            std::cout << counter_names[id] << "_CALLS, " << total_calls(app_id, (COUNTER)id) << "\n";
+        }
+    }
+
+    std::string histogram_name(HISTOGRAM id)
+    {
+        const char *mode_names[NUM_MODES] = {"INV_READ", "INV_WRITE", "MMAP", "MANAGED"};
+
+        if (id < DEVICE_FAULT_LATENCY)
+        {
+            int size_class = id < DMA_WRITE_LATENCY ? id - DMA_READ_LATENCY : id - DMA_WRITE_LATENCY;
+            return std::string(id < DMA_WRITE_LATENCY ? "DMA_READ_" : "DMA_WRITE_") + std::to_string(4 << size_class) + "K";
+        }
+        if (id < HOST_FAULT_LATENCY)
+        {
+            int index = id - DEVICE_FAULT_LATENCY;
+            return std::string("DEVICE_FAULT_") + mode_names[index / 2] + (index % 2 ? "_WRITE" : "_READ");
+        }
+        if (id < RESPOND_TLB_LATENCY)
+            return id == HOST_FAULT_LATENCY ? "HOST_FAULT_READ" : "HOST_FAULT_WRITE";
+        if (id == RESPOND_TLB_LATENCY)
+            return "RESPOND_TLB";
+        if (id == CREDIT_WAIT_LATENCY)
+            return "CREDIT_WAIT";
+        return "MPROTECT";
+    }
+
+    LatencySummary summarize(uint64_t app_id, HISTOGRAM id)
+    {
+        const Histogram &histogram = histograms[app_id][id];
+        double cycles_per_us = cycles_per_ns() * 1000;
+
+        LatencySummary summary;
+        summary.count = histogram.count();
+        summary.mean_us = histogram.mean() / cycles_per_us;
+        summary.p50_us = histogram.percentile(50) / cycles_per_us;
+        summary.p99_us = histogram.percentile(99) / cycles_per_us;
+        summary.p999_us = histogram.percentile(99.9) / cycles_per_us;
+        summary.max_us = histogram.max() / cycles_per_us;
+        return summary;
+    }
+
+    void reset(uint64_t app_id, HISTOGRAM first, HISTOGRAM last)
+    {
+        for (int id = first; id < last; ++id)
+            histograms[app_id][id].reset();
+    }
+
+    void report(uint64_t app_id, HISTOGRAM first, HISTOGRAM last)
+    {
+        for (int id = first; id < last; ++id)
+        {
+            if (histograms[app_id][id].count() == 0)
+                continue;
+            std::string name = histogram_name((HISTOGRAM)id);
+            LatencySummary summary = summarize(app_id, (HISTOGRAM)id);
+            std::cout << name << "_COUNT, " << summary.count << "\n";
+            std::cout << name << "_MEAN_US, " << summary.mean_us << "\n";
+            std::cout << name << "_P50_US, " << summary.p50_us << "\n";
+            std::cout << name << "_P99_US, " << summary.p99_us << "\n";
+            std::cout << name << "_P999_US, " << summary.p999_us << "\n";
+            std::cout << name << "_MAX_US, " << summary.max_us << "\n";
+        }
+    }
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <x86intrin.h>
+
+#include "histogram.h"
+
+// PERF instrumentation. Counters are identified at compile time and
+// accumulated per thread and per app slot in TSC cycles, so START/END are a
+// couple of plain loads and stores. Per-thread blocks are merged at report
+// time. Latency histograms are shared per app slot and also kept in cycles.
+namespace perf
+{
+    // matches max_apps in fpga.h
+    const uint64_t num_slots = 4;
+
+    enum COUNTER
+    {
+        // fpga.cpp
+        APP_REG,
+        SYS_REG,
+        MEM_REG,
+        DMA_READ,
+        DMA_WRITE,
+        ATTACH_PCI,
+        HUGE_PAGE,
+        ZERO_TLB,
+        // fsrf.cpp
+        MMAP,
+        MPROTECT,
+        MPROTECT_NONE,
+        MPROTECT_NONE_TO_R,
+        MPROTECT_NONE_TO_RW,
+        MPROTECT_RW_TO_R,
+
+        NUM_COUNTERS
+    };
+
+    const COUNTER FPGA_COUNTERS = APP_REG;
+    const COUNTER FSRF_COUNTERS = MMAP;
+
+    extern const char *const counter_names[NUM_COUNTERS];
+
+    struct ThreadCounters
+    {
+        // written only by the owning thread, read by report()
+        std::atomic<uint64_t> cycles[num_slots][NUM_COUNTERS];
+        std::atomic<uint64_t> calls[num_slots][NUM_COUNTERS];
+        uint64_t last_start[num_slots][NUM_COUNTERS];
+
+        ThreadCounters();
+        ~ThreadCounters();
+    };
+
+    extern thread_local ThreadCounters counters;
+
+    inline uint64_t now()
+    {
+        return __rdtsc();
+    }
+
+    inline void bump(std::atomic<uint64_t> &counter, uint64_t value)
+    {
+        // single writer, no need for a locked add
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    inline void start(uint64_t app_id, COUNTER id)
+    {
+        ThreadCounters &c = counters;
+        c.last_start[app_id][id] = now();
+        bump(c.calls[app_id][id], 1);
+    }
+
+    inline void end(uint64_t app_id, COUNTER id)
+    {
+        ThreadCounters &c = counters;
+        bump(c.cycles[app_id][id], now() - c.last_start[app_id][id]);
+    }
+
+    const int DMA_SIZE_CLASSES = 10; // 4 KB .. 2 MB
+    const int NUM_MODES = 4;         // FSRF::MODE
+
+    enum HISTOGRAM
+    {
+        // fpga.cpp, one per power of two transfer size
+        DMA_READ_LATENCY = 0,
+        DMA_WRITE_LATENCY = DMA_READ_LATENCY + DMA_SIZE_CLASSES,
+        // fsrf.cpp
+        DEVICE_FAULT_LATENCY = DMA_WRITE_LATENCY + DMA_SIZE_CLASSES, // per mode, read / write
+        HOST_FAULT_LATENCY = DEVICE_FAULT_LATENCY + 2 * NUM_MODES,   // read / write
+        RESPOND_TLB_LATENCY = HOST_FAULT_LATENCY + 2,                // fault arrival to response
+        CREDIT_WAIT_LATENCY,                                         // credits outstanding to drained
+        MPROTECT_LATENCY,
+
+        NUM_HISTOGRAMS
+    };
+
+    const HISTOGRAM FPGA_HISTOGRAMS = DMA_READ_LATENCY;
+    const HISTOGRAM FSRF_HISTOGRAMS = DEVICE_FAULT_LATENCY;
+
+    extern Histogram histograms[num_slots][NUM_HISTOGRAMS];
+
+    inline HISTOGRAM dma_histogram(bool read, uint64_t bytes)
+    {
+        int size_class = 63 - __builtin_clzll(bytes >> 12 | 1);
+        if (size_class >= DMA_SIZE_CLASSES)
+            size_class = DMA_SIZE_CLASSES - 1;
+        return (HISTOGRAM)((read ? DMA_READ_LATENCY : DMA_WRITE_LATENCY) + size_class);
+    }
+
+    inline HISTOGRAM device_fault_histogram(int mode, bool read)
+    {
+        return (HISTOGRAM)(DEVICE_FAULT_LATENCY + 2 * mode + !read);
+    }
+
+    inline HISTOGRAM host_fault_histogram(bool read)
+    {
+        return (HISTOGRAM)(HOST_FAULT_LATENCY + !read);
+    }
+
+    inline void record(uint64_t app_id, HISTOGRAM id, uint64_t cycles)
+    {
+        histograms[app_id][id].record(cycles);
+    }
+
+    struct LatencySummary
+    {
+        uint64_t count;
+        double mean_us;
+        double p50_us;
+        double p99_us;
+        double p999_us;
+        double max_us;
+    };
+
+    std::string histogram_name(HISTOGRAM id);
+    LatencySummary summarize(uint64_t app_id, HISTOGRAM id);
+
+    // Clear / print histograms [first, last) of one app slot, skipping empty ones
+    void reset(uint64_t app_id, HISTOGRAM first, HISTOGRAM last);
+    void report(uint64_t app_id, HISTOGRAM first, HISTOGRAM last);
+
+    double cycles_per_ns();
+    uint64_t total_cycles(uint64_t app_id, COUNTER id);
+    uint64_t total_calls(uint64_t app_id, COUNTER id);
+
+    // Clear / print counters [first, last) of one app slot
+    void reset(uint64_t app_id, COUNTER first, COUNTER last);
+    void report(uint64_t app_id, COUNTER first, COUNTER last);
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+// Migration policy: what each mode does about a device or host fault, kept
+// free of any device or OS state so the runtime, the fault handling daemon
+// and tools/fault_replay all run the same decisions.
+namespace policy
+{
+    // values of FSRF::MODE
+    enum MODE
+    {
+        INV_READ = 0,
+        INV_WRITE = 1,
+        MMAP = 2,
+        MANAGED = 3,
+    };
+
+    const int KEEP_PROT = -1;
+
+    struct DevicePlan
+    {
+        bool valid;              // false if the mode should never see this fault
+        trace::DECISION decision;
+        uint64_t vpn;            // first page of the range, batch aligned
+        uint64_t pages;          // length of the range
+        bool copy;               // allocate device pages and copy the range over
+        bool map;                // write TLB entries for the range
+        bool writeable;          // device permission of those entries
+        bool needs_vme;          // range must lie in an fsrf allocation
+        int prot_before_copy;    // host protection of the range, or KEEP_PROT
+        int prot_after_copy;
+    };
+
+    // resident: the faulting page is already on the device
+    // prefetch: batches to migrate beyond the faulting one, MANAGED only
+    inline DevicePlan plan_device_fault(MODE mode, bool read, uint64_t vpn, bool resident,
+                                        uint64_t batch_pages, uint64_t prefetch = 0)
+    {
+        DevicePlan plan = {true, trace::MIGRATE_PAGE, vpn, 1, true, true, true, false, KEEP_PROT, KEEP_PROT};
+        switch (mode)
+        {
+        case INV_READ:
+            plan.prot_after_copy = PROT_NONE;
+            break;
+        case INV_WRITE:
+            if (read)
+            {
+                // host and device share a read only copy
+                plan.writeable = false;
+                plan.prot_before_copy = PROT_READ;
+            }
+            else if (resident)
+            {
+                plan.decision = trace::UPGRADE_WRITEABLE;
+                plan.copy = false;
+                plan.prot_before_copy = PROT_NONE;
+            }
+            else
+            {
+                plan.prot_after_copy = PROT_NONE;
+            }
+            break;
+        case MANAGED:
+            if (resident)
+            {
+                // the device raced with an earlier batch fault
+                plan.decision = trace::ALREADY_PRESENT;
+                plan.copy = false;
+                plan.map = false;
+                break;
+            }
+            plan.decision = trace::MIGRATE_BATCH;
+            plan.vpn = vpn - vpn % batch_pages;
+            plan.pages = batch_pages * (1 + prefetch);
+            plan.needs_vme = true;
+            plan.prot_after_copy = PROT_NONE;
+            break;
+        default:
+            plan.valid = false;
+        }
+        return plan;
+    }
+
+    // Narrows a MANAGED plan to the pages around vpn that aren't on the
+    // device yet. Only adaptive batches overlap earlier, differently sized
+    // ones; fixed batches tile the allocation and pass through unchanged.
+    template <typename Resident>
+    inline void trim_to_missing(DevicePlan &plan, uint64_t vpn, Resident resident)
+    {
+        uint64_t first = vpn, end = vpn + 1;
+        while (first > plan.vpn && !resident(first - 1))
+            --first;
+        while (end < plan.vpn + plan.pages && !resident(end))
+            ++end;
+        plan.vpn = first;
+        plan.pages = end - first;
+    }
+
+    // Online batch size of one MANAGED allocation, between one page and the
+    // allocation's alignment. A fault right after a recent batch continues a
+    // stream and doubles the batch, any other fault halves it, so sequential
+    // scans grow toward 2 MB and scattered gathers shrink toward 4 KB.
+    const uint64_t adaptive_start_pages = 16;
+    const uint64_t adaptive_max_pages = 512; // 2 MB
+
+    struct BatchTuner
+    {
+        static const uint64_t streams = 4; // interleaved streams recognized
+        uint64_t pages;
+        uint64_t max_pages;
+        uint64_t ends[streams]; // page after each recent batch
+        uint64_t next_end;
+
+        BatchTuner(uint64_t pages = 1, uint64_t max_pages = 1) : pages(pages), max_pages(max_pages), next_end(0)
+        {
+            for (uint64_t i = 0; i < streams; ++i)
+                ends[i] = ~0ull;
+        }
+
+        // Batch for a fault at vpn, hit is set if it continued a stream
+        uint64_t on_fault(uint64_t vpn, bool &hit)
+        {
+            hit = false;
+            for (uint64_t i = 0; i < streams; ++i)
+                hit |= ends[i] == vpn;
+            if (hit)
+                pages = pages * 2 > max_pages ? max_pages : pages * 2;
+            else if (pages > 1)
+                pages /= 2;
+            return pages;
+        }
+
+        // The batch for the fault at vpn ended before end
+        void migrated(uint64_t vpn, uint64_t end)
+        {
+            for (uint64_t i = 0; i < streams; ++i)
+            {
+                if (ends[i] == vpn)
+                {
+                    ends[i] = end;
+                    return;
+                }
+            }
+            ends[next_end] = end;
+            next_end = (next_end + 1) % streams;
+        }
+    };
+
+    struct HostPlan
+    {
+        bool valid;         // false if the mode should never see this fault
+        uint64_t vpn;       // first page of the range, batch aligned
+        uint64_t pages;     // length of the range, copied back to the host
+        bool device_keeps;  // range stays on the device read only, else it is freed
+        int prot;           // host protection once copied back
+    };
+
+    inline HostPlan plan_host_fault(MODE mode, bool write, uint64_t vpn, uint64_t batch_pages)
+    {
+        HostPlan plan = {true, vpn, 1, false, PROT_READ | PROT_WRITE};
+        switch (mode)
+        {
+        case INV_READ:
+            break;
+        case INV_WRITE:
+            if (!write)
+            {
+                // the device may have written the page, share it read only
+                plan.device_keeps = true;
+                plan.prot = PROT_READ;
+            }
+            break;
+        case MANAGED:
+            plan.vpn = vpn - vpn % batch_pages;
+            plan.pages = batch_pages;
+            break;
+        default:
+            plan.valid = false;
+        }
+        return plan;
+    }
+}
@@ -0,0 +1,296 @@
+#include <cstring>
+#include <iostream>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <thread>
+
+#include "sim/device.h"
+#include "sim/kernels.h"
+#include "fpga.h"
+
+namespace sim
+{
+    // register file of the app and sys BARs, see FPGA::reg_access
+    static uint64_t reg_id(uint64_t offset)
+    {
+        return (offset >> 3) & 0xF;
+    }
+
+    static uint64_t reg_addr(uint64_t offset)
+    {
+        return (offset >> 7) << 3;
+    }
+
+    Device &Device::get()
+    {
+        // never destroyed, kernel threads may outlive main()
+        static Device *device = new Device();
+        return *device;
+    }
+
+    Device::Device() : next_phys(1ull << 30)
+    {
+        dram = (uint8_t *)mmap(NULL, dram_bytes, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (dram == MAP_FAILED)
+        {
+            perror("sim dram allocation error");
+            exit(EXIT_FAILURE);
+        }
+        for (uint64_t channel = 0; channel < num_channels; ++channel)
+            pages_xfered[channel] = 0;
+        for (uint64_t id = 0; id < 16; ++id)
+            for (uint64_t reg = 0; reg < 16; ++reg)
+                sys_regs[id][reg] = 0;
+
+        const char *env = getenv("FSRF_SIM_IMAGE");
+        if (env != nullptr)
+            image = env;
+    }
+
+    uint64_t Device::peek(int bar, uint64_t offset)
+    {
+        // an MMIO read is a bus round trip, don't let pollers starve kernels
+        std::this_thread::yield();
+        switch (bar)
+        {
+        case APP_PF_BAR0:
+            return kernel(reg_id(offset)).read_reg(reg_addr(offset));
+        case APP_PF_BAR1:
+        {
+            uint64_t id = reg_id(offset), addr = reg_addr(offset);
+            if (id < num_apps && addr == 0)
+                return read_fault(id);
+            if (id == 9)
+                return pages_xfered[(addr >> 3) % num_channels];
+            if ((addr >> 3) < 16)
+                return sys_regs[id][addr >> 3];
+            return 0;
+        }
+        case APP_PF_BAR4:
+            if (offset + 8 > dram_bytes)
+                return ~0ull;
+            return *(volatile uint64_t *)(dram + offset);
+        }
+        return ~0ull;
+    }
+
+    void Device::poke(int bar, uint64_t offset, uint64_t value)
+    {
+        switch (bar)
+        {
+        case APP_PF_BAR0:
+            kernel(reg_id(offset)).write_reg(reg_addr(offset), value);
+            break;
+        case APP_PF_BAR1:
+        {
+            uint64_t id = reg_id(offset), addr = reg_addr(offset);
+            if (id < num_apps && addr == 0)
+                respond(id, value);
+            else if (id == 9 && addr == 0)
+                dma(value);
+            else if ((addr >> 3) < 16)
+                sys_regs[id][addr >> 3] = value;
+            break;
+        }
+        case APP_PF_BAR4:
+            if (offset + 8 <= dram_bytes)
+                *(volatile uint64_t *)(dram + offset) = value;
+            break;
+        }
+    }
+
+    bool Device::access(uint64_t app_id, uint64_t vaddr, void *buf, uint64_t bytes, bool write)
+    {
+        Mmu &mmu = mmus[app_id];
+        bool ok = true;
+        mmu.credits += 1;
+        uint8_t *data = (uint8_t *)buf;
+        while (bytes != 0)
+        {
+            uint64_t offset = vaddr & 0xFFF;
+            uint64_t len = std::min<uint64_t>(bytes, 0x1000 - offset);
+            uint8_t *page = translate(app_id, vaddr >> 12, write);
+            if (page == nullptr)
+            {
+                ok = false;
+                if (!write)
+                    memset(data, 0, len);
+            }
+            else if (write)
+            {
+                memcpy(page + offset, data, len);
+            }
+            else
+            {
+                memcpy(data, page + offset, len);
+            }
+            vaddr += len;
+            data += len;
+            bytes -= len;
+        }
+        mmu.credits -= 1;
+        return ok;
+    }
+
+    void *Device::dma_alloc(uint64_t bytes, uint64_t &phys)
+    {
+        uint8_t *addr = (uint8_t *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+            return MAP_FAILED;
+
+        const std::lock_guard<std::mutex> guard(dma_lock);
+        phys = next_phys;
+        next_phys += (bytes + (2 << 20) - 1) & ~((2ull << 20) - 1);
+        dma_buffers.push_back({phys, bytes, addr});
+        return addr;
+    }
+
+    uint8_t *Device::translate(uint64_t app_id, uint64_t vpn, bool write)
+    {
+        uint64_t ppn;
+        if (lookup(app_id, vpn, write, ppn))
+            return dram + (ppn << 12);
+
+        Mmu &mmu = mmus[app_id];
+        const std::lock_guard<std::mutex> miss(mmu.miss_lock);
+        // the host may have filled the entry for an earlier miss
+        if (lookup(app_id, vpn, write, ppn))
+            return dram + (ppn << 12);
+
+        std::unique_lock<std::mutex> guard(mmu.lock);
+        mmu.fault = ((vpn & 0xFFFFFFFFFFFFF) << 2) | ((uint64_t)!write << 1) | 1;
+        mmu.fault_pending = true;
+        mmu.waiting = true;
+        mmu.responded_cv.wait(guard, [&] { return !mmu.waiting; });
+        if (!(mmu.response & 1))
+            return nullptr;
+        ppn = (mmu.response >> 1) & 0xFFFFFF;
+        return dram + (ppn << 12);
+    }
+
+    bool Device::lookup(uint64_t app_id, uint64_t vpn, bool write, uint64_t &ppn)
+    {
+        uint64_t addr = FPGA::dram_tlb_addr(app_id, vpn);
+        uint64_t entry = __atomic_load_n((uint64_t *)(dram + addr), __ATOMIC_ACQUIRE);
+        if (!(entry & 1) || (entry >> 28) != (vpn & ((1ull << 36) - 1)))
+            return false;
+        if (!(entry & (write ? 0x4 : 0x2)))
+            return false;
+        ppn = (entry >> 4) & 0xFFFFFF;
+        return true;
+    }
+
+    uint64_t Device::read_fault(uint64_t app_id)
+    {
+        Mmu &mmu = mmus[app_id];
+        const std::lock_guard<std::mutex> guard(mmu.lock);
+        if (mmu.fault_pending)
+        {
+            mmu.fault_pending = false;
+            return mmu.fault;
+        }
+        return std::min<uint64_t>(mmu.credits, 127) << 57;
+    }
+
+    void Device::respond(uint64_t app_id, uint64_t response)
+    {
+        Mmu &mmu = mmus[app_id];
+        const std::lock_guard<std::mutex> guard(mmu.lock);
+        // e.g. the tests clear the FIFO with no fault outstanding
+        if (!mmu.waiting || mmu.fault_pending)
+            return;
+        mmu.response = response;
+        mmu.waiting = false;
+        mmu.responded_cv.notify_all();
+    }
+
+    void Device::dma(uint64_t command)
+    {
+        uint64_t pcie_addr = (command & ((1ull << 28) - 1)) << 12;
+        uint64_t ppn = (command >> 28) & 0xFFFFFF;
+        uint64_t pages = ((command >> 52) & 0x1FF) + 1;
+        uint64_t channel = (command >> 61) & 0x3;
+        bool fpga_read = command >> 63;
+
+        uint64_t bytes = pages << 12;
+        uint8_t *host = host_buffer(pcie_addr, bytes);
+        uint8_t *device = dram + (ppn << 12);
+        if (host == nullptr || (ppn << 12) + bytes > dram_bytes)
+        {
+            std::cerr << "sim: PCIM command " << (void *)command << " out of range\n";
+            exit(EXIT_FAILURE);
+        }
+
+        if (fpga_read)
+        {
+            memcpy(host, device, bytes);
+        }
+        else
+        {
+            // zeroing the TLB and empty pages is most of what gets copied,
+            // give those back instead of committing memory for them
+            bool zero = host[0] == 0 && memcmp(host, host + 1, bytes - 1) == 0;
+            if (!zero || madvise(device, bytes, MADV_DONTNEED))
+                memcpy(device, host, bytes);
+        }
+        pages_xfered[channel] += pages;
+    }
+
+    uint8_t *Device::host_buffer(uint64_t phys, uint64_t bytes)
+    {
+        const std::lock_guard<std::mutex> guard(dma_lock);
+        for (const DmaBuffer &buffer : dma_buffers)
+        {
+            if (phys >= buffer.phys && phys + bytes <= buffer.phys + buffer.bytes)
+                return buffer.addr + (phys - buffer.phys);
+        }
+        return nullptr;
+    }
+
+    Kernel &Device::kernel(uint64_t app_id)
+    {
+        const std::lock_guard<std::mutex> guard(kernel_lock);
+        if (app_id >= num_apps)
+        {
+            std::cerr << "sim: no app slot " << app_id << "\n";
+            exit(EXIT_FAILURE);
+        }
+        if (!kernels[app_id])
+        {
+            kernels[app_id].reset(make_kernel(image, *this, app_id));
+            if (!kernels[app_id])
+            {
+                std::cerr << "sim: unknown image \"" << image << "\", set FSRF_SIM_IMAGE to aes, md5, nw or pagerank\n";
+                exit(EXIT_FAILURE);
+            }
+        }
+        return *kernels[app_id];
+    }
+}
+
+int fpga_mgmt_init()
+{
+    return 0;
+}
+
+int fpga_pci_attach(int slot_id, int pf_id, int bar_id, uint32_t flags, pci_bar_handle_t *handle)
+{
+    if (slot_id != 0 || pf_id != FPGA_APP_PF)
+        return 1;
+    sim::Device::get();
+    *handle = bar_id;
+    return 0;
+}
+
+int fpga_pci_peek64(pci_bar_handle_t handle, uint64_t offset, uint64_t *value)
+{
+    *value = sim::Device::get().peek(handle, offset);
+    return 0;
+}
+
+int fpga_pci_poke64(pci_bar_handle_t handle, uint64_t offset, uint64_t value)
+{
+    sim::Device::get().poke(handle, offset, value);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Software model of the FSRF shell, used by SIM builds in place of an F1
+// card. It serves the three BARs the runtime maps: app registers (BAR0),
+// system registers (BAR1) with the TLB fault FIFO and PCIM DMA engine, and
+// device DRAM (BAR4) holding the DRAM TLB. Kernels (sim/kernels.h) reach
+// DRAM only through translate(), which walks that TLB and faults to the
+// host the way the hardware does. The image is picked by FSRF_SIM_IMAGE.
+namespace sim
+{
+    const uint64_t dram_bytes = 64ull << 30;
+    const uint64_t num_apps = 4;
+    const uint64_t num_channels = 4;
+
+    class Kernel;
+
+    class Device
+    {
+    public:
+        static Device &get();
+
+        uint64_t peek(int bar, uint64_t offset);
+        void poke(int bar, uint64_t offset, uint64_t value);
+
+        // Copy between a kernel and app virtual memory, faulting to the host
+        // on TLB misses. False if the host refused a page, whose bytes are
+        // then dropped (stores) or zero (loads).
+        bool access(uint64_t app_id, uint64_t vaddr, void *buf, uint64_t bytes, bool write);
+
+        // Host memory the PCIM engine may reach; phys is its bus address
+        void *dma_alloc(uint64_t bytes, uint64_t &phys);
+
+    private:
+        Device();
+
+        // TLB walk of one app, a single outstanding miss like the hardware
+        struct Mmu
+        {
+            std::mutex miss_lock;
+            std::mutex lock;
+            std::condition_variable responded_cv;
+            uint64_t fault = 0;
+            bool fault_pending = false; // not read by the host yet
+            bool waiting = false;       // for the host's response
+            uint64_t response = 0;
+            std::atomic<uint64_t> credits; // accesses in flight
+
+            Mmu() : credits(0) {}
+        };
+
+        struct DmaBuffer
+        {
+            uint64_t phys;
+            uint64_t bytes;
+            uint8_t *addr;
+        };
+
+        uint8_t *translate(uint64_t app_id, uint64_t vpn, bool write);
+        bool lookup(uint64_t app_id, uint64_t vpn, bool write, uint64_t &ppn);
+        uint64_t read_fault(uint64_t app_id);
+        void respond(uint64_t app_id, uint64_t response);
+        void dma(uint64_t command);
+        uint8_t *host_buffer(uint64_t phys, uint64_t bytes);
+        Kernel &kernel(uint64_t app_id);
+
+        uint8_t *dram;
+        Mmu mmus[num_apps];
+        std::atomic<uint64_t> pages_xfered[num_channels];
+        std::atomic<uint64_t> sys_regs[16][16];
+
+        std::mutex dma_lock;
+        std::vector<DmaBuffer> dma_buffers;
+        uint64_t next_phys;
+
+        std::mutex kernel_lock;
+        std::unique_ptr<Kernel> kernels[num_apps];
+        std::string image;
+    };
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// Stand-in for the SDK's fpga_mgmt.h in SIM builds
+int fpga_mgmt_init();
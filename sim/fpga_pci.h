@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+// Stand-in for the SDK's fpga_pci.h in SIM builds; every BAR access is
+// served by the software device in sim/device.h.
+typedef int pci_bar_handle_t;
+
+#define FPGA_APP_PF 0
+#define APP_PF_BAR0 0
+#define APP_PF_BAR1 1
+#define APP_PF_BAR4 4
+#define BURST_CAPABLE 1
+
+int fpga_pci_attach(int slot_id, int pf_id, int bar_id, uint32_t flags, pci_bar_handle_t *handle);
+int fpga_pci_peek64(pci_bar_handle_t handle, uint64_t offset, uint64_t *value);
+int fpga_pci_poke64(pci_bar_handle_t handle, uint64_t offset, uint64_t value);
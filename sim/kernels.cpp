@@ -0,0 +1,547 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <stdlib.h>
+
+#include "sim/device.h"
+#include "sim/kernels.h"
+
+namespace sim
+{
+    Kernel::Kernel(Device &device, uint64_t app_id) : device(device), app_id(app_id)
+    {
+        for (uint64_t i = 0; i < num_regs; ++i)
+            regs[i] = 0;
+
+        const char *env = getenv("FSRF_SIM_THREADS");
+        workers_wanted = env != nullptr ? atoi(env) : std::thread::hardware_concurrency();
+        workers_wanted = std::max<uint64_t>(1, std::min<uint64_t>(workers_wanted, 16));
+    }
+
+    Kernel::~Kernel()
+    {
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+
+    void Kernel::write_reg(uint64_t addr, uint64_t value)
+    {
+        if ((addr >> 3) >= num_regs)
+            return;
+        regs[addr >> 3] = value;
+        written(addr);
+    }
+
+    uint64_t Kernel::read_reg(uint64_t addr)
+    {
+        return reg(addr);
+    }
+
+    uint64_t Kernel::reg(uint64_t addr) const
+    {
+        if ((addr >> 3) >= num_regs)
+            return 0;
+        return regs[addr >> 3];
+    }
+
+    void Kernel::launch(std::function<void(uint64_t)> body, std::function<void()> done)
+    {
+        // a new run waits for the last one, as on the card
+        for (std::thread &worker : workers)
+            worker.join();
+        workers.clear();
+
+        std::shared_ptr<std::atomic<uint64_t>> running(new std::atomic<uint64_t>(workers_wanted));
+        for (uint64_t worker = 0; worker < workers_wanted; ++worker)
+        {
+            workers.push_back(std::thread([=] {
+                body(worker);
+                if (--*running == 0)
+                    done();
+            }));
+        }
+    }
+
+    uint64_t Kernel::num_workers() const
+    {
+        return workers_wanted;
+    }
+
+    bool Kernel::load(uint64_t vaddr, void *buf, uint64_t bytes)
+    {
+        return device.access(app_id, vaddr, buf, bytes, false);
+    }
+
+    bool Kernel::store(uint64_t vaddr, const void *buf, uint64_t bytes)
+    {
+        return device.access(app_id, vaddr, (void *)buf, bytes, true);
+    }
+
+    Kernel::Stream::Stream(Kernel &kernel, uint64_t vaddr) : kernel(kernel), vaddr(vaddr), pos(0), end(0)
+    {
+    }
+
+    uint64_t Kernel::Stream::next()
+    {
+        if (pos == end)
+        {
+            // up to the end of the page, so a burst never faults twice
+            uint64_t bytes = 0x1000 - (vaddr & 0xFFF);
+            kernel.load(vaddr, words, bytes);
+            vaddr += bytes;
+            pos = 0;
+            end = bytes / 8;
+        }
+        return words[pos++];
+    }
+
+    // AES-128 over 16 byte blocks, keyed by the low words of 0x00-0x18.
+    // 0x20 src, 0x28 dest, 0x30 words (starts), 0x38 words left
+    class AesKernel : public Kernel
+    {
+        std::atomic<uint64_t> next_word;
+        std::atomic<uint64_t> words_left;
+        uint8_t round_keys[176];
+
+        static const uint8_t *sbox()
+        {
+            struct Table
+            {
+                uint8_t s[256];
+                Table()
+                {
+                    for (int x = 0; x < 256; ++x)
+                    {
+                        uint8_t inv = 0;
+                        for (int y = 1; x != 0 && y < 256; ++y)
+                        {
+                            if (gmul(x, y) == 1)
+                            {
+                                inv = y;
+                                break;
+                            }
+                        }
+                        uint8_t s_x = inv;
+                        for (int shift = 1; shift < 5; ++shift)
+                            s_x ^= (uint8_t)((inv << shift) | (inv >> (8 - shift)));
+                        s[x] = s_x ^ 0x63;
+                    }
+                }
+            };
+            static Table table;
+            return table.s;
+        }
+
+        static uint8_t xtime(uint8_t x)
+        {
+            return (x << 1) ^ ((x & 0x80) ? 0x1B : 0);
+        }
+
+        static uint8_t gmul(uint8_t a, uint8_t b)
+        {
+            uint8_t p = 0;
+            for (; b != 0; b >>= 1, a = xtime(a))
+            {
+                if (b & 1)
+                    p ^= a;
+            }
+            return p;
+        }
+
+        void expand_key()
+        {
+            const uint8_t *s = sbox();
+            for (uint64_t i = 0; i < 4; ++i)
+            {
+                uint32_t word = reg(i * 8);
+                memcpy(round_keys + 4 * i, &word, 4);
+            }
+            uint8_t rcon = 1;
+            for (uint64_t i = 4; i < 44; ++i)
+            {
+                uint8_t t[4];
+                memcpy(t, round_keys + 4 * (i - 1), 4);
+                if (i % 4 == 0)
+                {
+                    uint8_t first = t[0];
+                    t[0] = s[t[1]] ^ rcon;
+                    t[1] = s[t[2]];
+                    t[2] = s[t[3]];
+                    t[3] = s[first];
+                    rcon = xtime(rcon);
+                }
+                for (uint64_t j = 0; j < 4; ++j)
+                    round_keys[4 * i + j] = round_keys[4 * (i - 4) + j] ^ t[j];
+            }
+        }
+
+        void encrypt(uint8_t *block) const
+        {
+            const uint8_t *s = sbox();
+            uint8_t state[16];
+            for (int i = 0; i < 16; ++i)
+                state[i] = block[i] ^ round_keys[i];
+            for (int round = 1; round <= 10; ++round)
+            {
+                // SubBytes and ShiftRows, state is column major
+                uint8_t shifted[16];
+                for (int c = 0; c < 4; ++c)
+                    for (int r = 0; r < 4; ++r)
+                        shifted[c * 4 + r] = s[state[((c + r) % 4) * 4 + r]];
+                if (round != 10)
+                {
+                    for (int c = 0; c < 4; ++c)
+                    {
+                        uint8_t *a = shifted + c * 4;
+                        uint8_t t = a[0] ^ a[1] ^ a[2] ^ a[3];
+                        uint8_t a0 = a[0];
+                        a[0] ^= t ^ xtime(a[0] ^ a[1]);
+                        a[1] ^= t ^ xtime(a[1] ^ a[2]);
+                        a[2] ^= t ^ xtime(a[2] ^ a[3]);
+                        a[3] ^= t ^ xtime(a[3] ^ a0);
+                    }
+                }
+                for (int i = 0; i < 16; ++i)
+                    state[i] = shifted[i] ^ round_keys[round * 16 + i];
+            }
+            memcpy(block, state, 16);
+        }
+
+    public:
+        AesKernel(Device &device, uint64_t app_id) : Kernel(device, app_id), next_word(0), words_left(0) {}
+
+        virtual uint64_t read_reg(uint64_t addr)
+        {
+            if (addr == 0x38)
+                return words_left;
+            return Kernel::read_reg(addr);
+        }
+
+    protected:
+        virtual void written(uint64_t addr)
+        {
+            if (addr != 0x30)
+                return;
+            expand_key();
+            uint64_t words = reg(0x30);
+            next_word = 0;
+            words_left = words;
+            launch([=](uint64_t) {
+                const uint64_t chunk = 64; // one page
+                uint8_t buf[chunk * 64];
+                uint64_t first;
+                while ((first = next_word.fetch_add(chunk)) < words)
+                {
+                    uint64_t count = std::min(chunk, words - first);
+                    load(reg(0x20) + first * 64, buf, count * 64);
+                    for (uint64_t block = 0; block < count * 4; ++block)
+                        encrypt(buf + block * 16);
+                    store(reg(0x28) + first * 64, buf, count * 64);
+                    words_left -= count;
+                }
+            },
+                   [] {});
+        }
+    };
+
+    // MD5 compression of the raw words, no padding.
+    // 0x10 src, 0x20 words (starts), 0x28 words done, 0x00/0x08 digest,
+    // 0x30 nonzero continues from the previous run's digest
+    class Md5Kernel : public Kernel
+    {
+        std::atomic<uint64_t> words_done;
+        std::atomic<uint64_t> ab, cd;
+
+        static void compress(uint32_t *state, const uint32_t *m)
+        {
+            static const uint32_t shifts[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+            struct Table
+            {
+                uint32_t k[64];
+                Table()
+                {
+                    for (int i = 0; i < 64; ++i)
+                        k[i] = (uint32_t)(uint64_t)(fabs(sin(i + 1.0)) * 4294967296.0);
+                }
+            };
+            static Table table;
+
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            for (int i = 0; i < 64; ++i)
+            {
+                uint32_t f, g;
+                if (i < 16)
+                {
+                    f = (b & c) | (~b & d);
+                    g = i;
+                }
+                else if (i < 32)
+                {
+                    f = (d & b) | (~d & c);
+                    g = (5 * i + 1) % 16;
+                }
+                else if (i < 48)
+                {
+                    f = b ^ c ^ d;
+                    g = (3 * i + 5) % 16;
+                }
+                else
+                {
+                    f = c ^ (b | ~d);
+                    g = (7 * i) % 16;
+                }
+                uint32_t rotate = shifts[(i / 16) * 4 + i % 4];
+                uint32_t sum = a + f + table.k[i] + m[g];
+                a = d;
+                d = c;
+                c = b;
+                b += (sum << rotate) | (sum >> (32 - rotate));
+            }
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+        }
+
+    public:
+        Md5Kernel(Device &device, uint64_t app_id) : Kernel(device, app_id), words_done(0), ab(0), cd(0) {}
+
+        virtual uint64_t read_reg(uint64_t addr)
+        {
+            switch (addr)
+            {
+            case 0x00:
+                return ab;
+            case 0x08:
+                return cd;
+            case 0x28:
+                return words_done;
+            }
+            return Kernel::read_reg(addr);
+        }
+
+    protected:
+        virtual void written(uint64_t addr)
+        {
+            if (addr != 0x20)
+                return;
+            uint64_t words = reg(0x20);
+            uint64_t first_ab = reg(0x30) ? ab.load() : 0x67452301efcdab89;
+            uint64_t first_cd = reg(0x30) ? cd.load() : 0x98badcfe10325476;
+            words_done = 0;
+            // one chain, the other workers have nothing to do
+            launch([=](uint64_t worker) {
+                if (worker != 0)
+                    return;
+                uint32_t state[4] = {(uint32_t)(first_ab >> 32), (uint32_t)first_ab, (uint32_t)(first_cd >> 32), (uint32_t)first_cd};
+                uint32_t buf[1024];
+                for (uint64_t first = 0; first < words;)
+                {
+                    uint64_t count = std::min<uint64_t>(64, words - first);
+                    load(reg(0x10) + first * 64, buf, count * 64);
+                    for (uint64_t word = 0; word < count; ++word)
+                        compress(state, buf + word * 16);
+                    first += count;
+                    // digest is valid once the count reaches words
+                    ab = ((uint64_t)state[0] << 32) | state[1];
+                    cd = ((uint64_t)state[2] << 32) | state[3];
+                    words_done = first;
+                }
+            },
+                   [] {});
+        }
+    };
+
+    // Needleman-Wunsch over 128 bit symbols, scores saturated to 8 bits and
+    // written row major. Workers take rows round robin and trail the row
+    // above by a block, like the systolic array.
+    // 0x00 s0 addr, 0x08 s0 words, 0x10 s1 addr, 0x18 s1 words,
+    // 0x28 score count, 0x30 score addr, 0x38 score words (starts), 0x48 busy
+    class NwKernel : public Kernel
+    {
+        static const uint64_t block = 4096;
+
+        std::atomic<uint64_t> busy;
+        std::atomic<bool> s1_loaded;
+        std::vector<uint8_t> s1;
+        std::vector<std::vector<int32_t>> rows;     // worker ring of score rows
+        std::unique_ptr<std::atomic<uint64_t>[]> blocks_done;
+
+    public:
+        NwKernel(Device &device, uint64_t app_id) : Kernel(device, app_id), busy(0), s1_loaded(false) {}
+
+        virtual uint64_t read_reg(uint64_t addr)
+        {
+            if (addr == 0x48)
+                return busy;
+            return Kernel::read_reg(addr);
+        }
+
+    protected:
+        virtual void written(uint64_t addr)
+        {
+            if (addr != 0x38)
+                return;
+            uint64_t num_rows = reg(0x08) * 4;
+            uint64_t num_cols = reg(0x18) * 4;
+            uint64_t cells = std::min(std::min(reg(0x28), num_rows * num_cols), reg(0x38) * 64);
+            num_rows = num_cols == 0 ? 0 : std::min(num_rows, (cells + num_cols - 1) / num_cols);
+            uint64_t num_blocks = (num_cols + block - 1) / block;
+
+            busy = 1;
+            s1_loaded = false;
+            rows.assign(num_workers() + 1, std::vector<int32_t>(num_cols + 1));
+            blocks_done.reset(new std::atomic<uint64_t>[num_rows]);
+            for (uint64_t row = 0; row < num_rows; ++row)
+                blocks_done[row] = 0;
+
+            launch([=](uint64_t worker) {
+                if (worker == 0)
+                {
+                    s1.resize(num_cols * 16);
+                    load(reg(0x10), s1.data(), s1.size());
+                    s1_loaded = true;
+                }
+                while (!s1_loaded)
+                    std::this_thread::yield();
+
+                std::vector<uint8_t> scores(block);
+                for (uint64_t i = worker; i < num_rows; i += num_workers())
+                {
+                    uint8_t symbol[16];
+                    load(reg(0x00) + i * 16, symbol, 16);
+                    const std::vector<int32_t> &above = rows[i % rows.size()];
+                    std::vector<int32_t> &row = rows[(i + 1) % rows.size()];
+                    row[0] = -(int32_t)(i + 1);
+                    // carried across blocks, so a block only reads what the
+                    // row above wrote in the same block
+                    int32_t up_left = -(int32_t)i;
+                    for (uint64_t b = 0; b < num_blocks; ++b)
+                    {
+                        // the first row is scored against the gap row
+                        while (i != 0 && blocks_done[i - 1] <= b)
+                            std::this_thread::yield();
+                        uint64_t first = b * block, last = std::min(num_cols, first + block);
+                        for (uint64_t j = first; j < last; ++j)
+                        {
+                            int32_t up = i == 0 ? -(int32_t)(j + 1) : above[j + 1];
+                            int32_t match = memcmp(symbol, &s1[j * 16], 16) == 0 ? 1 : -1;
+                            int32_t score = std::max(up_left + match, std::max(up, row[j]) - 1);
+                            row[j + 1] = score;
+                            up_left = up;
+                            scores[j - first] = (uint8_t)std::max(-128, std::min(127, score));
+                        }
+                        uint64_t cell = i * num_cols + first;
+                        if (cell < cells)
+                            store(reg(0x30) + cell, scores.data(), std::min(last - first, cells - cell));
+                        blocks_done[i] = b + 1;
+                    }
+                }
+            },
+                   [this] { busy = 0; });
+        }
+    };
+
+    // One PageRank step over the in-edge graph of inputs/matrix2graph:
+    // rank[v] = (1 - d) / verts + d * sum(rank[u] / out_degree[u]), ranks
+    // fixed point with UINT64_MAX as 1. Workers split the vertices.
+    // 0x20 verts, 0x30 edges, 0x40 vertex ptr, 0x50 edge ptr, 0x60 input
+    // ranks, 0x70 output ranks, 0x00 control: write 1 starts, 0x10 clears,
+    // reads bit 0 busy and bit 1 done
+    class PagerankKernel : public Kernel
+    {
+        std::atomic<uint64_t> status;
+        std::atomic<uint64_t> ranges_counted;
+        std::vector<uint64_t> range_edges;
+
+    public:
+        PagerankKernel(Device &device, uint64_t app_id) : Kernel(device, app_id), status(0), ranges_counted(0) {}
+
+        virtual uint64_t read_reg(uint64_t addr)
+        {
+            if (addr == 0x00)
+                return status;
+            return Kernel::read_reg(addr);
+        }
+
+    protected:
+        virtual void written(uint64_t addr)
+        {
+            if (addr != 0x00)
+                return;
+            if (reg(0x00) & 0x10)
+            {
+                status = 0;
+                return;
+            }
+            if (!(reg(0x00) & 0x1))
+                return;
+
+            uint64_t verts = reg(0x20);
+            uint64_t workers = num_workers();
+            status = 1;
+            ranges_counted = 0;
+            range_edges.assign(workers, 0);
+
+            launch([=](uint64_t worker) {
+                uint64_t first = verts * worker / workers, last = verts * (worker + 1) / workers;
+
+                // where this range's edges start
+                Stream degrees(*this, reg(0x40) + first * 16);
+                for (uint64_t v = first; v < last; ++v)
+                {
+                    range_edges[worker] += degrees.next();
+                    degrees.next();
+                }
+                ++ranges_counted;
+                while (ranges_counted != workers)
+                    std::this_thread::yield();
+                uint64_t edge = 0;
+                for (uint64_t w = 0; w < worker; ++w)
+                    edge += range_edges[w];
+
+                const uint64_t one = UINT64_MAX;
+                const uint64_t base = verts == 0 ? 0 : (one / verts) / 100 * 15;
+                Stream vertices(*this, reg(0x40) + first * 16);
+                Stream edges(*this, reg(0x50) + edge * 8);
+                uint64_t out[512];
+                uint64_t out_first = first;
+                for (uint64_t v = first; v < last; ++v)
+                {
+                    uint64_t in_edges = vertices.next();
+                    vertices.next();
+                    uint64_t sum = 0;
+                    for (uint64_t e = 0; e < in_edges; ++e)
+                    {
+                        uint64_t src = edges.next();
+                        uint64_t rank = 0, degree = 0;
+                        load(reg(0x60) + src * 8, &rank, 8);
+                        load(reg(0x40) + src * 16 + 8, &degree, 8);
+                        sum += rank / std::max<uint64_t>(degree, 1);
+                    }
+                    out[v - out_first] = base + sum / 100 * 85;
+                    if (v + 1 - out_first == 512 || v + 1 == last)
+                    {
+                        store(reg(0x70) + out_first * 8, out, (v + 1 - out_first) * 8);
+                        out_first = v + 1;
+                    }
+                }
+            },
+                   [this] { status = 2; });
+        }
+    };
+
+    Kernel *make_kernel(const std::string &image, Device &device, uint64_t app_id)
+    {
+        if (image == "aes")
+            return new AesKernel(device, app_id);
+        if (image == "md5")
+            return new Md5Kernel(device, app_id);
+        if (image == "nw")
+            return new NwKernel(device, app_id);
+        if (image == "pagerank")
+            return new PagerankKernel(device, app_id);
+        return nullptr;
+    }
+}
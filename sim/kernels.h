@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace sim
+{
+    class Device;
+
+    // One app slot's accelerator. Register writes that start a run hand the
+    // work to worker threads, which reach memory only through the app's
+    // virtual addresses, so the host sees the same faults and credits the
+    // hardware kernel would cause. FSRF_SIM_THREADS sets the worker count.
+    class Kernel
+    {
+    public:
+        static const uint64_t num_regs = 64;
+
+        Kernel(Device &device, uint64_t app_id);
+        virtual ~Kernel();
+
+        void write_reg(uint64_t addr, uint64_t value);
+        virtual uint64_t read_reg(uint64_t addr);
+
+    protected:
+        // called after a write is stored, e.g. to start a run
+        virtual void written(uint64_t addr) = 0;
+
+        uint64_t reg(uint64_t addr) const;
+
+        // Runs body(worker) on every worker in the background, then done()
+        // on whichever worker finishes last
+        void launch(std::function<void(uint64_t)> body, std::function<void()> done);
+        uint64_t num_workers() const;
+
+        bool load(uint64_t vaddr, void *buf, uint64_t bytes);
+        bool store(uint64_t vaddr, const void *buf, uint64_t bytes);
+
+        // Sequential 64 bit reads, a page at a time like a burst
+        class Stream
+        {
+        public:
+            Stream(Kernel &kernel, uint64_t vaddr);
+            uint64_t next();
+
+        private:
+            Kernel &kernel;
+            uint64_t vaddr;
+            uint64_t words[512];
+            uint64_t pos;
+            uint64_t end;
+        };
+
+        Device &device;
+        uint64_t app_id;
+
+    private:
+        std::atomic<uint64_t> regs[num_regs];
+        std::vector<std::thread> workers;
+        uint64_t workers_wanted;
+    };
+
+    // Model of the kernel in a bitstream, nullptr for an unknown image
+    Kernel *make_kernel(const std::string &image, Device &device, uint64_t app_id);
+}
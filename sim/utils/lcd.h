@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdio.h>
+
+// Stand-in for the SDK's utils/lcd.h in SIM builds
+#define fail_on(CONDITION, LABEL, ...)    \
+    do                                    \
+    {                                     \
+        if (CONDITION)                    \
+        {                                 \
+            fprintf(stderr, __VA_ARGS__); \
+            goto LABEL;                   \
+        }                                 \
+    } while (0)
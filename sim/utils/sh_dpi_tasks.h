@@ -0,0 +1,4 @@
+#pragma once
+
+// Stand-in for the SDK's utils/sh_dpi_tasks.h in SIM builds, nothing in the
+// runtime uses it
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <functional>
+#include <iterator>
+#include <set>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+// Small objects carved out of large FSRF allocations, so they share the
+// allocations' host mappings, VMEs, device pages and TLB entries instead of
+// each rounding up to a batch. Objects come in power of two size classes
+// from 64 B to 2 KB. A class takes whole 4 KB pages from the regions and
+// tracks each page's objects in a bitmap. A page that empties can be taken
+// by any class again, regions themselves are kept for reuse. Callers lock.
+class SlabAllocator
+{
+public:
+    static const uint64_t min_object = 64;
+    static const uint64_t max_object = 2048;
+    static const uint64_t min_region = 64 << 10;
+
+    // new_region(region_bytes) returns a page aligned allocation
+    SlabAllocator(std::function<void *(uint64_t)> new_region, uint64_t region_bytes) : new_region(new_region), region_bytes(region_bytes) {}
+
+    // bytes at most max_object
+    void *allocate(uint64_t bytes)
+    {
+        uint64_t size_class = class_of(bytes);
+        std::set<uint64_t> &partial = partial_pages[size_class];
+        if (partial.empty())
+            partial.insert(take_page(size_class));
+
+        uint64_t page = *partial.begin();
+        Page &slab = pages[page];
+        uint64_t slot = __builtin_ctzll(~slab.used);
+        slab.used |= 1ull << slot;
+        if (slab.used == full(size_class))
+            partial.erase(page);
+        return (void *)(page + slot * object_bytes(size_class));
+    }
+
+    // Whether addr is in one of the regions, live object or not
+    bool owns(void *addr) const
+    {
+        auto it = regions.upper_bound((uint64_t)addr);
+        return it != regions.begin() && (uint64_t)addr < *std::prev(it) + region_bytes;
+    }
+
+    // Bytes of the live object at addr, 0 if there is none
+    uint64_t size_of(void *addr) const
+    {
+        uint64_t page = (uint64_t)addr & ~(page_bytes - 1);
+        auto it = pages.find(page);
+        if (it == pages.end())
+            return 0;
+        uint64_t bytes = object_bytes(it->second.size_class);
+        uint64_t offset = (uint64_t)addr - page;
+        if (offset % bytes != 0 || !(it->second.used & (1ull << (offset / bytes))))
+            return 0;
+        return bytes;
+    }
+
+    // False if addr isn't a live object of this allocator
+    bool free(void *addr)
+    {
+        uint64_t bytes = size_of(addr);
+        if (bytes == 0)
+            return false;
+        uint64_t page = (uint64_t)addr & ~(page_bytes - 1);
+        auto it = pages.find(page);
+        Page &slab = it->second;
+        uint64_t slot = ((uint64_t)addr - page) / bytes;
+
+        bool was_full = slab.used == full(slab.size_class);
+        slab.used &= ~(1ull << slot);
+        if (slab.used == 0)
+        {
+            partial_pages[slab.size_class].erase(page);
+            pages.erase(it);
+            free_pages.push_back(page);
+        }
+        else if (was_full)
+        {
+            partial_pages[slab.size_class].insert(page);
+        }
+        return true;
+    }
+
+private:
+    static const uint64_t page_bytes = 0x1000;
+    static const uint64_t num_classes = 6; // 64 B .. 2 KB
+
+    struct Page
+    {
+        uint64_t size_class;
+        uint64_t used; // bitmap of objects, at most 64 per page
+    };
+
+    std::function<void *(uint64_t)> new_region;
+    uint64_t region_bytes;
+    std::set<uint64_t> regions;
+    std::unordered_map<uint64_t, Page> pages; // pages given to a class
+    std::set<uint64_t> partial_pages[num_classes];
+    std::vector<uint64_t> free_pages;
+
+    static uint64_t class_of(uint64_t bytes)
+    {
+        uint64_t size_class = 0;
+        while (object_bytes(size_class) < bytes)
+            ++size_class;
+        return size_class;
+    }
+
+    static uint64_t object_bytes(uint64_t size_class)
+    {
+        return min_object << size_class;
+    }
+
+    static uint64_t full(uint64_t size_class)
+    {
+        uint64_t objects = page_bytes / object_bytes(size_class);
+        return objects == 64 ? ~0ull : (1ull << objects) - 1;
+    }
+
+    uint64_t take_page(uint64_t size_class)
+    {
+        if (free_pages.empty())
+        {
+            uint64_t region = (uint64_t)new_region(region_bytes);
+            regions.insert(region);
+            // hand out the lowest pages first
+            for (uint64_t page = region + region_bytes; page > region; page -= page_bytes)
+                free_pages.push_back(page - page_bytes);
+        }
+        uint64_t page = free_pages.back();
+        free_pages.pop_back();
+        pages[page] = {size_class, 0};
+        return page;
+    }
+};
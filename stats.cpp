@@ -0,0 +1,216 @@
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+namespace stats
+{
+    const char *const counter_names[NUM_COUNTERS] = {
+        "BYTES_TO_DEVICE",
+        "BYTES_TO_HOST",
+        "DEVICE_READ_FAULTS",
+        "DEVICE_WRITE_FAULTS",
+        "HOST_READ_FAULTS",
+        "HOST_WRITE_FAULTS",
+        "MPROTECTS",
+        "DMA_TRANSFERS",
+        "CREDIT_STALLS",
+        "PAGES_RESIDENT",
+        "PAGES_ALLOCATED",
+        "CREDITS_OUTSTANDING",
+        "DMA_QUEUE_DEPTH",
+    };
+
+    const char *const vme_counter_names[NUM_VME_COUNTERS] = {
+        "DEVICE_FAULTS",
+        "HOST_FAULTS",
+        "BYTES_TO_DEVICE",
+        "BYTES_TO_HOST",
+        "BATCH_HITS",
+        "BATCH_PAGES",
+    };
+
+    App apps[num_slots];
+
+    Vme *track_vme(uint64_t app_id, uint64_t addr, uint64_t size)
+    {
+        for (uint64_t i = 0; i < max_vmes; ++i)
+        {
+            Vme &vme = apps[app_id].vmes[i];
+            uint64_t expected = 0;
+            if (!vme.addr.compare_exchange_strong(expected, addr))
+                continue;
+            vme.size.store(size, std::memory_order_relaxed);
+            for (int id = 0; id < NUM_VME_COUNTERS; ++id)
+                vme.values[id].store(0, std::memory_order_relaxed);
+            return &vme;
+        }
+        return nullptr;
+    }
+
+    void untrack_vme(Vme *vme)
+    {
+        if (vme != nullptr)
+            vme->addr.store(0);
+    }
+
+    Snapshot snapshot(uint64_t app_id)
+    {
+        Snapshot snapshot;
+        snapshot.app_id = app_id;
+        for (int id = 0; id < NUM_COUNTERS; ++id)
+            snapshot.values[id] = apps[app_id].values[id].load(std::memory_order_relaxed);
+
+        for (uint64_t i = 0; i < max_vmes; ++i)
+        {
+            const Vme &vme = apps[app_id].vmes[i];
+            VmeSnapshot entry;
+            entry.addr = vme.addr.load();
+            if (entry.addr == 0)
+                continue;
+            entry.size = vme.size.load(std::memory_order_relaxed);
+            for (int id = 0; id < NUM_VME_COUNTERS; ++id)
+                entry.values[id] = vme.values[id].load(std::memory_order_relaxed);
+            snapshot.vmes.push_back(entry);
+        }
+        return snapshot;
+    }
+
+    void reset(uint64_t app_id)
+    {
+        for (int id = 0; id < NUM_COUNTERS; ++id)
+            apps[app_id].values[id].store(0, std::memory_order_relaxed);
+        for (uint64_t i = 0; i < max_vmes; ++i)
+            apps[app_id].vmes[i].addr.store(0);
+    }
+
+    std::string format(const Snapshot &snapshot)
+    {
+        std::ostringstream out;
+        out << "APP_ID, " << snapshot.app_id << "\n";
+        for (int id = 0; id < NUM_COUNTERS; ++id)
+            out << counter_names[id] << ", " << snapshot.values[id] << "\n";
+        for (const VmeSnapshot &vme : snapshot.vmes)
+        {
+            out << "VME_" << (void *)vme.addr << "_SIZE, " << vme.size << "\n";
+            for (int id = 0; id < NUM_VME_COUNTERS; ++id)
+                out << "VME_" << (void *)vme.addr << "_" << vme_counter_names[id] << ", " << vme.values[id] << "\n";
+        }
+        return out.str();
+    }
+
+    Reporter::Reporter(uint64_t app_id) : app_id(app_id), interval_ms(1000), listen_fd(-1), stop(false)
+    {
+        const char *file = getenv("FSRF_STATS_FILE");
+        const char *socket_name = getenv("FSRF_STATS_SOCKET");
+        const char *interval = getenv("FSRF_STATS_INTERVAL_MS");
+        if (file != nullptr)
+            file_path = std::string(file) + "." + std::to_string(app_id);
+        if (socket_name != nullptr)
+            socket_path = std::string(socket_name) + "." + std::to_string(app_id);
+        if (interval != nullptr && atoi(interval) > 0)
+            interval_ms = atoi(interval);
+
+        if (!socket_path.empty())
+        {
+            sockaddr_un addr = {0};
+            addr.sun_family = AF_UNIX;
+            if (socket_path.size() >= sizeof(addr.sun_path))
+            {
+                std::cerr << "stats socket path too long: " << socket_path << "\n";
+                socket_path.clear();
+            }
+            else
+            {
+                strcpy(addr.sun_path, socket_path.c_str());
+                unlink(socket_path.c_str());
+                listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) || listen(listen_fd, 8))
+                {
+                    perror("stats socket");
+                    if (listen_fd >= 0)
+                        close(listen_fd);
+                    listen_fd = -1;
+                    socket_path.clear();
+                }
+            }
+        }
+
+        if (!file_path.empty() || listen_fd >= 0)
+            thread = std::thread(&Reporter::run, this);
+    }
+
+    Reporter::~Reporter()
+    {
+        stop = true;
+        if (thread.joinable())
+            thread.join();
+        if (listen_fd >= 0)
+        {
+            close(listen_fd);
+            unlink(socket_path.c_str());
+        }
+    }
+
+    void Reporter::run()
+    {
+        while (!stop)
+        {
+            if (!file_path.empty())
+                write_file();
+            // sleeps in poll() when there is no socket
+            serve_clients(interval_ms);
+        }
+        // last snapshot reflects the finished run
+        if (!file_path.empty())
+            write_file();
+    }
+
+    void Reporter::write_file()
+    {
+        // write then rename so readers never see a partial snapshot
+        std::string tmp_path = file_path + ".tmp";
+        FILE *fp = fopen(tmp_path.c_str(), "w");
+        if (fp == NULL)
+        {
+            perror("stats file");
+            file_path.clear();
+            return;
+        }
+        std::string text = format(snapshot(app_id));
+        fwrite(text.data(), 1, text.size(), fp);
+        fclose(fp);
+        rename(tmp_path.c_str(), file_path.c_str());
+    }
+
+    void Reporter::serve_clients(int timeout_ms)
+    {
+        pollfd pfd = {listen_fd, POLLIN, 0};
+        // wake up regularly so the destructor doesn't wait a whole interval
+        for (int waited = 0; waited < timeout_ms && !stop; waited += 100)
+        {
+            int slice = timeout_ms - waited < 100 ? timeout_ms - waited : 100;
+            if (poll(&pfd, listen_fd >= 0 ? 1 : 0, slice) <= 0)
+                continue;
+            int client = accept(listen_fd, NULL, NULL);
+            if (client < 0)
+                continue;
+            std::string text = format(snapshot(app_id));
+            for (size_t sent = 0; sent < text.size();)
+            {
+                ssize_t n = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0)
+                    break;
+                sent += n;
+            }
+            close(client);
+        }
+    }
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Always-on runtime statistics. Counters are relaxed atomics updated on the
+// fault and DMA paths and read without taking any runtime lock, so a monitor
+// can sample a live app slot with snapshot(). Allocations are broken down in
+// a fixed table of VME slots per app slot.
+namespace stats
+{
+    // matches max_apps in fpga.h
+    const uint64_t num_slots = 4;
+    // allocations past this many per app slot are only counted in the totals
+    const uint64_t max_vmes = 64;
+
+    enum COUNTER
+    {
+        BYTES_TO_DEVICE,
+        BYTES_TO_HOST,
+        DEVICE_READ_FAULTS,
+        DEVICE_WRITE_FAULTS,
+        HOST_READ_FAULTS,
+        HOST_WRITE_FAULTS,
+        MPROTECTS,
+        DMA_TRANSFERS,
+        CREDIT_STALLS, // times the device started holding fault credits
+        // gauges
+        PAGES_RESIDENT,
+        PAGES_ALLOCATED,
+        CREDITS_OUTSTANDING,
+        DMA_QUEUE_DEPTH,
+
+        NUM_COUNTERS
+    };
+
+    enum VME_COUNTER
+    {
+        VME_DEVICE_FAULTS,
+        VME_HOST_FAULTS,
+        VME_BYTES_TO_DEVICE,
+        VME_BYTES_TO_HOST,
+        VME_BATCH_HITS, // MANAGED faults that continued a stream of batches
+        // gauges
+        VME_BATCH_PAGES, // pages the next MANAGED fault migrates
+
+        NUM_VME_COUNTERS
+    };
+
+    extern const char *const counter_names[NUM_COUNTERS];
+    extern const char *const vme_counter_names[NUM_VME_COUNTERS];
+
+    struct Vme
+    {
+        std::atomic<uint64_t> addr; // 0 while the slot is free
+        std::atomic<uint64_t> size;
+        std::atomic<uint64_t> values[NUM_VME_COUNTERS];
+    };
+
+    struct App
+    {
+        std::atomic<uint64_t> values[NUM_COUNTERS];
+        Vme vmes[max_vmes];
+    };
+
+    extern App apps[num_slots];
+
+    inline void add(uint64_t app_id, COUNTER id, uint64_t value = 1)
+    {
+        apps[app_id].values[id].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    inline void sub(uint64_t app_id, COUNTER id, uint64_t value = 1)
+    {
+        apps[app_id].values[id].fetch_sub(value, std::memory_order_relaxed);
+    }
+
+    inline void set(uint64_t app_id, COUNTER id, uint64_t value)
+    {
+        apps[app_id].values[id].store(value, std::memory_order_relaxed);
+    }
+
+    // vme may be null for memory that isn't tracked
+    inline void add(Vme *vme, VME_COUNTER id, uint64_t value = 1)
+    {
+        if (vme != nullptr)
+            vme->values[id].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    inline void set(Vme *vme, VME_COUNTER id, uint64_t value)
+    {
+        if (vme != nullptr)
+            vme->values[id].store(value, std::memory_order_relaxed);
+    }
+
+    // Claim a VME slot, returns null if the table is full
+    Vme *track_vme(uint64_t app_id, uint64_t addr, uint64_t size);
+    void untrack_vme(Vme *vme);
+
+    struct VmeSnapshot
+    {
+        uint64_t addr;
+        uint64_t size;
+        uint64_t values[NUM_VME_COUNTERS];
+    };
+
+    struct Snapshot
+    {
+        uint64_t app_id;
+        uint64_t values[NUM_COUNTERS];
+        std::vector<VmeSnapshot> vmes;
+    };
+
+    Snapshot snapshot(uint64_t app_id);
+    void reset(uint64_t app_id);
+
+    // "NAME, value" lines, VME counters as VME_<addr>_NAME
+    std::string format(const Snapshot &snapshot);
+
+    // Publishes snapshots of one app slot while it lives, configured from
+    // the environment:
+    //   FSRF_STATS_FILE=path      rewrite path.<app_id> every interval
+    //   FSRF_STATS_SOCKET=path    serve a snapshot to every client of the
+    //                             unix socket path.<app_id>
+    //   FSRF_STATS_INTERVAL_MS=n  default 1000
+    class Reporter
+    {
+    public:
+        Reporter(uint64_t app_id);
+        ~Reporter();
+
+    private:
+        uint64_t app_id;
+        std::string file_path;
+        std::string socket_path;
+        uint64_t interval_ms;
+        int listen_fd;
+        std::atomic<bool> stop;
+        std::thread thread;
+
+        void run();
+        void write_file();
+        void serve_clients(int timeout_ms);
+    };
+}
@@ -0,0 +1,158 @@
+#include <assert.h>
+#include <iostream>
+#include <set>
+
+#include "policy.h"
+
+using namespace policy;
+
+static void device_faults()
+{
+    // INV_READ moves the page over and takes it from the host
+    DevicePlan plan = plan_device_fault(INV_READ, true, 35, false, 16);
+    assert(plan.valid && plan.decision == trace::MIGRATE_PAGE);
+    assert(plan.vpn == 35 && plan.pages == 1);
+    assert(plan.copy && plan.map && plan.writeable && !plan.needs_vme);
+    assert(plan.prot_before_copy == KEEP_PROT && plan.prot_after_copy == PROT_NONE);
+
+    // INV_WRITE reads share a read only copy
+    plan = plan_device_fault(INV_WRITE, true, 35, false, 16);
+    assert(plan.decision == trace::MIGRATE_PAGE && plan.copy && !plan.writeable);
+    assert(plan.prot_before_copy == PROT_READ && plan.prot_after_copy == KEEP_PROT);
+
+    // a write to that shared copy only upgrades it
+    plan = plan_device_fault(INV_WRITE, false, 35, true, 16);
+    assert(plan.decision == trace::UPGRADE_WRITEABLE);
+    assert(!plan.copy && plan.map && plan.writeable);
+    assert(plan.prot_before_copy == PROT_NONE && plan.prot_after_copy == KEEP_PROT);
+
+    // a write to a page the device doesn't have moves it
+    plan = plan_device_fault(INV_WRITE, false, 35, false, 16);
+    assert(plan.decision == trace::MIGRATE_PAGE && plan.copy && plan.writeable);
+    assert(plan.prot_before_copy == KEEP_PROT && plan.prot_after_copy == PROT_NONE);
+
+    // MANAGED moves the whole aligned batch, plus any prefetch
+    plan = plan_device_fault(MANAGED, true, 35, false, 16);
+    assert(plan.decision == trace::MIGRATE_BATCH);
+    assert(plan.vpn == 32 && plan.pages == 16);
+    assert(plan.copy && plan.map && plan.writeable && plan.needs_vme);
+    assert(plan.prot_after_copy == PROT_NONE);
+    plan = plan_device_fault(MANAGED, false, 35, false, 16, 2);
+    assert(plan.vpn == 32 && plan.pages == 48);
+
+    // a fault racing an earlier batch does nothing
+    plan = plan_device_fault(MANAGED, true, 35, true, 16);
+    assert(plan.valid && plan.decision == trace::ALREADY_PRESENT);
+    assert(!plan.copy && !plan.map);
+
+    // MMAP allocations are mapped up front and never fault this way
+    plan = plan_device_fault(MMAP, true, 35, false, 16);
+    assert(!plan.valid);
+}
+
+static void host_faults()
+{
+    // INV_READ takes the page back
+    HostPlan plan = plan_host_fault(INV_READ, false, 35, 16);
+    assert(plan.valid && plan.vpn == 35 && plan.pages == 1);
+    assert(!plan.device_keeps && plan.prot == (PROT_READ | PROT_WRITE));
+
+    // INV_WRITE host reads share the page, writes take it back
+    plan = plan_host_fault(INV_WRITE, false, 35, 16);
+    assert(plan.pages == 1 && plan.device_keeps && plan.prot == PROT_READ);
+    plan = plan_host_fault(INV_WRITE, true, 35, 16);
+    assert(plan.pages == 1 && !plan.device_keeps && plan.prot == (PROT_READ | PROT_WRITE));
+
+    // MANAGED takes back the whole batch
+    plan = plan_host_fault(MANAGED, true, 35, 16);
+    assert(plan.vpn == 32 && plan.pages == 16 && !plan.device_keeps);
+
+    plan = plan_host_fault(MMAP, true, 35, 16);
+    assert(!plan.valid);
+}
+
+static void trims()
+{
+    std::set<uint64_t> on_device = {33, 34, 40};
+    auto resident = [&](uint64_t vpn) { return on_device.count(vpn) != 0; };
+
+    // stops at the pages already on the device around the fault
+    DevicePlan plan = plan_device_fault(MANAGED, true, 37, false, 16);
+    trim_to_missing(plan, 37, resident);
+    assert(plan.vpn == 35 && plan.pages == 5);
+
+    // and at the ends of the batch
+    plan = plan_device_fault(MANAGED, true, 44, false, 16);
+    trim_to_missing(plan, 44, resident);
+    assert(plan.vpn == 41 && plan.pages == 7);
+
+    // a fixed batch with nothing on the device is unchanged
+    on_device.clear();
+    plan = plan_device_fault(MANAGED, true, 37, false, 16);
+    trim_to_missing(plan, 37, resident);
+    assert(plan.vpn == 32 && plan.pages == 16);
+}
+
+static void tuner()
+{
+    BatchTuner batch(adaptive_start_pages, adaptive_max_pages);
+    bool hit;
+
+    // a stream doubles the batch up to the maximum
+    uint64_t vpn = 1000;
+    assert(batch.on_fault(vpn, hit) == 8 && !hit);
+    batch.migrated(vpn, vpn + 8);
+    uint64_t pages = 8;
+    for (int i = 0; i < 10; ++i)
+    {
+        vpn += pages;
+        pages = batch.on_fault(vpn, hit);
+        assert(hit);
+        assert(pages == (8ull << (i + 1) < adaptive_max_pages ? 8ull << (i + 1) : adaptive_max_pages));
+        batch.migrated(vpn, vpn + pages);
+    }
+    assert(pages == adaptive_max_pages);
+
+    // scattered faults halve it down to one page
+    for (int i = 0; i < 12; ++i)
+    {
+        pages = batch.on_fault(100000 + 7919 * i, hit);
+        assert(!hit);
+        batch.migrated(100000 + 7919 * i, 100000 + 7919 * i + pages);
+    }
+    assert(pages == 1);
+
+    // up to four interleaved streams are recognized
+    BatchTuner streams(16, 512);
+    uint64_t next[5];
+    for (uint64_t s = 0; s < 5; ++s)
+    {
+        next[s] = s * 10000;
+        streams.on_fault(next[s], hit);
+        streams.migrated(next[s], next[s] + 4);
+        next[s] += 4;
+    }
+    // the fifth stream pushed out the first
+    streams.on_fault(next[0], hit);
+    assert(!hit);
+    for (uint64_t s = 2; s < 5; ++s)
+    {
+        streams.on_fault(next[s], hit);
+        assert(hit);
+    }
+
+    // a stream never grows the batch past the allocation's alignment
+    BatchTuner capped(16, 16);
+    capped.migrated(0, 16);
+    assert(capped.on_fault(16, hit) == 16 && hit);
+}
+
+int main(int argc, char **argv)
+{
+    device_faults();
+    host_faults();
+    trims();
+    tuner();
+    std::cout << "policy tests passed\n";
+    return 0;
+}
@@ -0,0 +1,148 @@
+#include <assert.h>
+#include <iostream>
+#include <string.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include "fsrf.h"
+#include "slab.h"
+
+static uint64_t regions = 0;
+
+static void *new_region(uint64_t bytes)
+{
+    regions += 1;
+    void *region = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(region != MAP_FAILED);
+    return region;
+}
+
+static uint64_t page_of(void *addr)
+{
+    return (uint64_t)addr & ~0xFFFull;
+}
+
+static void size_classes()
+{
+    SlabAllocator slab(new_region, SlabAllocator::min_region);
+
+    // 64 B and 2 KB are the smallest and largest classes
+    void *one = slab.allocate(1);
+    void *min = slab.allocate(64);
+    void *over_min = slab.allocate(65);
+    void *under_max = slab.allocate(2047);
+    void *max = slab.allocate(2048);
+    assert(slab.size_of(one) == 64);
+    assert(slab.size_of(min) == 64);
+    assert(slab.size_of(over_min) == 128);
+    assert(slab.size_of(under_max) == 2048);
+    assert(slab.size_of(max) == 2048);
+
+    // a page holds one class only
+    assert(page_of(one) == page_of(min));
+    assert(page_of(min) != page_of(over_min));
+    assert(page_of(under_max) == page_of(max));
+    assert((uint64_t)max - (uint64_t)under_max == 2048);
+}
+
+static void exhaustion()
+{
+    regions = 0;
+    SlabAllocator slab(new_region, SlabAllocator::min_region);
+
+    // 64 objects of 64 B fill a page's whole bitmap
+    std::vector<void *> small;
+    for (int i = 0; i < 64; ++i)
+        small.push_back(slab.allocate(64));
+    for (int i = 0; i < 64; ++i)
+        assert(page_of(small[i]) == page_of(small[0]));
+    void *next_page = slab.allocate(64);
+    assert(page_of(next_page) != page_of(small[0]));
+
+    // a slot freed in the full page is handed out again
+    assert(slab.free(small[10]));
+    assert(slab.allocate(64) == small[10]);
+
+    // the first region has 16 pages, two taken; 2 KB objects fill the
+    // other 14 and then grow into a new region
+    std::vector<void *> large;
+    for (int i = 0; i < 28; ++i)
+        large.push_back(slab.allocate(2048));
+    assert(regions == 1);
+    void *grown = slab.allocate(2048);
+    assert(regions == 2);
+    assert(slab.owns(grown) && slab.owns(small[0]));
+    for (int i = 0; i < 28; ++i)
+        assert(page_of(large[i]) - page_of(small[0]) < SlabAllocator::min_region);
+    assert(page_of(grown) - page_of(small[0]) >= SlabAllocator::min_region ||
+           page_of(grown) < page_of(small[0]));
+
+    // a page that empties goes to whichever class needs one next
+    for (int i = 0; i < 64; ++i)
+        assert(slab.free(small[i]));
+    void *reused = slab.allocate(1024);
+    assert(page_of(reused) == page_of(small[0]));
+    assert(regions == 2);
+}
+
+static void invalid_frees()
+{
+    SlabAllocator slab(new_region, SlabAllocator::min_region);
+    char *object = (char *)slab.allocate(256);
+    char *neighbor = (char *)slab.allocate(256);
+
+    assert(!slab.free(object + 8));
+    assert(!slab.free(object + 255));
+    assert(slab.free(object));
+    assert(!slab.free(object));
+    // the neighbor survives both
+    assert(slab.size_of(neighbor) == 256);
+
+    // a slot that was never handed out and memory outside every region
+    assert(slab.owns(neighbor + 256 * 4));
+    assert(slab.size_of(neighbor + 256 * 4) == 0);
+    assert(!slab.free(neighbor + 256 * 4));
+    int local;
+    assert(!slab.owns(&local));
+    assert(!slab.free(&local));
+}
+
+static void sync_neighbors()
+{
+    FSRF fsrf(0, FSRF::MODE::MMAP, false, 1);
+    char *a = (char *)fsrf.fsrf_malloc_small(100, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE);
+    char *b = (char *)fsrf.fsrf_malloc_small(100, PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE);
+    assert(page_of(a) == page_of(b));
+
+    memset(a, 1, 100);
+    memset(b, 2, 100);
+    fsrf.sync_small_to_device(a);
+    fsrf.sync_small_to_device(b);
+
+    // b's newer host bytes stay when a comes back from the device
+    memset(b, 3, 100);
+    memset(a, 4, 100);
+    fsrf.sync_small_to_host(a);
+    for (int i = 0; i < 100; ++i)
+        assert(a[i] == 1 && b[i] == 3);
+
+    // and a's sync to the device leaves b's device copy alone
+    memset(a, 5, 100);
+    fsrf.sync_small_to_device(a);
+    fsrf.sync_small_to_host(b);
+    for (int i = 0; i < 100; ++i)
+        assert(a[i] == 5 && b[i] == 2);
+
+    fsrf.fsrf_free_small(a);
+    fsrf.fsrf_free_small(b);
+}
+
+int main(int argc, char **argv)
+{
+    size_classes();
+    exhaustion();
+    invalid_frees();
+    sync_neighbors();
+    std::cout << "slab tests passed\n";
+    return 0;
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <iostream>
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+#include "trace_file.h"
+
+// Timing model of the host side of a migration: fault FIFO and TLB MMIO,
+// PCIM DMA and mprotect. The defaults are rough F1 numbers; fit() replaces
+// them with what a trace actually measured.
+struct CostModel
+{
+    double fault_us = 8;       // fault FIFO read, response and bookkeeping
+    double tlb_write_us = 0.5; // one MMIO write into the DRAM TLB
+    double dma_fixed_us = 4;   // per PCIM transfer
+    double dma_page_us = 0.4;  // per 4 KB page of a transfer
+    double mprotect_us = 2;    // per call, independent of length
+
+    // pages may exceed one transfer, xfer_buf holds 512 pages
+    double dma(uint64_t pages) const
+    {
+        uint64_t transfers = (pages + 511) / 512;
+        return transfers * dma_fixed_us + pages * dma_page_us;
+    }
+
+    // TLB entries of a run of consecutive pages. Runs of 64 or more are
+    // installed by reading their sets back and writing them out again, 64
+    // bytes of sets per entry each way (FSRF::write_tlb_run).
+    double tlb_run(uint64_t pages) const
+    {
+        if (pages < 64)
+            return pages * tlb_write_us;
+        return 2 * dma((pages * 64 + 4095) / 4096);
+    }
+
+    // device fault that moves pages to the device
+    double migrate(uint64_t pages) const
+    {
+        return fault_us + pages * tlb_write_us + dma(pages) + mprotect_us;
+    }
+
+    // host fault that brings pages back
+    double evict(uint64_t pages) const
+    {
+        return pages * tlb_write_us + dma(pages) + mprotect_us;
+    }
+
+    // Fit the model to the events of one app, keeping defaults for any cost
+    // the trace has no samples of
+    void fit(const std::vector<TraceEvent> &events, uint64_t app_id)
+    {
+        LinearFit dma_fit, fault_fit;
+        double mprotect_total = 0;
+        uint64_t mprotect_calls = 0;
+
+        // per thread state, events of one thread are strictly nested
+        struct Open
+        {
+            const TraceEvent *dma = nullptr;
+            const TraceEvent *mprotect = nullptr;
+            const TraceEvent *fault = nullptr;
+            double inner_us = 0; // DMA and mprotect time inside the fault
+            uint64_t tlb_writes = 0;
+        };
+        std::map<uint32_t, Open> open;
+
+        for (const TraceEvent &e : events)
+        {
+            if (e.event.app_id != app_id)
+                continue;
+            Open &o = open[e.event.thread];
+            switch (e.event.type)
+            {
+            case trace::DMA_SUBMIT:
+                o.dma = &e;
+                break;
+            case trace::DMA_COMPLETE:
+                if (o.dma != nullptr)
+                {
+                    double us = elapsed_us(*o.dma, e);
+                    dma_fit.add((e.event.arg1 & ~(1ULL << 63)) >> 12, us);
+                    o.inner_us += us;
+                    o.dma = nullptr;
+                }
+                break;
+            case trace::MPROTECT_BEGIN:
+                o.mprotect = &e;
+                break;
+            case trace::MPROTECT_END:
+                if (o.mprotect != nullptr)
+                {
+                    double us = elapsed_us(*o.mprotect, e);
+                    mprotect_total += us;
+                    mprotect_calls += 1;
+                    o.inner_us += us;
+                    o.mprotect = nullptr;
+                }
+                break;
+            case trace::TLB_WRITE:
+                o.tlb_writes += 1;
+                break;
+            case trace::DEVICE_FAULT_BEGIN:
+                o.fault = &e;
+                o.inner_us = 0;
+                o.tlb_writes = 0;
+                break;
+            case trace::DEVICE_FAULT_END:
+                if (o.fault != nullptr)
+                {
+                    fault_fit.add(o.tlb_writes, elapsed_us(*o.fault, e) - o.inner_us);
+                    o.fault = nullptr;
+                }
+                break;
+            }
+        }
+
+        dma_fit.apply(dma_fixed_us, dma_page_us);
+        fault_fit.apply(fault_us, tlb_write_us);
+        if (mprotect_calls != 0)
+            mprotect_us = mprotect_total / mprotect_calls;
+    }
+
+    void print(std::ostream &out) const
+    {
+        out << "FAULT_US, " << fault_us << "\n";
+        out << "TLB_WRITE_US, " << tlb_write_us << "\n";
+        out << "DMA_FIXED_US, " << dma_fixed_us << "\n";
+        out << "DMA_PAGE_US, " << dma_page_us << "\n";
+        out << "MPROTECT_US, " << mprotect_us << "\n";
+    }
+
+private:
+    // least squares y = intercept + slope * x
+    struct LinearFit
+    {
+        double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+        void add(double x, double y)
+        {
+            n += 1;
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+
+        // only the intercept is measurable if x never varies
+        void apply(double &intercept, double &slope) const
+        {
+            if (n == 0)
+                return;
+            double var = n * sxx - sx * sx;
+            if (var > 1e-9 * n * n)
+            {
+                slope = (n * sxy - sx * sy) / var;
+                intercept = (sy - slope * sx) / n;
+            }
+            else
+            {
+                intercept = (sy - slope * sx) / n;
+            }
+            if (slope < 0)
+                slope = 0;
+            if (intercept < 0)
+                intercept = 0;
+        }
+    };
+};
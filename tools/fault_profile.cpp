@@ -0,0 +1,340 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "cost_model.h"
+#include "trace_file.h"
+
+// Access-pattern profile of a traced run (make trace). For every allocation
+// it reports working set, stride, reuse distance, host/device sharing and
+// ping-pong, then recommends the mode and batch size with the lowest
+// predicted migration cost.
+//   ./fault_profile fsrf_trace.0.bin [fsrf_trace.1.bin ...]
+//
+// Faults are only seen at the granularity the traced mode migrates at, so
+// profile with -m inv_read -s 1 to see every page the device touches.
+// Faults outside fsrf_malloc'd memory are grouped into regions of nearby pages.
+
+const char *mode_names[4] = {"inv_read", "inv_write", "mmap", "managed"};
+const uint64_t max_batch = 512;
+const uint64_t region_gap = 512; // pages between unrelated regions
+
+struct Access
+{
+    uint64_t vpn;
+    bool device;
+    bool write;
+    double time_us;
+};
+
+struct Region
+{
+    uint64_t addr;
+    uint64_t size;
+    bool vme;
+    std::vector<Access> accesses;
+};
+
+struct Choice
+{
+    int mode;
+    uint64_t batch;
+    double cost_us;
+};
+
+// Distinct pages touched between two device faults on the same page
+static std::vector<uint64_t> reuse_distances(const std::vector<uint64_t> &vpns)
+{
+    // Fenwick tree over positions, a 1 marks the latest access of some page
+    std::vector<int64_t> tree(vpns.size() + 1, 0);
+    auto update = [&](uint64_t i, int64_t delta) {
+        for (++i; i < tree.size(); i += i & -i)
+            tree[i] += delta;
+    };
+    auto prefix = [&](uint64_t i) {
+        int64_t sum = 0;
+        for (; i > 0; i -= i & -i)
+            sum += tree[i];
+        return sum;
+    };
+
+    std::vector<uint64_t> distances;
+    std::unordered_map<uint64_t, uint64_t> last;
+    for (uint64_t i = 0; i < vpns.size(); ++i)
+    {
+        auto it = last.find(vpns[i]);
+        if (it != last.end())
+        {
+            distances.push_back(prefix(i) - prefix(it->second + 1));
+            update(it->second, -1);
+        }
+        update(i, 1);
+        last[vpns[i]] = i;
+    }
+    return distances;
+}
+
+static uint64_t percentile(std::vector<uint64_t> values, double p)
+{
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (uint64_t)(p / 100 * values.size()))];
+}
+
+// Predicted cost of inv_read, inv_write, mmap and managed -s 1..512 for one region
+static std::vector<Choice> region_costs(const Region &region, const CostModel &model, bool print)
+{
+    std::unordered_set<uint64_t> device_pages, host_pages, written;
+    std::vector<uint64_t> device_vpns;
+    uint64_t faults[2][2] = {{0, 0}, {0, 0}}; // [device][write]
+    for (const Access &a : region.accesses)
+    {
+        faults[a.device][a.write] += 1;
+        if (a.device)
+        {
+            device_pages.insert(a.vpn);
+            device_vpns.push_back(a.vpn);
+            if (a.write)
+                written.insert(a.vpn);
+        }
+        else
+        {
+            host_pages.insert(a.vpn);
+        }
+    }
+
+    // host faults on device pages, and device faults on pages the host took back
+    uint64_t host_pulls = 0, host_pulls_written = 0, ping_pongs = 0, ping_pongs_written = 0;
+    std::unordered_set<uint64_t> on_host;
+    for (const Access &a : region.accesses)
+    {
+        if (!a.device && device_pages.count(a.vpn))
+        {
+            host_pulls += 1;
+            host_pulls_written += written.count(a.vpn);
+            on_host.insert(a.vpn);
+        }
+        else if (a.device && on_host.erase(a.vpn))
+        {
+            ping_pongs += 1;
+            ping_pongs_written += written.count(a.vpn);
+        }
+    }
+
+    uint64_t shared = 0;
+    for (uint64_t vpn : host_pages)
+        shared += device_pages.count(vpn);
+
+    // most common distance between consecutive device faults
+    std::map<int64_t, uint64_t> strides;
+    for (uint64_t i = 1; i < device_vpns.size(); ++i)
+        strides[(int64_t)(device_vpns[i] - device_vpns[i - 1])] += 1;
+    auto stride = std::max_element(strides.begin(), strides.end(),
+                                   [](const std::pair<const int64_t, uint64_t> &a,
+                                      const std::pair<const int64_t, uint64_t> &b) { return a.second < b.second; });
+
+    std::vector<uint64_t> reuse = reuse_distances(device_vpns);
+    uint64_t pages = region.size >> 12;
+    double span_us = region.accesses.empty() ? 0 : region.accesses.back().time_us - region.accesses.front().time_us;
+
+    std::vector<Choice> costs;
+    uint64_t d = device_pages.size();
+    costs.push_back({0, 1, (d + ping_pongs) * model.migrate(1) + host_pulls * model.evict(1)});
+    costs.push_back({1, 1, (d + ping_pongs_written) * model.migrate(1) + written.size() * (model.fault_us + model.tlb_write_us + model.mprotect_us) + host_pulls_written * model.evict(1)});
+    costs.push_back({2, 1, pages * model.tlb_write_us + model.dma(pages) + (written.empty() ? 0 : model.dma(pages))});
+
+    std::vector<std::string> batch_lines;
+    for (uint64_t batch = 1; batch <= max_batch; batch <<= 1)
+    {
+        // replay at batch granularity
+        std::unordered_set<uint64_t> batches, pulled;
+        uint64_t migrations = 0, evictions = 0;
+        for (const Access &a : region.accesses)
+        {
+            uint64_t b = a.vpn / batch;
+            if (a.device && (batches.insert(b).second || pulled.erase(b)))
+                migrations += 1;
+            else if (!a.device && batches.count(b) && pulled.insert(b).second)
+                evictions += 1;
+        }
+        costs.push_back({3, batch, migrations * model.migrate(batch) + evictions * model.evict(batch)});
+
+        if (print)
+        {
+            std::ostringstream line;
+            line << "  managed -s " << std::setw(3) << batch << ": " << std::setw(6) << std::setprecision(3)
+                 << (batches.empty() ? 0.0 : 100.0 * d / (batches.size() * batch)) << "% of migrated pages used, "
+                 << migrations << " migrations, " << evictions << " evictions";
+            batch_lines.push_back(line.str());
+        }
+    }
+
+    if (!print)
+        return costs;
+
+    std::cout << (region.vme ? "VME " : "REGION ") << (void *)region.addr << " (" << pages << " pages)\n";
+    std::cout << "  device faults: " << faults[1][0] << " read, " << faults[1][1] << " write\n";
+    std::cout << "  host faults: " << faults[0][0] << " read, " << faults[0][1] << " write\n";
+    std::cout << "  working set: " << d << " device pages (" << std::setprecision(3)
+              << (pages ? 100.0 * d / pages : 0.0) << "%), " << written.size() << " written\n";
+    if (stride != strides.end())
+        std::cout << "  stride: " << stride->first << " pages for " << std::setprecision(3)
+                  << 100.0 * stride->second / (device_vpns.size() - 1) << "% of faults\n";
+    if (!reuse.empty())
+        std::cout << "  reuse distance: " << reuse.size() << " refaults, p50 " << percentile(reuse, 50)
+                  << " pages, p90 " << percentile(reuse, 90) << " pages\n";
+    std::cout << "  sharing: " << shared << " pages touched by host and device, " << host_pulls << " pulled back\n";
+    std::cout << "  ping-pong: " << ping_pongs << " (" << std::setprecision(3)
+              << (d ? 100.0 * ping_pongs / (d + ping_pongs) : 0.0) << "% of device faults";
+    if (span_us > 0)
+        std::cout << ", " << ping_pongs / span_us * 1e6 << "/s";
+    std::cout << ")\n";
+    for (const std::string &line : batch_lines)
+        std::cout << line << "\n";
+
+    auto best = std::min_element(costs.begin(), costs.end(),
+                                 [](const Choice &a, const Choice &b) { return a.cost_us < b.cost_us; });
+    std::cout << "  recommended: -m " << mode_names[best->mode];
+    if (best->mode == 3)
+        std::cout << " -s " << best->batch;
+    std::cout << ", predicted migration cost " << std::setprecision(6) << best->cost_us / 1000 << " ms\n";
+    if (!region.vme && best->mode >= 2)
+        std::cout << "  (needs the allocation to come from fsrf_malloc / fsrf_malloc_managed)\n";
+    std::cout << "\n";
+    return costs;
+}
+
+static void profile_app(const std::vector<TraceEvent> &events, uint64_t app_id)
+{
+    CostModel model;
+    model.fit(events, app_id);
+
+    // allocations live at each point in time
+    std::vector<Region> regions;
+    std::map<uint64_t, uint64_t> live; // addr -> region
+    std::vector<Access> loose;
+    int64_t run_mode = -1;
+    uint64_t run_batch = 0;
+    const TraceEvent *first = nullptr;
+
+    for (const TraceEvent &e : events)
+    {
+        if (e.event.app_id != app_id)
+            continue;
+        if (first == nullptr)
+            first = &e;
+        const trace::Event &ev = e.event;
+        switch (ev.type)
+        {
+        case trace::RUN_CONFIG:
+            run_mode = ev.arg0;
+            run_batch = ev.arg1;
+            break;
+        case trace::VME_ALLOC:
+            live[ev.arg0] = regions.size();
+            regions.push_back({ev.arg0, ev.arg1, true, {}});
+            break;
+        case trace::VME_FREE:
+            live.erase(ev.arg0);
+            break;
+        case trace::DEVICE_FAULT_BEGIN:
+        case trace::HOST_FAULT_BEGIN:
+        {
+            bool device = ev.type == trace::DEVICE_FAULT_BEGIN;
+            uint64_t vpn = device ? ev.arg0 : ev.arg0 >> 12;
+            bool write = device ? !ev.arg1 : ev.arg1;
+            Access access = {vpn, device, write, elapsed_us(*first, e)};
+
+            auto it = live.upper_bound(vpn << 12);
+            if (it != live.begin() && (vpn << 12) < (--it)->first + regions[it->second].size)
+                regions[it->second].accesses.push_back(access);
+            else
+                loose.push_back(access);
+            break;
+        }
+        }
+    }
+
+    // group the remaining faults into regions of nearby pages
+    std::set<uint64_t> loose_vpns;
+    for (const Access &a : loose)
+        loose_vpns.insert(a.vpn);
+    std::map<uint64_t, uint64_t> loose_regions; // first vpn -> region
+    uint64_t prev = 0;
+    for (uint64_t vpn : loose_vpns)
+    {
+        if (loose_regions.empty() || vpn - prev > region_gap)
+        {
+            loose_regions[vpn] = regions.size();
+            regions.push_back({vpn << 12, 0, false, {}});
+        }
+        regions.back().size = (vpn + 1 - (regions.back().addr >> 12)) << 12;
+        prev = vpn;
+    }
+    for (const Access &a : loose)
+        regions[(--loose_regions.upper_bound(a.vpn))->second].accesses.push_back(a);
+
+    std::cout << "APP " << app_id;
+    if (run_mode >= 0 && run_mode < 4)
+        std::cout << ", traced with -m " << mode_names[run_mode] << " -s " << run_batch;
+    std::cout << "\n";
+    model.print(std::cout);
+    std::cout << "\n";
+
+    // one mode and batch size applies to the whole run
+    std::vector<double> totals;
+    std::vector<Choice> choices;
+    for (const Region &region : regions)
+    {
+        // regions only the host touched don't migrate in any mode
+        if (std::none_of(region.accesses.begin(), region.accesses.end(), [](const Access &a) { return a.device; }))
+            continue;
+        std::vector<Choice> costs = region_costs(region, model, true);
+        if (totals.empty())
+        {
+            totals.assign(costs.size(), 0);
+            choices = costs;
+        }
+        for (uint64_t i = 0; i < costs.size(); ++i)
+            totals[i] += costs[i].cost_us;
+    }
+    if (totals.empty())
+    {
+        std::cout << "no faults traced\n\n";
+        return;
+    }
+
+    uint64_t best = std::min_element(totals.begin(), totals.end()) - totals.begin();
+    std::cout << "RECOMMENDED, -m " << mode_names[choices[best].mode];
+    if (choices[best].mode == 3)
+        std::cout << " -s " << choices[best].batch;
+    std::cout << "\nPREDICTED_MIGRATION_MS, " << std::setprecision(6) << totals[best] / 1000 << "\n\n";
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " trace.bin [trace.bin ...]\n";
+        return 1;
+    }
+
+    std::vector<TraceEvent> events;
+    if (!load_traces(argc - 1, argv + 1, events))
+        return 1;
+
+    std::set<uint64_t> apps;
+    for (const TraceEvent &e : events)
+        apps.insert(e.event.app_id);
+    for (uint64_t app_id : apps)
+        profile_app(events, app_id);
+    return 0;
+}
@@ -0,0 +1,444 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../policy.h"
+#include "cost_model.h"
+#include "trace_file.h"
+
+// Replays the faults and syncs of a traced run (make trace) through the
+// runtime's migration policy (policy.h) against a timing model fitted from
+// the same trace, so policies can be compared without a device.
+//   ./fault_replay [-m modes] [-s batches] [-p prefetches] [-c capacities] [-e evictions] trace.bin ...
+// Every option takes a comma separated list and all combinations are
+// replayed. Defaults are the traced mode and batch size, no prefetch and an
+// unlimited device (-c 0). -e is lru or fifo, used once -c pages are resident.
+//
+// Only faulting accesses are traced, so replaying a finer grained policy than
+// the traced one misses accesses; trace with -m inv_read -s 1 for the most
+// faithful replay.
+
+const char *mode_names[4] = {"inv_read", "inv_write", "mmap", "managed"};
+
+enum EVICTION
+{
+    LRU,
+    FIFO,
+};
+const char *eviction_names[2] = {"lru", "fifo"};
+
+struct Config
+{
+    policy::MODE mode;
+    uint64_t batch;
+    uint64_t prefetch;
+    uint64_t capacity; // device pages, 0 for unlimited
+    EVICTION eviction;
+};
+
+struct Result
+{
+    uint64_t device_faults = 0;
+    uint64_t host_faults = 0;
+    uint64_t migrated_pages = 0;
+    uint64_t evicted_pages = 0;
+    double cost_us = 0;
+};
+
+class Replay
+{
+public:
+    Replay(const Config &config, const CostModel &model) : config(config), model(model) {}
+
+    void run(const std::vector<TraceEvent> &events, uint64_t app_id)
+    {
+        // Syncs only show up in MMAP runs, as do MAP_RESERVED decisions
+        // when the device touched a batch no sync had mapped yet. Without
+        // either the run was traced in another mode.
+        assume_syncs = true;
+        for (const TraceEvent &e : events)
+        {
+            const trace::Event &ev = e.event;
+            if (ev.app_id == app_id && (ev.type == trace::SYNC_BEGIN ||
+                                        (ev.type == trace::MODE_DECISION && ev.arg0 == trace::MAP_RESERVED)))
+                assume_syncs = false;
+        }
+
+        for (const TraceEvent &e : events)
+        {
+            const trace::Event &ev = e.event;
+            if (ev.app_id != app_id)
+                continue;
+            switch (ev.type)
+            {
+            case trace::VME_ALLOC:
+                // MMAP only reserves device pages here, see map_reserved
+                vmes[ev.arg0] = ev.arg1;
+                break;
+            case trace::VME_FREE:
+                vmes.erase(ev.arg0);
+                break;
+            case trace::SYNC_BEGIN:
+                if (config.mode == policy::MMAP && vmes.count(ev.arg0))
+                {
+                    // syncs to the device map what they cover, syncs back
+                    // skip the batches the device never used
+                    uint64_t vpn = ev.arg0 >> 12, end = (ev.arg0 + vmes[ev.arg0]) >> 12;
+                    if (ev.arg1)
+                        map_reserved(vpn, end);
+                    result.cost_us += model.dma(ev.arg1 ? end - vpn : mapped_pages(vpn, end));
+                }
+                break;
+            case trace::DEVICE_FAULT_BEGIN:
+                device_access(ev.arg0, ev.arg1);
+                break;
+            case trace::HOST_FAULT_BEGIN:
+                host_access(ev.arg0 >> 12, ev.arg1);
+                break;
+            }
+        }
+
+        // assume one sync each way of what the device used, the first one
+        // mapping it
+        if (config.mode == policy::MMAP && assume_syncs)
+            result.cost_us += model.tlb_run(mmap_touched.size()) + model.dma(mmap_touched.size()) * (mmap_written ? 2 : 1);
+    }
+
+    Result result;
+
+private:
+    Config config;
+    const CostModel &model;
+    std::map<uint64_t, uint64_t> vmes; // addr -> size
+
+    std::unordered_map<uint64_t, bool> device; // resident vpn -> writeable
+    std::unordered_map<uint64_t, int> host_prot;
+    bool assume_syncs = false;
+    std::set<uint64_t> mmap_touched;
+    bool mmap_written = false;
+    std::set<uint64_t> mmap_mapped; // first vpn of each mapped MMAP batch
+
+    // migrated ranges, oldest or least recently used first
+    std::list<std::pair<uint64_t, uint64_t>> ranges;
+    std::unordered_map<uint64_t, std::list<std::pair<uint64_t, uint64_t>>::iterator> range_of;
+
+    // end of the VME holding vpn, or ~0 for memory fsrf didn't allocate
+    uint64_t vme_end(uint64_t vpn)
+    {
+        auto it = vmes.upper_bound(vpn << 12);
+        if (it == vmes.begin() || (vpn << 12) >= (--it)->first + it->second)
+            return ~0ULL;
+        return (it->first + it->second) >> 12;
+    }
+
+    // first vpn of the batch holding vpn, batches tile a VME from its start
+    uint64_t batch_start(uint64_t vpn)
+    {
+        auto it = vmes.upper_bound(vpn << 12);
+        if (it == vmes.begin() || (vpn << 12) >= (--it)->first + it->second)
+            return vpn;
+        uint64_t first = it->first >> 12;
+        return first + (vpn - first) / config.batch * config.batch;
+    }
+
+    // Maps the batches of [vpn, end) that aren't mapped yet onto their
+    // reserved device pages, each run of them as one TLB run
+    void map_reserved(uint64_t vpn, uint64_t end)
+    {
+        uint64_t run = 0;
+        for (uint64_t batch = batch_start(vpn); batch < end; batch += config.batch)
+        {
+            if (mmap_mapped.insert(batch).second)
+            {
+                run += std::min(config.batch, end - batch);
+                continue;
+            }
+            result.cost_us += model.tlb_run(run);
+            run = 0;
+        }
+        result.cost_us += model.tlb_run(run);
+    }
+
+    uint64_t mapped_pages(uint64_t vpn, uint64_t end)
+    {
+        uint64_t pages = 0;
+        for (auto it = mmap_mapped.lower_bound(vpn); it != mmap_mapped.end() && *it < end; ++it)
+            pages += std::min(config.batch, end - *it);
+        return pages;
+    }
+
+    void touch(uint64_t vpn)
+    {
+        auto it = range_of.find(vpn);
+        if (config.eviction == LRU && it != range_of.end())
+            ranges.splice(ranges.end(), ranges, it->second);
+    }
+
+    void evict_oldest()
+    {
+        auto victim = ranges.begin();
+        uint64_t pages = 0;
+        for (uint64_t vpn = victim->first; vpn < victim->first + victim->second; ++vpn)
+        {
+            // pages the host took back or a later range migrated again
+            auto it = range_of.find(vpn);
+            if (it == range_of.end() || it->second != victim)
+                continue;
+            range_of.erase(it);
+            device.erase(vpn);
+            host_prot.erase(vpn);
+            pages += 1;
+        }
+        ranges.erase(victim);
+        if (pages == 0)
+            return;
+        result.evicted_pages += pages;
+        result.cost_us += model.evict(pages);
+    }
+
+    void device_access(uint64_t vpn, bool read)
+    {
+        if (config.mode == policy::MMAP)
+        {
+            if (assume_syncs)
+            {
+                mmap_touched.insert(vpn);
+                mmap_written |= !read;
+                return;
+            }
+            // the first touch of a batch no sync mapped faults and maps it,
+            // nothing is copied
+            uint64_t end = vme_end(vpn), batch = batch_start(vpn);
+            if (end == ~0ULL || mmap_mapped.count(batch))
+                return;
+            result.device_faults += 1;
+            result.cost_us += model.fault_us;
+            map_reserved(batch, std::min(batch + config.batch, end));
+            return;
+        }
+
+        auto it = device.find(vpn);
+        bool resident = it != device.end();
+        if (resident && (read || it->second))
+        {
+            touch(vpn);
+            return;
+        }
+
+        policy::DevicePlan plan = policy::plan_device_fault(config.mode, read, vpn, resident, config.batch, config.prefetch);
+        if (!plan.valid)
+            return;
+        if (plan.needs_vme)
+            plan.pages = std::min(plan.pages, vme_end(vpn) - plan.vpn);
+
+        result.device_faults += 1;
+        result.cost_us += model.fault_us;
+        if (plan.prot_before_copy != policy::KEEP_PROT)
+        {
+            result.cost_us += model.mprotect_us;
+            set_host_prot(plan.vpn, plan.pages, plan.prot_before_copy);
+        }
+        if (plan.copy)
+        {
+            while (config.capacity != 0 && !ranges.empty() && device.size() + plan.pages > config.capacity)
+                evict_oldest();
+            ranges.push_back(std::make_pair(plan.vpn, plan.pages));
+            for (uint64_t page = plan.vpn; page < plan.vpn + plan.pages; ++page)
+            {
+                device[page] = false;
+                range_of[page] = --ranges.end();
+            }
+            result.migrated_pages += plan.pages;
+            result.cost_us += model.dma(plan.pages);
+        }
+        if (plan.prot_after_copy != policy::KEEP_PROT)
+        {
+            result.cost_us += model.mprotect_us;
+            set_host_prot(plan.vpn, plan.pages, plan.prot_after_copy);
+        }
+        if (plan.map)
+        {
+            for (uint64_t page = plan.vpn; page < plan.vpn + plan.pages; ++page)
+                device[page] = plan.writeable;
+            result.cost_us += plan.pages * model.tlb_write_us;
+        }
+    }
+
+    void host_access(uint64_t vpn, bool write)
+    {
+        auto prot = host_prot.find(vpn);
+        if (prot == host_prot.end() || (prot->second & (write ? PROT_WRITE : PROT_READ)))
+            return;
+        if (device.find(vpn) == device.end())
+            return;
+
+        policy::HostPlan plan = policy::plan_host_fault(config.mode, write, vpn, config.batch);
+        if (!plan.valid)
+            return;
+
+        uint64_t pages = 0;
+        for (uint64_t page = plan.vpn; page < plan.vpn + plan.pages; ++page)
+        {
+            auto it = device.find(page);
+            if (it == device.end())
+                continue;
+            pages += 1;
+            if (plan.device_keeps)
+            {
+                it->second = false;
+            }
+            else
+            {
+                device.erase(it);
+                range_of.erase(page);
+            }
+            host_prot[page] = plan.prot;
+        }
+        result.host_faults += 1;
+        result.cost_us += model.evict(pages) + (plan.prot != (PROT_READ | PROT_WRITE) ? model.mprotect_us : 0);
+    }
+
+    void set_host_prot(uint64_t vpn, uint64_t pages, int prot)
+    {
+        for (uint64_t page = vpn; page < vpn + pages; ++page)
+            host_prot[page] = prot;
+    }
+};
+
+// Time the traced run spent handling faults and syncs
+static double measured_us(const std::vector<TraceEvent> &events, uint64_t app_id)
+{
+    std::map<std::pair<uint32_t, uint16_t>, const TraceEvent *> open;
+    double total = 0;
+    for (const TraceEvent &e : events)
+    {
+        const trace::Event &ev = e.event;
+        if (ev.app_id != app_id)
+            continue;
+        switch (ev.type)
+        {
+        case trace::DEVICE_FAULT_BEGIN:
+        case trace::HOST_FAULT_BEGIN:
+        case trace::SYNC_BEGIN:
+            open[std::make_pair(ev.thread, ev.type)] = &e;
+            break;
+        case trace::DEVICE_FAULT_END:
+        case trace::HOST_FAULT_END:
+        case trace::SYNC_END:
+        {
+            auto it = open.find(std::make_pair(ev.thread, (uint16_t)(ev.type - 1)));
+            if (it != open.end() && it->second != nullptr)
+            {
+                total += elapsed_us(*it->second, e);
+                it->second = nullptr;
+            }
+            break;
+        }
+        }
+    }
+    return total;
+}
+
+static std::vector<std::string> split(const char *list)
+{
+    std::vector<std::string> items;
+    std::stringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ','))
+        items.push_back(item);
+    return items;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> modes, batches, prefetches, capacities, evictions;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        std::vector<std::string> values = split(argv[arg + 1]);
+        if (!strcmp(argv[arg], "-m"))
+            modes = values;
+        else if (!strcmp(argv[arg], "-s"))
+            batches = values;
+        else if (!strcmp(argv[arg], "-p"))
+            prefetches = values;
+        else if (!strcmp(argv[arg], "-c"))
+            capacities = values;
+        else if (!strcmp(argv[arg], "-e"))
+            evictions = values;
+        else
+            break;
+    }
+    if (arg >= argc)
+    {
+        std::cerr << "usage: " << argv[0] << " [-m modes] [-s batches] [-p prefetches] [-c capacities] [-e lru|fifo] trace.bin ...\n";
+        return 1;
+    }
+
+    std::vector<TraceEvent> events;
+    if (!load_traces(argc - arg, argv + arg, events))
+        return 1;
+
+    std::set<uint64_t> apps;
+    for (const TraceEvent &e : events)
+        apps.insert(e.event.app_id);
+
+    for (uint64_t app_id : apps)
+    {
+        CostModel model;
+        model.fit(events, app_id);
+
+        // traced configuration
+        std::string traced_mode = "inv_read", traced_batch = "1";
+        for (const TraceEvent &e : events)
+        {
+            if (e.event.app_id == app_id && e.event.type == trace::RUN_CONFIG && e.event.arg0 < 4)
+            {
+                traced_mode = mode_names[e.event.arg0];
+                traced_batch = std::to_string(e.event.arg1);
+            }
+        }
+
+        std::cout << "APP " << app_id << ", traced with -m " << traced_mode << " -s " << traced_batch << "\n";
+        model.print(std::cout);
+        std::cout << "MEASURED_MS, " << measured_us(events, app_id) / 1000 << "\n\n";
+        std::cout << "mode,batch,prefetch,capacity,eviction,device_faults,host_faults,migrated_pages,evicted_pages,predicted_ms\n";
+
+        for (const std::string &mode : modes.empty() ? std::vector<std::string>{traced_mode} : modes)
+        for (const std::string &batch : batches.empty() ? std::vector<std::string>{traced_batch} : batches)
+        for (const std::string &prefetch : prefetches.empty() ? std::vector<std::string>{"0"} : prefetches)
+        for (const std::string &capacity : capacities.empty() ? std::vector<std::string>{"0"} : capacities)
+        for (const std::string &eviction : evictions.empty() ? std::vector<std::string>{"lru"} : evictions)
+        {
+            Config config;
+            config.mode = (policy::MODE)(std::find(mode_names, mode_names + 4, mode) - mode_names);
+            config.batch = std::stoull(batch);
+            config.prefetch = std::stoull(prefetch);
+            config.capacity = std::stoull(capacity);
+            config.eviction = eviction == "fifo" ? FIFO : LRU;
+            if (config.mode > policy::MANAGED || config.batch == 0)
+            {
+                std::cerr << "bad mode or batch size: " << mode << " " << batch << "\n";
+                return 1;
+            }
+
+            Replay replay(config, model);
+            replay.run(events, app_id);
+            const Result &r = replay.result;
+            std::cout << mode_names[config.mode] << "," << config.batch << "," << config.prefetch << ","
+                      << config.capacity << "," << eviction_names[config.eviction] << "," << r.device_faults << ","
+                      << r.host_faults << "," << r.migrated_pages << "," << r.evicted_pages << ","
+                      << r.cost_us / 1000 << "\n";
+        }
+        std::cout << "\n";
+    }
+    return 0;
+}
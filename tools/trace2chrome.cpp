@@ -0,0 +1,115 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "trace_file.h"
+
+// Converts one or more binary FSRF traces to the Chrome trace event format,
+// loadable in chrome://tracing or Perfetto.
+//   ./trace2chrome fsrf_trace.0.bin [fsrf_trace.1.bin ...] > trace.json
+
+static const char *names[trace::NUM_TYPES] = {
+    "DEVICE_FAULT",
+    "DEVICE_FAULT",
+    "MODE_DECISION",
+    "DMA",
+    "DMA",
+    "MPROTECT",
+    "MPROTECT",
+    "TLB_WRITE",
+    "HOST_FAULT",
+    "HOST_FAULT",
+    "SYNC",
+    "SYNC",
+    "RUN_CONFIG",
+    "VME_ALLOC",
+    "VME_FREE",
+};
+
+static const char *decisions[] = {"MIGRATE_PAGE", "MIGRATE_BATCH", "UPGRADE_WRITEABLE", "ALREADY_PRESENT", "MAP_RESERVED"};
+
+static char phase(uint16_t type)
+{
+    switch (type)
+    {
+    case trace::DEVICE_FAULT_BEGIN:
+    case trace::DMA_SUBMIT:
+    case trace::MPROTECT_BEGIN:
+    case trace::HOST_FAULT_BEGIN:
+    case trace::SYNC_BEGIN:
+        return 'B';
+    case trace::DEVICE_FAULT_END:
+    case trace::DMA_COMPLETE:
+    case trace::MPROTECT_END:
+    case trace::HOST_FAULT_END:
+    case trace::SYNC_END:
+        return 'E';
+    default:
+        return 'i';
+    }
+}
+
+static std::string args(const trace::Event &e)
+{
+    std::string s;
+    switch (e.type)
+    {
+    case trace::DEVICE_FAULT_BEGIN:
+        return "\"vpn\":" + std::to_string(e.arg0) + ",\"read\":" + std::to_string(e.arg1);
+    case trace::DEVICE_FAULT_END:
+        return "\"ppn\":" + std::to_string(e.arg0) + ",\"valid\":" + std::to_string(e.arg1);
+    case trace::MODE_DECISION:
+        s = e.arg0 < 5 ? decisions[e.arg0] : "UNKNOWN";
+        return "\"decision\":\"" + s + "\",\"pages\":" + std::to_string(e.arg1);
+    case trace::DMA_SUBMIT:
+    case trace::DMA_COMPLETE:
+        return "\"ppn\":" + std::to_string(e.arg0) + ",\"bytes\":" + std::to_string(e.arg1 & ~(1ULL << 63)) +
+               ",\"from_device\":" + std::to_string(e.arg1 >> 63);
+    case trace::MPROTECT_BEGIN:
+    case trace::MPROTECT_END:
+        return "\"addr\":" + std::to_string(e.arg0) + ",\"len\":" + std::to_string(e.arg1 & ((1ULL << 48) - 1)) +
+               ",\"prot\":" + std::to_string(e.arg1 >> 48);
+    case trace::TLB_WRITE:
+        return "\"vpn\":" + std::to_string(e.arg0) + ",\"entry\":" + std::to_string(e.arg1);
+    case trace::HOST_FAULT_BEGIN:
+    case trace::HOST_FAULT_END:
+        return "\"vaddr\":" + std::to_string(e.arg0) + ",\"write\":" + std::to_string(e.arg1);
+    case trace::RUN_CONFIG:
+        return "\"mode\":" + std::to_string(e.arg0) + ",\"batch_pages\":" + std::to_string(e.arg1);
+    case trace::VME_ALLOC:
+    case trace::VME_FREE:
+        return "\"addr\":" + std::to_string(e.arg0) + ",\"size\":" + std::to_string(e.arg1);
+    default:
+        return "\"addr\":" + std::to_string(e.arg0) + ",\"to_device\":" + std::to_string(e.arg1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " trace.bin [trace.bin ...]\n";
+        return 1;
+    }
+
+    std::vector<TraceEvent> events;
+    if (!load_traces(argc - 1, argv + 1, events))
+        return 1;
+
+    uint64_t origin = events.empty() ? 0 : events[0].event.tsc;
+    std::cout << "{\"traceEvents\":[\n";
+    for (uint64_t i = 0; i < events.size(); ++i)
+    {
+        const trace::Event &e = events[i].event;
+        char ph = phase(e.type);
+        double ts = (e.tsc - origin) / events[i].cycles_per_ns / 1000;
+
+        std::cout << "{\"name\":\"" << names[e.type] << "\",\"ph\":\"" << ph << "\",\"ts\":" << std::fixed << ts
+                  << ",\"pid\":" << e.app_id << ",\"tid\":" << e.thread;
+        if (ph == 'i')
+            std::cout << ",\"s\":\"t\"";
+        std::cout << ",\"args\":{" << args(e) << "}}" << (i + 1 < events.size() ? ",\n" : "\n");
+    }
+    std::cout << "]}\n";
+    return 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "../trace.h"
+
+// Reading side of trace::dump, shared by the trace tools
+
+struct TraceEvent
+{
+    trace::Event event;
+    double cycles_per_ns; // of the file the event came from
+};
+
+// Appends the events of one dump file to out, false on a bad file
+inline bool load_trace(const char *path, std::vector<TraceEvent> &out)
+{
+    std::ifstream in(path, std::ios::binary);
+    trace::FileHeader header;
+    if (!in.read((char *)&header, sizeof(header)) || header.magic != trace::magic)
+    {
+        std::cerr << path << ": not an FSRF trace\n";
+        return false;
+    }
+
+    TraceEvent loaded;
+    loaded.cycles_per_ns = header.cycles_per_ns;
+    for (uint64_t i = 0; i < header.num_events; ++i)
+    {
+        if (!in.read((char *)&loaded.event, sizeof(trace::Event)))
+        {
+            std::cerr << path << ": truncated after " << i << " events\n";
+            return false;
+        }
+        if (loaded.event.type < trace::NUM_TYPES)
+            out.push_back(loaded);
+    }
+    return true;
+}
+
+// Loads every file and orders all events by time
+inline bool load_traces(int num_paths, char **paths, std::vector<TraceEvent> &out)
+{
+    for (int i = 0; i < num_paths; ++i)
+    {
+        if (!load_trace(paths[i], out))
+            return false;
+    }
+    std::stable_sort(out.begin(), out.end(),
+                     [](const TraceEvent &a, const TraceEvent &b) { return a.event.tsc < b.event.tsc; });
+    return true;
+}
+
+// Microseconds between two events of the same trace
+inline double elapsed_us(const TraceEvent &from, const TraceEvent &to)
+{
+    return (double)(int64_t)(to.event.tsc - from.event.tsc) / from.cycles_per_ns / 1000;
+}
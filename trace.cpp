@@ -0,0 +1,63 @@
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "perf.h"
+#include "trace.h"
+
+namespace trace
+{
+    // Rings outlive their threads so late dumps still see every event
+    static std::mutex registry_lock;
+    static std::vector<Ring *> rings;
+
+    Ring *register_thread()
+    {
+        static const char *env = getenv("FSRF_TRACE_EVENTS");
+        static const uint64_t capacity = env != NULL && atoll(env) > 0 ? atoll(env) : ring_events;
+
+        Ring *ring = new Ring;
+        ring->head = 0;
+        ring->capacity = capacity;
+        ring->events = new Event[capacity];
+
+        const std::lock_guard<std::mutex> guard(registry_lock);
+        ring->thread = rings.size();
+        rings.push_back(ring);
+        return ring;
+    }
+
+    int64_t dump(const char *path, uint64_t app_id)
+    {
+        std::vector<Event> events;
+        {
+            const std::lock_guard<std::mutex> guard(registry_lock);
+            for (Ring *ring : rings)
+            {
+                uint64_t head = ring->head.load(std::memory_order_acquire);
+                uint64_t tail = head > ring->capacity ? head - ring->capacity : 0;
+                for (uint64_t i = tail; i < head; ++i)
+                {
+                    const Event &event = ring->events[i % ring->capacity];
+                    if (event.app_id == app_id)
+                        events.push_back(event);
+                }
+            }
+        }
+
+        FILE *fp = fopen(path, "w");
+        if (fp == NULL)
+        {
+            perror("trace dump");
+            return -1;
+        }
+
+        FileHeader header = {magic, perf::cycles_per_ns(), events.size()};
+        bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+        if (!events.empty())
+            ok = ok && fwrite(events.data(), sizeof(Event), events.size(), fp) == events.size();
+        ok = fclose(fp) == 0 && ok;
+        return ok ? (int64_t)events.size() : -1;
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <x86intrin.h>
+
+// Binary event trace. Every thread appends fixed size events to its own
+// ring buffer with no locks or atomics beyond a release store of the head;
+// dump() snapshots all rings into a file that tools/trace2chrome converts to
+// Chrome trace JSON and tools/fault_profile analyses. Rings keep the most
+// recent ring_events per thread, or FSRF_TRACE_EVENTS if set.
+namespace trace
+{
+    const uint64_t magic = 0x3143525446525346; // "FSRFTRC1"
+    const uint64_t ring_events = 1 << 16;
+
+    enum TYPE : uint16_t
+    {
+        DEVICE_FAULT_BEGIN = 0, // vpn, read
+        DEVICE_FAULT_END = 1,   // ppn, valid
+        MODE_DECISION = 2,      // DECISION, pages
+        DMA_SUBMIT = 3,         // ppn, bytes | from_device << 63
+        DMA_COMPLETE = 4,       // ppn, bytes | from_device << 63
+        MPROTECT_BEGIN = 5,     // addr, len | prot << 48
+        MPROTECT_END = 6,       // addr, len | prot << 48
+        TLB_WRITE = 7,          // vpn, entry
+        HOST_FAULT_BEGIN = 8,   // vaddr, write
+        HOST_FAULT_END = 9,     // vaddr, write
+        SYNC_BEGIN = 10,        // addr, to_device
+        SYNC_END = 11,          // addr, to_device
+        RUN_CONFIG = 12,        // FSRF::MODE, batch pages
+        VME_ALLOC = 13,         // addr, size
+        VME_FREE = 14,          // addr, size
+
+        NUM_TYPES
+    };
+
+    // What a device fault handler chose to do, argument of MODE_DECISION
+    enum DECISION : uint64_t
+    {
+        MIGRATE_PAGE = 0,      // copy one page to the device
+        MIGRATE_BATCH = 1,     // copy a whole batch to the device
+        UPGRADE_WRITEABLE = 2, // already on the device, make it writeable
+        ALREADY_PRESENT = 3,   // already on the device
+        MAP_RESERVED = 4,      // map a batch of an MMAP allocation, no copy
+    };
+
+    struct Event
+    {
+        uint64_t tsc;
+        uint64_t arg0;
+        uint64_t arg1;
+        uint16_t type;
+        uint16_t app_id;
+        uint32_t thread;
+    };
+
+    struct FileHeader
+    {
+        uint64_t magic;
+        double cycles_per_ns;
+        uint64_t num_events;
+    };
+
+    struct Ring
+    {
+        std::atomic<uint64_t> head;
+        uint32_t thread;
+        uint64_t capacity;
+        Event *events;
+    };
+
+    Ring *register_thread();
+
+    inline void emit(uint64_t app_id, TYPE type, uint64_t arg0, uint64_t arg1)
+    {
+        static thread_local Ring *ring = nullptr;
+        if (ring == nullptr)
+            ring = register_thread();
+
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        Event &event = ring->events[head % ring->capacity];
+        event.tsc = __rdtsc();
+        event.arg0 = arg0;
+        event.arg1 = arg1;
+        event.type = type;
+        event.app_id = app_id;
+        event.thread = ring->thread;
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+
+    // Write the events of one app slot from every thread to path,
+    // returns the number of events written or -1
+    int64_t dump(const char *path, uint64_t app_id);
+}